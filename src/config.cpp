@@ -21,16 +21,56 @@
 #include <assert.h>
 #include <stdint.h>  // uint32_t
 #include <syslog.h>
+#include <algorithm>  // std::copy
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <libconfig.h++>
+#include <vector>
 #include "input-common.h"  // input_t
 #include "rtl_airband.h"
+#include "scan_planner.h"
 
 using namespace std;
 
+static void output_error_prefix(int i, int j, int o, bool parsing_mixers) {
+    if (parsing_mixers) {
+        cerr << "Configuration error: mixers.[" << i << "] outputs.[" << o << "]: ";
+    } else {
+        cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] outputs.[" << o << "]: ";
+    }
+}
+
+// lossless codecs are only allowed for file outputs
+static enum audio_codecs parse_codec(libconfig::Setting& out, int i, int j, int o, bool parsing_mixers, bool lossless) {
+    if (!out.exists("codec") || !strcmp(out["codec"], "mp3")) {
+        return AC_MP3;
+    }
+    if (!strcmp(out["codec"], "vorbis")) {
+        return AC_VORBIS;
+    }
+    if (lossless && !strcmp(out["codec"], "wav")) {
+        return AC_WAV;
+    }
+#ifdef WITH_FLAC
+    if (lossless && !strcmp(out["codec"], "flac")) {
+        return AC_FLAC;
+    }
+#endif /* WITH_FLAC */
+    output_error_prefix(i, j, o, parsing_mixers);
+    cerr << "invalid value for codec; must be one of: mp3, vorbis";
+    if (lossless) {
+        cerr << ", wav";
+#ifdef WITH_FLAC
+        cerr << ", flac";
+#endif /* WITH_FLAC */
+    }
+    cerr << "\n";
+    error();
+    return AC_MP3;
+}
+
 static int parse_outputs(libconfig::Setting& outs, channel_t* channel, int i, int j, bool parsing_mixers) {
     int oo = 0;
     for (int o = 0; o < channel->output_count; o++) {
@@ -70,20 +110,12 @@ static int parse_outputs(libconfig::Setting& outs, channel_t* channel, int i, in
                     } else if (!strcmp(outs[o]["tls"], "disabled")) {
                         idata->tls_mode = SHOUT_TLS_DISABLED;
                     } else {
-                        if (parsing_mixers) {
-                            cerr << "Configuration error: mixers.[" << i << "] outputs.[" << o << "]: ";
-                        } else {
-                            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] outputs.[" << o << "]: ";
-                        }
+                        output_error_prefix(i, j, o, parsing_mixers);
                         cerr << "invalid value for tls; must be one of: auto, auto_no_plain, transport, upgrade, disabled\n";
                         error();
                     }
                 } else {
-                    if (parsing_mixers) {
-                        cerr << "Configuration error: mixers.[" << i << "] outputs.[" << o << "]: ";
-                    } else {
-                        cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] outputs.[" << o << "]: ";
-                    }
+                    output_error_prefix(i, j, o, parsing_mixers);
                     cerr << "tls value must be a string\n";
                     error();
                 }
@@ -91,7 +123,12 @@ static int parse_outputs(libconfig::Setting& outs, channel_t* channel, int i, in
                 idata->tls_mode = SHOUT_TLS_DISABLED;
             }
 #endif /* LIBSHOUT_HAS_TLS */
-            channel->need_mp3 = 1;
+            idata->codec = parse_codec(outs[o], i, j, o, parsing_mixers, false);
+            if (idata->codec == AC_VORBIS) {
+                channel->need_vorbis = 1;
+            } else {
+                channel->need_mp3 = 1;
+            }
         } else if (!strncmp(outs[o]["type"], "file", 4)) {
             channel->outputs[oo].data = XCALLOC(1, sizeof(struct file_data));
             channel->outputs[oo].type = O_FILE;
@@ -99,39 +136,71 @@ static int parse_outputs(libconfig::Setting& outs, channel_t* channel, int i, in
 
             fdata->type = O_FILE;
             if (!outs[o].exists("directory") || !outs[o].exists("filename_template")) {
-                if (parsing_mixers) {
-                    cerr << "Configuration error: mixers.[" << i << "] outputs.[" << o << "]: ";
-                } else {
-                    cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] outputs.[" << o << "]: ";
-                }
+                output_error_prefix(i, j, o, parsing_mixers);
                 cerr << "both directory and filename_template required for file\n";
                 error();
             }
             fdata->basedir = outs[o]["directory"].c_str();
             fdata->basename = outs[o]["filename_template"].c_str();
             fdata->dated_subdirectories = outs[o].exists("dated_subdirectories") ? (bool)(outs[o]["dated_subdirectories"]) : false;
-            fdata->suffix = ".mp3";
+            fdata->codec = parse_codec(outs[o], i, j, o, parsing_mixers, true);
+            if (fdata->codec == AC_VORBIS) {
+                fdata->suffix = ".ogg";
+                channel->need_vorbis = 1;
+            } else if (fdata->codec == AC_WAV) {
+                fdata->suffix = ".wav";
+                channel->need_pcm = 1;
+            } else if (fdata->codec == AC_FLAC) {
+                fdata->suffix = ".flac";
+                channel->need_pcm = 1;
+            } else {
+                fdata->suffix = ".mp3";
+                channel->need_mp3 = 1;
+            }
 
             fdata->continuous = outs[o].exists("continuous") ? (bool)(outs[o]["continuous"]) : false;
-            fdata->append = (!outs[o].exists("append")) || (bool)(outs[o]["append"]);
+            if (fdata->codec == AC_FLAC) {
+                // a FLAC stream can't be continued
+                if (outs[o].exists("append") && (bool)(outs[o]["append"])) {
+                    output_error_prefix(i, j, o, parsing_mixers);
+                    cerr << "append is not supported for flac files\n";
+                    error();
+                }
+                fdata->append = false;
+            } else {
+                fdata->append = (!outs[o].exists("append")) || (bool)(outs[o]["append"]);
+            }
             fdata->split_on_transmission = outs[o].exists("split_on_transmission") ? (bool)(outs[o]["split_on_transmission"]) : false;
             fdata->include_freq = outs[o].exists("include_freq") ? (bool)(outs[o]["include_freq"]) : false;
-            channel->need_mp3 = 1;
 
             if (fdata->split_on_transmission) {
                 if (parsing_mixers) {
-                    cerr << "Configuration error: mixers.[" << i << "] outputs.[" << o << "]: split_on_transmission is not allowed for mixers\n";
+                    output_error_prefix(i, j, o, parsing_mixers);
+                    cerr << "split_on_transmission is not allowed for mixers\n";
                     error();
                 }
                 if (fdata->continuous) {
-                    cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] outputs.[" << o << "]: can't have both continuous and split_on_transmission\n";
+                    output_error_prefix(i, j, o, parsing_mixers);
+                    cerr << "can't have both continuous and split_on_transmission\n";
                     error();
                 }
             }
+            fdata->pre_trigger_ms = outs[o].exists("pre_trigger_ms") ? (int)(outs[o]["pre_trigger_ms"]) : 0;
+            if (fdata->pre_trigger_ms < 0 || fdata->pre_trigger_ms > MAX_PRE_TRIGGER_MS) {
+                output_error_prefix(i, j, o, parsing_mixers);
+                cerr << "pre_trigger_ms must be between 0 and " << MAX_PRE_TRIGGER_MS << "\n";
+                error();
+            }
+            if (fdata->pre_trigger_ms > 0 && fdata->continuous) {
+                output_error_prefix(i, j, o, parsing_mixers);
+                cerr << "can't have both continuous and pre_trigger_ms\n";
+                error();
+            }
 
         } else if (!strncmp(outs[o]["type"], "rawfile", 7)) {
             if (parsing_mixers) {  // rawfile outputs not allowed for mixers
-                cerr << "Configuration error: mixers.[" << i << "] outputs[" << o << "]: rawfile output is not allowed for mixers\n";
+                output_error_prefix(i, j, o, parsing_mixers);
+                cerr << "rawfile output is not allowed for mixers\n";
                 error();
             }
             channel->outputs[oo].data = XCALLOC(1, sizeof(struct file_data));
@@ -140,7 +209,8 @@ static int parse_outputs(libconfig::Setting& outs, channel_t* channel, int i, in
 
             fdata->type = O_RAWFILE;
             if (!outs[o].exists("directory") || !outs[o].exists("filename_template")) {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] outputs.[" << o << "]: both directory and filename_template required for file\n";
+                output_error_prefix(i, j, o, parsing_mixers);
+                cerr << "both directory and filename_template required for file\n";
                 error();
             }
 
@@ -156,33 +226,40 @@ static int parse_outputs(libconfig::Setting& outs, channel_t* channel, int i, in
             channel->needs_raw_iq = channel->has_iq_outputs = 1;
 
             if (fdata->continuous && fdata->split_on_transmission) {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] outputs.[" << o << "]: can't have both continuous and split_on_transmission\n";
+                output_error_prefix(i, j, o, parsing_mixers);
+                cerr << "can't have both continuous and split_on_transmission\n";
                 error();
             }
         } else if (!strncmp(outs[o]["type"], "mixer", 5)) {
-            if (parsing_mixers) {  // mixer outputs not allowed for mixers
-                cerr << "Configuration error: mixers.[" << i << "] outputs.[" << o << "]: mixer output is not allowed for mixers\n";
-                error();
-            }
+            // on a mixer, this makes it a sub-mix feeding another mixer
             channel->outputs[oo].data = XCALLOC(1, sizeof(struct mixer_data));
             channel->outputs[oo].type = O_MIXER;
             mixer_data* mdata = (mixer_data*)(channel->outputs[oo].data);
+            mdata->from_mixer = parsing_mixers;
             const char* name = (const char*)outs[o]["name"];
             if ((mdata->mixer = getmixerbyname(name)) == NULL) {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] outputs.[" << o << "]: unknown mixer \"" << name << "\"\n";
+                output_error_prefix(i, j, o, parsing_mixers);
+                cerr << "unknown mixer \"" << name << "\"\n";
                 error();
             }
             float ampfactor = outs[o].exists("ampfactor") ? (float)outs[o]["ampfactor"] : 1.0f;
             float balance = outs[o].exists("balance") ? (float)outs[o]["balance"] : 0.0f;
             if (balance < -1.0f || balance > 1.0f) {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] outputs.[" << o << "]: balance out of allowed range <-1.0;1.0>\n";
+                output_error_prefix(i, j, o, parsing_mixers);
+                cerr << "balance out of allowed range <-1.0;1.0>\n";
                 error();
             }
-            if ((mdata->input = mixer_connect_input(mdata->mixer, ampfactor, balance)) < 0) {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] outputs.[" << o
-                     << "]: "
-                        "could not connect to mixer "
-                     << name << ": " << mixer_get_error() << "\n";
+            int jitter_buffer = outs[o].exists("jitter_buffer") ? (int)outs[o]["jitter_buffer"] : DEFAULT_MIX_INPUT_SLOTS;
+            if (jitter_buffer < 1 || jitter_buffer > MAX_MIX_INPUT_SLOTS) {
+                output_error_prefix(i, j, o, parsing_mixers);
+                cerr << "jitter_buffer out of allowed range (1-" << MAX_MIX_INPUT_SLOTS << ")\n";
+                error();
+            }
+            bool drift_compensation = outs[o].exists("drift_compensation") ? (bool)outs[o]["drift_compensation"] : false;
+            // a sub-mix without a configured rate passes it on once settled by mixer_setup()
+            if ((mdata->input = mixer_connect_input(mdata->mixer, ampfactor, balance, channel->wave_rate, jitter_buffer, drift_compensation)) < 0) {
+                output_error_prefix(i, j, o, parsing_mixers);
+                cerr << "could not connect to mixer " << name << ": " << mixer_get_error() << "\n";
                 error();
             }
             debug_print("dev[%d].chan[%d].out[%d] connected to mixer %s as input %d (ampfactor=%.1f balance=%.1f)\n", i, j, o, name, mdata->input, ampfactor, balance);
@@ -197,11 +274,7 @@ static int parse_outputs(libconfig::Setting& outs, channel_t* channel, int i, in
             if (outs[o].exists("dest_address")) {
                 sdata->dest_address = strdup(outs[o]["dest_address"]);
             } else {
-                if (parsing_mixers) {
-                    cerr << "Configuration error: mixers.[" << i << "] outputs.[" << o << "]: ";
-                } else {
-                    cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] outputs.[" << o << "]: ";
-                }
+                output_error_prefix(i, j, o, parsing_mixers);
                 cerr << "missing dest_address\n";
                 error();
             }
@@ -215,11 +288,7 @@ static int parse_outputs(libconfig::Setting& outs, channel_t* channel, int i, in
                     sdata->dest_port = strdup(outs[o]["dest_port"]);
                 }
             } else {
-                if (parsing_mixers) {
-                    cerr << "Configuration error: mixers.[" << i << "] outputs.[" << o << "]: ";
-                } else {
-                    cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] outputs.[" << o << "]: ";
-                }
+                output_error_prefix(i, j, o, parsing_mixers);
                 cerr << "missing dest_port\n";
                 error();
             }
@@ -238,7 +307,8 @@ static int parse_outputs(libconfig::Setting& outs, channel_t* channel, int i, in
                 pdata->stream_name = strdup(outs[o]["stream_name"]);
             } else {
                 if (parsing_mixers) {
-                    cerr << "Configuration error: mixers.[" << i << "] outputs.[" << o << "]: PulseAudio outputs of mixers must have stream_name defined\n";
+                    output_error_prefix(i, j, o, parsing_mixers);
+                    cerr << "PulseAudio outputs of mixers must have stream_name defined\n";
                     error();
                 }
                 char buf[1024];
@@ -247,11 +317,7 @@ static int parse_outputs(libconfig::Setting& outs, channel_t* channel, int i, in
             }
 #endif /* WITH_PULSEAUDIO */
         } else {
-            if (parsing_mixers) {
-                cerr << "Configuration error: mixers.[" << i << "] outputs.[" << o << "]: ";
-            } else {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] outputs.[" << o << "]: ";
-            }
+            output_error_prefix(i, j, o, parsing_mixers);
             cerr << "unknown output type\n";
             error();
         }
@@ -275,6 +341,8 @@ static struct freq_t* mk_freqlist(int n) {
         fl[i].ampfactor = 1.0f;
         fl[i].squelch = Squelch();
         fl[i].active_counter = 0;
+        fl[i].priority = false;
+        fl[i].activity = 0.0f;
         fl[i].modulation = MOD_AM;
     }
     return fl;
@@ -303,426 +371,817 @@ static int parse_anynum2int(libconfig::Setting& f) {
     return ret;
 }
 
-static int parse_channels(libconfig::Setting& chans, device_t* dev, int i) {
-    int jj = 0;
+#ifdef NFM
+static float tau_to_alpha(int tau_usec, int wave_rate) {
+    return tau_usec == 0 ? 0.0f : exp(-1.0f / (wave_rate * 1e-6 * tau_usec));
+}
+
+static bool channel_uses_nfm(libconfig::Setting& chan) {
+    if (chan.exists("modulation") && strncmp(chan["modulation"], "nfm", 3) == 0) {
+        return true;
+    }
+    if (chan.exists("modulations")) {
+        for (int f = 0; f < chan["modulations"].getLength(); f++) {
+            if (strncmp(chan["modulations"][f], "nfm", 3) == 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+#endif /* NFM */
+
+// Audio sample rate of a device or a mixer. Returns 0 if not set in the config.
+static int parse_audio_rate(libconfig::Setting& cfg, const char* section, int i) {
+    if (!cfg.exists("audio_rate")) {
+        return 0;
+    }
+    int rate = (int)cfg["audio_rate"];
+    if (rate != DEFAULT_WAVE_RATE && rate != NFM_WAVE_RATE) {
+        cerr << "Configuration error: " << section << ".[" << i << "]: audio_rate must be " << DEFAULT_WAVE_RATE << " or " << NFM_WAVE_RATE << "\n";
+        error();
+    }
+    return rate;
+}
+
+// Unless set explicitly, devices with NFM channels run at NFM_WAVE_RATE, as FM audio
+// needs more bandwidth. AM-only devices stay at DEFAULT_WAVE_RATE.
+static int device_audio_rate(libconfig::Setting& dev, int i) {
+    int rate = parse_audio_rate(dev, "devices", i);
+    if (rate > 0) {
+        return rate;
+    }
+#ifdef NFM
+    libconfig::Setting& chans = dev["channels"];
     for (int j = 0; j < chans.getLength(); j++) {
         if (chans[j].exists("disable") && (bool)chans[j]["disable"] == true) {
             continue;
         }
-        channel_t* channel = dev->channels + jj;
-        for (int k = 0; k < AGC_EXTRA; k++) {
-            channel->wavein[k] = 20;
-            channel->waveout[k] = 0.5;
-        }
-        channel->axcindicate = NO_SIGNAL;
-        channel->mode = MM_MONO;
-        channel->need_mp3 = 0;
-        channel->freq_count = 1;
-        channel->freq_idx = 0;
-        channel->highpass = chans[j].exists("highpass") ? (int)chans[j]["highpass"] : 100;
-        channel->lowpass = chans[j].exists("lowpass") ? (int)chans[j]["lowpass"] : 2500;
-        channel->lame = NULL;
-        channel->lamebuf = NULL;
-#ifdef NFM
-        channel->pr = 0;
-        channel->pj = 0;
-        channel->prev_waveout = 0.5;
-        channel->alpha = dev->alpha;
+        if (channel_uses_nfm(chans[j])) {
+            return NFM_WAVE_RATE;
+        }
+    }
 #endif /* NFM */
+    return DEFAULT_WAVE_RATE;
+}
 
-        // Make sure lowpass / highpass aren't flipped.
-        // If lowpass is enabled (greater than zero) it must be larger than highpass
-        if (channel->lowpass > 0 && channel->lowpass < channel->highpass) {
-            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: lowpass (" << channel->lowpass << ") must be greater than or equal to highpass (" << channel->highpass << ")\n";
-            error();
+static void alloc_channel_rings(channel_t* channel, const device_t* dev) {
+    channel->wave_rate = dev->wave_rate;
+    channel->wave_batch = dev->wave_batch;
+    channel->wave_ring_len = dev->wave_ring_len;
+    channel->wavein = (float*)XCALLOC(channel->wave_ring_len, sizeof(float));
+    channel->waveout = (float*)XCALLOC(channel->wave_ring_len + channel->wave_batch, sizeof(float));
+    channel->iq_in = (float*)XCALLOC(2 * channel->wave_ring_len, sizeof(float));
+    for (size_t k = 0; k < AGC_EXTRA; k++) {
+        channel->wavein[k] = 20;
+        channel->waveout[k] = 0.5;
+        if (k < channel->wave_batch) {
+            channel->waveout[k + channel->wave_ring_len] = 0.5;
         }
+    }
+    channel->waveout_ofs = 0;
+}
 
-        modulations channel_modulation = MOD_AM;
-        if (chans[j].exists("modulation")) {
+static void parse_channel(libconfig::Setting& chan, device_t* dev, int i, int j, int jj, bool temporary) {
+    channel_t* channel = dev->channels + jj;
+    alloc_channel_rings(channel, dev);
+    channel->axcindicate = NO_SIGNAL;
+    channel->mode = MM_MONO;
+    channel->need_mp3 = 0;
+    channel->need_vorbis = 0;
+    channel->need_pcm = 0;
+    channel->vorbis = NULL;
+    channel->pcm = NULL;
+    channel->freq_count = 1;
+    channel->freq_idx = 0;
+    channel->highpass = chan.exists("highpass") ? (int)chan["highpass"] : 100;
+    channel->lowpass = chan.exists("lowpass") ? (int)chan["lowpass"] : 2500;
+    channel->lame = NULL;
+    channel->lamebuf = NULL;
+    channel->lame_pending = false;
+    channel->mp3_skipped_count = 0;
+    channel->mp3_bytes = 0;
+    channel->mp3_flushed = false;
+    channel->lame_poolable = false;
+    channel->silence_pending = false;
 #ifdef NFM
-            if (strncmp(chans[j]["modulation"], "nfm", 3) == 0) {
-                channel_modulation = MOD_NFM;
-            } else
+    channel->pr = 0;
+    channel->pj = 0;
+    channel->prev_waveout = 0.5;
+    channel->alpha = dev->alpha;
 #endif /* NFM */
-                if (strncmp(chans[j]["modulation"], "am", 2) != 0) {
-                    cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: unknown modulation\n";
-                    error();
-                }
-        }
-        channel->afc = chans[j].exists("afc") ? (unsigned char)(unsigned int)chans[j]["afc"] : 0;
-        if (dev->mode == R_MULTICHANNEL) {
-            channel->freqlist = mk_freqlist(1);
-            channel->freqlist[0].frequency = parse_anynum2int(chans[j]["freq"]);
-            warn_if_freq_not_in_range(i, j, channel->freqlist[0].frequency, dev->input->centerfreq, dev->input->sample_rate);
-            if (chans[j].exists("label")) {
-                channel->freqlist[0].label = strdup(chans[j]["label"]);
-            }
-            channel->freqlist[0].modulation = channel_modulation;
-        } else { /* R_SCAN */
-            channel->freq_count = chans[j]["freqs"].getLength();
-            if (channel->freq_count < 1) {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: freqs should be a list with at least one element\n";
-                error();
-            }
-            channel->freqlist = mk_freqlist(channel->freq_count);
-            if (chans[j].exists("labels") && chans[j]["labels"].getLength() < channel->freq_count) {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: labels should be a list with at least " << channel->freq_count << " elements\n";
-                error();
-            }
-            if (chans[j].exists("squelch_threshold") && libconfig::Setting::TypeList == chans[j]["squelch_threshold"].getType() && chans[j]["squelch_threshold"].getLength() < channel->freq_count) {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: squelch_threshold should be an int or a list of ints with at least " << channel->freq_count
-                     << " elements\n";
-                error();
-            }
-            if (chans[j].exists("squelch_snr_threshold") && libconfig::Setting::TypeList == chans[j]["squelch_snr_threshold"].getType() &&
-                chans[j]["squelch_snr_threshold"].getLength() < channel->freq_count) {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j
-                     << "]: squelch_snr_threshold should be an int, a float or a list of "
-                        "ints or floats with at least "
-                     << channel->freq_count << " elements\n";
-                error();
-            }
-            if (chans[j].exists("notch") && libconfig::Setting::TypeList == chans[j]["notch"].getType() && chans[j]["notch"].getLength() < channel->freq_count) {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: notch should be an float or a list of floats with at least " << channel->freq_count << " elements\n";
-                error();
-            }
-            if (chans[j].exists("notch_q") && libconfig::Setting::TypeList == chans[j]["notch_q"].getType() && chans[j]["notch_q"].getLength() < channel->freq_count) {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: notch_q should be a float or a list of floats with at least " << channel->freq_count << " elements\n";
-                error();
-            }
-            if (chans[j].exists("ctcss") && libconfig::Setting::TypeList == chans[j]["ctcss"].getType() && chans[j]["ctcss"].getLength() < channel->freq_count) {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: ctcss should be an float or a list of floats with at least " << channel->freq_count << " elements\n";
-                error();
-            }
-            if (chans[j].exists("modulation") && chans[j].exists("modulations")) {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: can't set both modulation and modulations\n";
-                error();
-            }
-            if (chans[j].exists("modulations") && chans[j]["modulations"].getLength() < channel->freq_count) {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: modulations should be a list with at least " << channel->freq_count << " elements\n";
-                error();
-            }
 
-            for (int f = 0; f < channel->freq_count; f++) {
-                channel->freqlist[f].frequency = parse_anynum2int((chans[j]["freqs"][f]));
-                if (chans[j].exists("labels")) {
-                    channel->freqlist[f].label = strdup(chans[j]["labels"][f]);
-                }
-                if (chans[j].exists("modulations")) {
+    // Make sure lowpass / highpass aren't flipped.
+    // If lowpass is enabled (greater than zero) it must be larger than highpass
+    if (channel->lowpass > 0 && channel->lowpass < channel->highpass) {
+        cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: lowpass (" << channel->lowpass << ") must be greater than or equal to highpass (" << channel->highpass << ")\n";
+        error();
+    }
+
+    modulations channel_modulation = MOD_AM;
+    if (chan.exists("modulation")) {
 #ifdef NFM
-                    if (strncmp(chans[j]["modulations"][f], "nfm", 3) == 0) {
-                        channel->freqlist[f].modulation = MOD_NFM;
-                    } else
+        if (strncmp(chan["modulation"], "nfm", 3) == 0) {
+            channel_modulation = MOD_NFM;
+        } else
 #endif /* NFM */
-                        if (strncmp(chans[j]["modulations"][f], "am", 2) == 0) {
-                            channel->freqlist[f].modulation = MOD_AM;
-                        } else {
-                            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] modulations.[" << f << "]: unknown modulation\n";
-                            error();
-                        }
-                } else {
-                    channel->freqlist[f].modulation = channel_modulation;
-                }
+            if (strncmp(chan["modulation"], "am", 2) != 0) {
+                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: unknown modulation\n";
+                error();
             }
-            // Set initial frequency for scanning
-            // We tune 20 FFT bins higher to avoid DC spike
-            dev->input->centerfreq = channel->freqlist[0].frequency + 20 * (double)(dev->input->sample_rate / fft_size);
+    }
+    channel->afc = chan.exists("afc") ? (unsigned char)(unsigned int)chan["afc"] : 0;
+    if (dev->mode == R_MULTICHANNEL) {
+        channel->freqlist = mk_freqlist(1);
+        if (temporary) {
+            // parked at the center frequency until discovery assigns a carrier to it
+            channel->freqlist[0].frequency = dev->input->centerfreq;
+            channel->idle = true;
+        } else {
+            channel->freqlist[0].frequency = parse_anynum2int(chan["freq"]);
+            warn_if_freq_not_in_range(i, j, channel->freqlist[0].frequency, dev->input->centerfreq, dev->input->sample_rate);
         }
-        if (chans[j].exists("squelch")) {
-            cerr << "Warning: 'squelch' no longer supported and will be ignored, use 'squelch_threshold' or 'squelch_snr_threshold' instead\n";
+        if (chan.exists("label")) {
+            channel->freqlist[0].label = strdup(chan["label"]);
         }
-        if (chans[j].exists("squelch_threshold") && chans[j].exists("squelch_snr_threshold")) {
-            cerr << "Warning: Both 'squelch_threshold' and 'squelch_snr_threshold' are set and may conflict\n";
+        channel->freqlist[0].modulation = channel_modulation;
+    } else { /* R_SCAN */
+        channel->freq_count = chan["freqs"].getLength();
+        if (channel->freq_count < 1) {
+            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: freqs should be a list with at least one element\n";
+            error();
         }
-        if (chans[j].exists("squelch_threshold")) {
-            // Value is dBFS, zero disables manual threshold (ie use auto squelch), negative is valid, positive is invalid
-            if (libconfig::Setting::TypeList == chans[j]["squelch_threshold"].getType()) {
-                // New-style array of per-frequency squelch settings
-                for (int f = 0; f < channel->freq_count; f++) {
-                    int threshold_dBFS = (int)chans[j]["squelch_threshold"][f];
-                    if (threshold_dBFS > 0) {
-                        cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: squelch_threshold must be less than or equal to 0\n";
-                        error();
-                    } else if (threshold_dBFS == 0) {
-                        channel->freqlist[f].squelch.set_squelch_level_threshold(0);
+        channel->freqlist = mk_freqlist(channel->freq_count);
+        if (chan.exists("labels") && chan["labels"].getLength() < channel->freq_count) {
+            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: labels should be a list with at least " << channel->freq_count << " elements\n";
+            error();
+        }
+        if (chan.exists("squelch_threshold") && libconfig::Setting::TypeList == chan["squelch_threshold"].getType() && chan["squelch_threshold"].getLength() < channel->freq_count) {
+            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: squelch_threshold should be an int or a list of ints with at least " << channel->freq_count
+                 << " elements\n";
+            error();
+        }
+        if (chan.exists("squelch_snr_threshold") && libconfig::Setting::TypeList == chan["squelch_snr_threshold"].getType() &&
+            chan["squelch_snr_threshold"].getLength() < channel->freq_count) {
+            cerr << "Configuration error: devices.[" << i << "] channels.[" << j
+                 << "]: squelch_snr_threshold should be an int, a float or a list of "
+                    "ints or floats with at least "
+                 << channel->freq_count << " elements\n";
+            error();
+        }
+        if (chan.exists("notch") && libconfig::Setting::TypeList == chan["notch"].getType() && chan["notch"].getLength() < channel->freq_count) {
+            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: notch should be an float or a list of floats with at least " << channel->freq_count << " elements\n";
+            error();
+        }
+        if (chan.exists("notch_q") && libconfig::Setting::TypeList == chan["notch_q"].getType() && chan["notch_q"].getLength() < channel->freq_count) {
+            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: notch_q should be a float or a list of floats with at least " << channel->freq_count << " elements\n";
+            error();
+        }
+        if (chan.exists("ctcss") && libconfig::Setting::TypeList == chan["ctcss"].getType() && chan["ctcss"].getLength() < channel->freq_count) {
+            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: ctcss should be an float or a list of floats with at least " << channel->freq_count << " elements\n";
+            error();
+        }
+        if (chan.exists("priorities") && chan["priorities"].getLength() < channel->freq_count) {
+            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: priorities should be a list with at least " << channel->freq_count << " elements\n";
+            error();
+        }
+        if (chan.exists("modulation") && chan.exists("modulations")) {
+            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: can't set both modulation and modulations\n";
+            error();
+        }
+        if (chan.exists("modulations") && chan["modulations"].getLength() < channel->freq_count) {
+            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: modulations should be a list with at least " << channel->freq_count << " elements\n";
+            error();
+        }
+
+        for (int f = 0; f < channel->freq_count; f++) {
+            channel->freqlist[f].frequency = parse_anynum2int((chan["freqs"][f]));
+            if (chan.exists("labels")) {
+                channel->freqlist[f].label = strdup(chan["labels"][f]);
+            }
+            if (chan.exists("priorities")) {
+                channel->freqlist[f].priority = (bool)chan["priorities"][f];
+            }
+            if (chan.exists("modulations")) {
+#ifdef NFM
+                if (strncmp(chan["modulations"][f], "nfm", 3) == 0) {
+                    channel->freqlist[f].modulation = MOD_NFM;
+                } else
+#endif /* NFM */
+                    if (strncmp(chan["modulations"][f], "am", 2) == 0) {
+                        channel->freqlist[f].modulation = MOD_AM;
                     } else {
-                        channel->freqlist[f].squelch.set_squelch_level_threshold(dBFS_to_level(threshold_dBFS));
+                        cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] modulations.[" << f << "]: unknown modulation\n";
+                        error();
                     }
-                }
-            } else if (libconfig::Setting::TypeInt == chans[j]["squelch_threshold"].getType()) {
-                // Legacy (single squelch for all frequencies)
-                int threshold_dBFS = (int)chans[j]["squelch_threshold"];
-                float level;
+            } else {
+                channel->freqlist[f].modulation = channel_modulation;
+            }
+        }
+        // Set initial frequency for scanning
+        // We tune 20 FFT bins higher to avoid DC spike
+        dev->input->centerfreq = channel->freqlist[0].frequency + 20 * (double)(dev->input->sample_rate / fft_size);
+    }
+    if (chan.exists("squelch")) {
+        cerr << "Warning: 'squelch' no longer supported and will be ignored, use 'squelch_threshold' or 'squelch_snr_threshold' instead\n";
+    }
+    if (chan.exists("squelch_threshold") && chan.exists("squelch_snr_threshold")) {
+        cerr << "Warning: Both 'squelch_threshold' and 'squelch_snr_threshold' are set and may conflict\n";
+    }
+    if (chan.exists("squelch_threshold")) {
+        // Value is dBFS, zero disables manual threshold (ie use auto squelch), negative is valid, positive is invalid
+        if (libconfig::Setting::TypeList == chan["squelch_threshold"].getType()) {
+            // New-style array of per-frequency squelch settings
+            for (int f = 0; f < channel->freq_count; f++) {
+                int threshold_dBFS = (int)chan["squelch_threshold"][f];
                 if (threshold_dBFS > 0) {
                     cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: squelch_threshold must be less than or equal to 0\n";
                     error();
                 } else if (threshold_dBFS == 0) {
-                    level = 0;
+                    channel->freqlist[f].squelch.set_squelch_level_threshold(0);
                 } else {
-                    level = dBFS_to_level(threshold_dBFS);
+                    channel->freqlist[f].squelch.set_squelch_level_threshold(dBFS_to_level(threshold_dBFS));
                 }
-
-                for (int f = 0; f < channel->freq_count; f++) {
-                    channel->freqlist[f].squelch.set_squelch_level_threshold(level);
-                }
-            } else {
-                cerr << "Invalid value for squelch_threshold (should be int or list - use parentheses)\n";
+            }
+        } else if (libconfig::Setting::TypeInt == chan["squelch_threshold"].getType()) {
+            // Legacy (single squelch for all frequencies)
+            int threshold_dBFS = (int)chan["squelch_threshold"];
+            float level;
+            if (threshold_dBFS > 0) {
+                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: squelch_threshold must be less than or equal to 0\n";
                 error();
+            } else if (threshold_dBFS == 0) {
+                level = 0;
+            } else {
+                level = dBFS_to_level(threshold_dBFS);
             }
-        }
-        if (chans[j].exists("squelch_snr_threshold")) {
-            // Value is SNR in dB, zero disables squelch (ie always open), -1 uses default value, positive is valid, other negative values are invalid
-            if (libconfig::Setting::TypeList == chans[j]["squelch_snr_threshold"].getType()) {
-                // New-style array of per-frequency squelch settings
-                for (int f = 0; f < channel->freq_count; f++) {
-                    float snr = 0.f;
-                    if (libconfig::Setting::TypeFloat == chans[j]["squelch_snr_threshold"][f].getType()) {
-                        snr = (float)chans[j]["squelch_snr_threshold"][f];
-                    } else if (libconfig::Setting::TypeInt == chans[j]["squelch_snr_threshold"][f].getType()) {
-                        snr = (int)chans[j]["squelch_snr_threshold"][f];
-                    } else {
-                        cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: squelch_snr_threshold list must be of int or float\n";
-                        error();
-                    }
 
-                    if (snr == -1.0) {
-                        continue;  // "disable" for this channel in list
-                    } else if (snr < 0) {
-                        cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: squelch_snr_threshold must be greater than or equal to 0\n";
-                        error();
-                    } else {
-                        channel->freqlist[f].squelch.set_squelch_snr_threshold(snr);
-                    }
+            for (int f = 0; f < channel->freq_count; f++) {
+                channel->freqlist[f].squelch.set_squelch_level_threshold(level);
+            }
+        } else {
+            cerr << "Invalid value for squelch_threshold (should be int or list - use parentheses)\n";
+            error();
+        }
+    }
+    if (chan.exists("squelch_snr_threshold")) {
+        // Value is SNR in dB, zero disables squelch (ie always open), -1 uses default value, positive is valid, other negative values are invalid
+        if (libconfig::Setting::TypeList == chan["squelch_snr_threshold"].getType()) {
+            // New-style array of per-frequency squelch settings
+            for (int f = 0; f < channel->freq_count; f++) {
+                float snr = 0.f;
+                if (libconfig::Setting::TypeFloat == chan["squelch_snr_threshold"][f].getType()) {
+                    snr = (float)chan["squelch_snr_threshold"][f];
+                } else if (libconfig::Setting::TypeInt == chan["squelch_snr_threshold"][f].getType()) {
+                    snr = (int)chan["squelch_snr_threshold"][f];
+                } else {
+                    cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: squelch_snr_threshold list must be of int or float\n";
+                    error();
                 }
-            } else if (libconfig::Setting::TypeFloat == chans[j]["squelch_snr_threshold"].getType() || libconfig::Setting::TypeInt == chans[j]["squelch_snr_threshold"].getType()) {
-                // Legacy (single squelch for all frequencies)
-                float snr = (libconfig::Setting::TypeFloat == chans[j]["squelch_snr_threshold"].getType()) ? (float)chans[j]["squelch_snr_threshold"] : (int)chans[j]["squelch_snr_threshold"];
 
                 if (snr == -1.0) {
-                    continue;  // "disable" so use the default without error message
+                    continue;  // "disable" for this channel in list
                 } else if (snr < 0) {
                     cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: squelch_snr_threshold must be greater than or equal to 0\n";
                     error();
+                } else {
+                    channel->freqlist[f].squelch.set_squelch_snr_threshold(snr);
                 }
+            }
+        } else if (libconfig::Setting::TypeFloat == chan["squelch_snr_threshold"].getType() || libconfig::Setting::TypeInt == chan["squelch_snr_threshold"].getType()) {
+            // Legacy (single squelch for all frequencies)
+            float snr = (libconfig::Setting::TypeFloat == chan["squelch_snr_threshold"].getType()) ? (float)chan["squelch_snr_threshold"] : (int)chan["squelch_snr_threshold"];
 
+            if (snr == -1.0) {
+                // "disable" so use the default without error message
+            } else if (snr < 0) {
+                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: squelch_snr_threshold must be greater than or equal to 0\n";
+                error();
+            } else {
                 for (int f = 0; f < channel->freq_count; f++) {
                     channel->freqlist[f].squelch.set_squelch_snr_threshold(snr);
                 }
-            } else {
-                cerr << "Invalid value for squelch_snr_threshold (should be float, int, or list of int/float - use parentheses)\n";
-                error();
             }
+        } else {
+            cerr << "Invalid value for squelch_snr_threshold (should be float, int, or list of int/float - use parentheses)\n";
+            error();
         }
-        if (chans[j].exists("notch")) {
-            static const float default_q = 10.0;
-
-            if (chans[j].exists("notch_q") && chans[j]["notch"].getType() != chans[j]["notch_q"].getType()) {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: notch_q (if set) must be the same type as notch - "
-                     << "float or a list of floats with at least " << channel->freq_count << " elements\n";
-                error();
-            }
-            if (libconfig::Setting::TypeList == chans[j]["notch"].getType()) {
-                for (int f = 0; f < channel->freq_count; f++) {
-                    float freq = (float)chans[j]["notch"][f];
-                    float q = chans[j].exists("notch_q") ? (float)chans[j]["notch_q"][f] : default_q;
+    }
+    if (chan.exists("notch")) {
+        static const float default_q = 10.0;
 
-                    if (q == 0.0) {
-                        q = default_q;
-                    } else if (q <= 0.0) {
-                        cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] freq.[" << f << "]: invalid value for notch_q: " << q << " (must be greater than 0.0)\n";
-                        error();
-                    }
+        if (chan.exists("notch_q") && chan["notch"].getType() != chan["notch_q"].getType()) {
+            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: notch_q (if set) must be the same type as notch - "
+                 << "float or a list of floats with at least " << channel->freq_count << " elements\n";
+            error();
+        }
+        if (libconfig::Setting::TypeList == chan["notch"].getType()) {
+            for (int f = 0; f < channel->freq_count; f++) {
+                float freq = (float)chan["notch"][f];
+                float q = chan.exists("notch_q") ? (float)chan["notch_q"][f] : default_q;
 
-                    if (freq == 0) {
-                        continue;  // "disable" for this channel in list
-                    } else if (freq < 0) {
-                        cerr << "devices.[" << i << "] channels.[" << j << "] freq.[" << f << "]: invalid value for notch: " << freq << ", ignoring\n";
-                    } else {
-                        channel->freqlist[f].notch_filter = NotchFilter(freq, WAVE_RATE, q);
-                    }
-                }
-            } else if (libconfig::Setting::TypeFloat == chans[j]["notch"].getType()) {
-                float freq = (float)chans[j]["notch"];
-                float q = chans[j].exists("notch_q") ? (float)chans[j]["notch_q"] : default_q;
-                if (q <= 0.0) {
-                    cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: invalid value for notch_q: " << q << " (must be greater than 0.0)\n";
+                if (q == 0.0) {
+                    q = default_q;
+                } else if (q <= 0.0) {
+                    cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "] freq.[" << f << "]: invalid value for notch_q: " << q << " (must be greater than 0.0)\n";
                     error();
                 }
-                for (int f = 0; f < channel->freq_count; f++) {
-                    if (freq == 0) {
-                        continue;  // "disable" is default so ignore without error message
-                    } else if (freq < 0) {
-                        cerr << "devices.[" << i << "] channels.[" << j << "]: notch value '" << freq << "' invalid, ignoring\n";
-                    } else {
-                        channel->freqlist[f].notch_filter = NotchFilter(freq, WAVE_RATE, q);
-                    }
+
+                if (freq == 0) {
+                    continue;  // "disable" for this channel in list
+                } else if (freq < 0) {
+                    cerr << "devices.[" << i << "] channels.[" << j << "] freq.[" << f << "]: invalid value for notch: " << freq << ", ignoring\n";
+                } else {
+                    channel->freqlist[f].notch_filter = NotchFilter(freq, dev->wave_rate, q);
                 }
-            } else {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: notch should be an float or a list of floats with at least " << channel->freq_count << " elements\n";
+            }
+        } else if (libconfig::Setting::TypeFloat == chan["notch"].getType()) {
+            float freq = (float)chan["notch"];
+            float q = chan.exists("notch_q") ? (float)chan["notch_q"] : default_q;
+            if (q <= 0.0) {
+                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: invalid value for notch_q: " << q << " (must be greater than 0.0)\n";
                 error();
             }
+            for (int f = 0; f < channel->freq_count; f++) {
+                if (freq == 0) {
+                    continue;  // "disable" is default so ignore without error message
+                } else if (freq < 0) {
+                    cerr << "devices.[" << i << "] channels.[" << j << "]: notch value '" << freq << "' invalid, ignoring\n";
+                } else {
+                    channel->freqlist[f].notch_filter = NotchFilter(freq, dev->wave_rate, q);
+                }
+            }
+        } else {
+            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: notch should be an float or a list of floats with at least " << channel->freq_count << " elements\n";
+            error();
         }
-        if (chans[j].exists("ctcss")) {
-            if (libconfig::Setting::TypeList == chans[j]["ctcss"].getType()) {
-                for (int f = 0; f < channel->freq_count; f++) {
-                    float freq = (float)chans[j]["ctcss"][f];
+    }
+    if (chan.exists("ctcss")) {
+        if (libconfig::Setting::TypeList == chan["ctcss"].getType()) {
+            for (int f = 0; f < channel->freq_count; f++) {
+                float freq = (float)chan["ctcss"][f];
 
-                    if (freq == 0) {
-                        continue;  // "disable" for this channel in list
-                    } else if (freq < 0) {
-                        cerr << "devices.[" << i << "] channels.[" << j << "] freq.[" << f << "]: invalid value for ctcss: " << freq << ", ignoring\n";
-                    } else {
-                        channel->freqlist[f].squelch.set_ctcss_freq(freq, WAVE_RATE);
-                    }
+                if (freq == 0) {
+                    continue;  // "disable" for this channel in list
+                } else if (freq < 0) {
+                    cerr << "devices.[" << i << "] channels.[" << j << "] freq.[" << f << "]: invalid value for ctcss: " << freq << ", ignoring\n";
+                } else {
+                    channel->freqlist[f].squelch.set_ctcss_freq(freq, dev->wave_rate);
                 }
-            } else if (libconfig::Setting::TypeFloat == chans[j]["ctcss"].getType()) {
-                float freq = (float)chans[j]["ctcss"];
-                for (int f = 0; f < channel->freq_count; f++) {
-                    if (freq <= 0) {
-                        cerr << "devices.[" << i << "] channels.[" << j << "]: ctcss value '" << freq << "' invalid, ignoring\n";
-                    } else {
-                        channel->freqlist[f].squelch.set_ctcss_freq(freq, WAVE_RATE);
-                    }
+            }
+        } else if (libconfig::Setting::TypeFloat == chan["ctcss"].getType()) {
+            float freq = (float)chan["ctcss"];
+            for (int f = 0; f < channel->freq_count; f++) {
+                if (freq <= 0) {
+                    cerr << "devices.[" << i << "] channels.[" << j << "]: ctcss value '" << freq << "' invalid, ignoring\n";
+                } else {
+                    channel->freqlist[f].squelch.set_ctcss_freq(freq, dev->wave_rate);
                 }
-            } else {
-                cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: ctcss should be an float or a list of floats with at least " << channel->freq_count << " elements\n";
-                error();
             }
+        } else {
+            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: ctcss should be an float or a list of floats with at least " << channel->freq_count << " elements\n";
+            error();
         }
-        if (chans[j].exists("bandwidth")) {
-            channel->needs_raw_iq = 1;
+    }
+    if (chan.exists("bandwidth")) {
+        channel->needs_raw_iq = 1;
 
-            if (libconfig::Setting::TypeList == chans[j]["bandwidth"].getType()) {
-                for (int f = 0; f < channel->freq_count; f++) {
-                    int bandwidth = parse_anynum2int(chans[j]["bandwidth"][f]);
+        if (libconfig::Setting::TypeList == chan["bandwidth"].getType()) {
+            for (int f = 0; f < channel->freq_count; f++) {
+                int bandwidth = parse_anynum2int(chan["bandwidth"][f]);
 
-                    if (bandwidth == 0) {
-                        continue;  // "disable" for this channel in list
-                    } else if (bandwidth < 0) {
-                        cerr << "devices.[" << i << "] channels.[" << j << "] freq.[" << f << "]: bandwidth value '" << bandwidth << "' invalid, ignoring\n";
-                    } else {
-                        channel->freqlist[f].lowpass_filter = LowpassFilter((float)bandwidth / 2, WAVE_RATE);
-                    }
-                }
-            } else {
-                int bandwidth = parse_anynum2int(chans[j]["bandwidth"]);
                 if (bandwidth == 0) {
-                    continue;  // "disable" is default so ignore without error message
+                    continue;  // "disable" for this channel in list
                 } else if (bandwidth < 0) {
-                    cerr << "devices.[" << i << "] channels.[" << j << "]: bandwidth value '" << bandwidth << "' invalid, ignoring\n";
+                    cerr << "devices.[" << i << "] channels.[" << j << "] freq.[" << f << "]: bandwidth value '" << bandwidth << "' invalid, ignoring\n";
                 } else {
-                    for (int f = 0; f < channel->freq_count; f++) {
-                        channel->freqlist[f].lowpass_filter = LowpassFilter((float)bandwidth / 2, WAVE_RATE);
-                    }
+                    channel->freqlist[f].lowpass_filter = LowpassFilter((float)bandwidth / 2, dev->wave_rate);
                 }
             }
-        }
-        if (chans[j].exists("ampfactor")) {
-            if (libconfig::Setting::TypeList == chans[j]["ampfactor"].getType()) {
+        } else {
+            int bandwidth = parse_anynum2int(chan["bandwidth"]);
+            if (bandwidth == 0) {
+                // "disable" is default so ignore without error message
+            } else if (bandwidth < 0) {
+                cerr << "devices.[" << i << "] channels.[" << j << "]: bandwidth value '" << bandwidth << "' invalid, ignoring\n";
+            } else {
                 for (int f = 0; f < channel->freq_count; f++) {
-                    float ampfactor = (float)chans[j]["ampfactor"][f];
-
-                    if (ampfactor < 0) {
-                        cerr << "devices.[" << i << "] channels.[" << j << "] freq.[" << f << "]: ampfactor '" << ampfactor << "' must not be negative\n";
-                        error();
-                    }
-
-                    channel->freqlist[f].ampfactor = ampfactor;
+                    channel->freqlist[f].lowpass_filter = LowpassFilter((float)bandwidth / 2, dev->wave_rate);
                 }
-            } else {
-                float ampfactor = (float)chans[j]["ampfactor"];
+            }
+        }
+    }
+    if (chan.exists("ampfactor")) {
+        if (libconfig::Setting::TypeList == chan["ampfactor"].getType()) {
+            for (int f = 0; f < channel->freq_count; f++) {
+                float ampfactor = (float)chan["ampfactor"][f];
 
                 if (ampfactor < 0) {
-                    cerr << "devices.[" << i << "] channels.[" << j << "]: ampfactor '" << ampfactor << "' must not be negative\n";
+                    cerr << "devices.[" << i << "] channels.[" << j << "] freq.[" << f << "]: ampfactor '" << ampfactor << "' must not be negative\n";
                     error();
                 }
 
-                for (int f = 0; f < channel->freq_count; f++) {
-                    channel->freqlist[f].ampfactor = ampfactor;
-                }
+                channel->freqlist[f].ampfactor = ampfactor;
+            }
+        } else {
+            float ampfactor = (float)chan["ampfactor"];
+
+            if (ampfactor < 0) {
+                cerr << "devices.[" << i << "] channels.[" << j << "]: ampfactor '" << ampfactor << "' must not be negative\n";
+                error();
+            }
+
+            for (int f = 0; f < channel->freq_count; f++) {
+                channel->freqlist[f].ampfactor = ampfactor;
+            }
+        }
+    }
+
+#ifdef NFM
+    if (chan.exists("tau")) {
+        channel->alpha = tau_to_alpha((int)chan["tau"], dev->wave_rate);
+    }
+#endif /* NFM */
+    libconfig::Setting& outputs = chan["outputs"];
+    channel->output_count = outputs.getLength();
+    if (channel->output_count < 1) {
+        cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: no outputs defined\n";
+        error();
+    }
+    channel->outputs = (output_t*)XCALLOC(channel->output_count, sizeof(struct output_t));
+    int outputs_enabled = parse_outputs(outputs, channel, i, j, false);
+    if (outputs_enabled < 1) {
+        cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: no outputs defined\n";
+        error();
+    }
+    channel->outputs = (output_t*)XREALLOC(channel->outputs, outputs_enabled * sizeof(struct output_t));
+    channel->output_count = outputs_enabled;
+    if (temporary) {
+        // Files must not outlive the carrier, as the channel may get retuned afterwards,
+        // and must not collide with files of other temporary channels.
+        for (int k = 0; k < channel->output_count; k++) {
+            if (channel->outputs[k].type != O_FILE && channel->outputs[k].type != O_RAWFILE) {
+                cerr << "Configuration error: devices.[" << i << "] discovery.channel outputs.[" << k << "]: only file and rawfile outputs are allowed for temporary channels\n";
+                error();
             }
+            file_data* fdata = (file_data*)channel->outputs[k].data;
+            if (fdata->continuous) {
+                cerr << "Configuration error: devices.[" << i << "] discovery.channel outputs.[" << k << "]: continuous is not allowed for temporary channels\n";
+                error();
+            }
+            fdata->split_on_transmission = true;
+            fdata->include_freq = true;
         }
+    }
+
+    dev->base_bins[jj] = dev->bins[jj] = freq_to_fft_bin(dev->input, channel->freqlist[0].frequency);
+    debug_print("bins[%d]: %zu\n", jj, dev->bins[jj]);
 
 #ifdef NFM
-        if (chans[j].exists("tau")) {
-            channel->alpha = ((int)chans[j]["tau"] == 0 ? 0.0f : exp(-1.0f / (WAVE_RATE * 1e-6 * (int)chans[j]["tau"])));
+    for (int f = 0; f < channel->freq_count; f++) {
+        if (channel->freqlist[f].modulation == MOD_NFM) {
+            channel->needs_raw_iq = 1;
+            break;
         }
+    }
 #endif /* NFM */
-        libconfig::Setting& outputs = chans[j]["outputs"];
-        channel->output_count = outputs.getLength();
-        if (channel->output_count < 1) {
-            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: no outputs defined\n";
+
+    if (channel->has_iq_outputs) {
+        channel->iq_out = (float*)XCALLOC(2 * channel->wave_batch, sizeof(float));
+    }
+
+    if (channel->needs_raw_iq) {
+        // Downmixing is done only for NFM and raw IQ outputs. It's not critical to have some residual
+        // freq offset in AM, as it doesn't affect sound quality significantly.
+        channel->dm_dphi = downmix_dphi(dev->input, dev->wave_rate, channel->freqlist[0].frequency);
+        debug_print("dev[%d].chan[%d]: dm_dphi=0x%x\n", i, jj, channel->dm_dphi);
+        channel->dm_phi = 0.f;
+    }
+
+#ifdef DEBUG_SQUELCH
+    // Setup squelch debug file, if enabled
+    char tmp_filepath[1024];
+    for (int f = 0; f < channel->freq_count; f++) {
+        snprintf(tmp_filepath, sizeof(tmp_filepath), "./squelch_debug-%d-%d.dat", j, f);
+        channel->freqlist[f].squelch.set_debug_file(tmp_filepath);
+    }
+#endif /* DEBUG_SQUELCH */
+}
+
+// Parses channels into dev->channels starting at index first, returns the count of enabled channels
+static int parse_channels(libconfig::Setting& chans, device_t* dev, int i, int first) {
+    int jj = first;
+    for (int j = 0; j < chans.getLength(); j++) {
+        if (chans[j].exists("disable") && (bool)chans[j]["disable"] == true) {
+            continue;
+        }
+        parse_channel(chans[j], dev, i, j, jj, false);
+        jj++;
+    }
+    return jj - first;
+}
+
+static spectrum_t* parse_spectrum(libconfig::Setting& cfg, int i) {
+    spectrum_t* spectrum = (spectrum_t*)XCALLOC(1, sizeof(spectrum_t));
+    if (!cfg.exists("type")) {
+        cerr << "Configuration error: devices.[" << i << "] spectrum: mandatory parameter missing: type\n";
+        error();
+    }
+    if (!strncmp(cfg["type"], "udp", 3)) {
+        spectrum->type = SPECTRUM_UDP;
+        if (!cfg.exists("dest_address") || !cfg.exists("dest_port")) {
+            cerr << "Configuration error: devices.[" << i << "] spectrum: both dest_address and dest_port required for udp\n";
             error();
         }
-        channel->outputs = (output_t*)XCALLOC(channel->output_count, sizeof(struct output_t));
-        int outputs_enabled = parse_outputs(outputs, channel, i, j, false);
-        if (outputs_enabled < 1) {
-            cerr << "Configuration error: devices.[" << i << "] channels.[" << j << "]: no outputs defined\n";
+        spectrum->dest_address = strdup(cfg["dest_address"]);
+        if (cfg["dest_port"].getType() == libconfig::Setting::TypeInt) {
+            char buffer[12];
+            sprintf(buffer, "%d", (int)cfg["dest_port"]);
+            spectrum->dest_port = strdup(buffer);
+        } else {
+            spectrum->dest_port = strdup(cfg["dest_port"]);
+        }
+    } else if (!strncmp(cfg["type"], "unix", 4) || !strncmp(cfg["type"], "shm", 3)) {
+        spectrum->type = (!strncmp(cfg["type"], "unix", 4) ? SPECTRUM_UNIX : SPECTRUM_SHM);
+        if (!cfg.exists("path")) {
+            cerr << "Configuration error: devices.[" << i << "] spectrum: mandatory parameter missing: path\n";
             error();
         }
-        channel->outputs = (output_t*)XREALLOC(channel->outputs, outputs_enabled * sizeof(struct output_t));
-        channel->output_count = outputs_enabled;
+        spectrum->path = strdup(cfg["path"]);
+        int slots = cfg.exists("slots") ? (int)cfg["slots"] : DEFAULT_SPECTRUM_SHM_SLOTS;
+        if (spectrum->type == SPECTRUM_SHM && (spectrum->path[0] != '/' || slots < 1)) {
+            cerr << "Configuration error: devices.[" << i << "] spectrum: shm path must start with '/' and slots must be positive\n";
+            error();
+        }
+        spectrum->shm_slot_count = slots;
+    } else {
+        cerr << "Configuration error: devices.[" << i << "] spectrum: invalid type (must be one of: \"udp\", \"unix\", \"shm\")\n";
+        error();
+    }
+    spectrum->rate = cfg.exists("rate") ? (int)cfg["rate"] : DEFAULT_SPECTRUM_RATE;
+    if (spectrum->rate < 1 || spectrum->rate > MAX_SPECTRUM_RATE) {
+        cerr << "Configuration error: devices.[" << i << "] spectrum: rate is out of allowed range (1-" << MAX_SPECTRUM_RATE << ")\n";
+        error();
+    }
+    int bins = cfg.exists("bins") ? (int)cfg["bins"] : (int)fft_size;
+    if (bins < 1 || (size_t)bins > fft_size || (bins & (bins - 1)) != 0) {
+        cerr << "Configuration error: devices.[" << i << "] spectrum: bins must be a power of two not greater than fft_size (" << fft_size << ")\n";
+        error();
+    }
+    spectrum->bin_count = bins;
+    return spectrum;
+}
 
-        dev->base_bins[jj] = dev->bins[jj] =
-            (size_t)ceil((channel->freqlist[0].frequency + dev->input->sample_rate - dev->input->centerfreq) / (double)(dev->input->sample_rate / fft_size) - 1.0) % fft_size;
-        debug_print("bins[%d]: %zu\n", jj, dev->bins[jj]);
+// Sets up the tuning positions of a scanning device. Normally each frequency has its own
+// position, with the tuner 20 FFT bins higher to avoid the DC spike. With wideband_scan
+// frequencies are grouped into as few positions as possible and every frequency of the
+// current position is demodulated by its own monitor channel.
+static void plan_scan(libconfig::Setting& cfg, device_t* dev, int i) {
+    channel_t* channel = dev->channels;
+    const int dc_offset = 20 * (double)(dev->input->sample_rate / fft_size);
+    const bool wideband = cfg.exists("wideband_scan") && (bool)cfg["wideband_scan"] == true;
 
-#ifdef NFM
+    std::vector<ScanPosition> plan;
+    if (wideband) {
+        std::vector<int> freqs;
+        for (int f = 0; f < channel->freq_count; f++) {
+            freqs.push_back(channel->freqlist[f].frequency);
+        }
+        plan = plan_scan_positions(freqs, dc_offset, std::max(dc_offset, (int)(dev->input->sample_rate * SCAN_USABLE_BANDWIDTH / 2)));
+    } else {
         for (int f = 0; f < channel->freq_count; f++) {
-            if (channel->freqlist[f].modulation == MOD_NFM) {
-                channel->needs_raw_iq = 1;
-                break;
+            ScanPosition pos;
+            pos.centerfreq = channel->freqlist[f].frequency + dc_offset;
+            pos.freq_idx.push_back(f);
+            plan.push_back(pos);
+        }
+    }
+
+    dev->scan_position_count = plan.size();
+    dev->scan_positions = (scan_position_t*)XCALLOC(plan.size(), sizeof(scan_position_t));
+    size_t monitors = 0;
+    int priority_count = 0;
+    for (size_t p = 0; p < plan.size(); p++) {
+        scan_position_t* pos = dev->scan_positions + p;
+        pos->centerfreq = plan[p].centerfreq;
+        pos->freq_count = plan[p].freq_idx.size();
+        pos->freq_idx = (int*)XCALLOC(pos->freq_count, sizeof(int));
+        std::copy(plan[p].freq_idx.begin(), plan[p].freq_idx.end(), pos->freq_idx);
+        pos->first_channel = 0;
+        pos->channel_count = 1;
+        pos->priority = false;
+        for (int k = 0; k < pos->freq_count; k++) {
+            pos->priority |= channel->freqlist[pos->freq_idx[k]].priority;
+        }
+        if (pos->priority) {
+            priority_count++;
+        }
+        monitors = std::max(monitors, plan[p].freq_idx.size());
+    }
+    dev->input->centerfreq = dev->scan_positions[0].centerfreq;
+    if (wideband) {
+        log(LOG_INFO, "devices[%d]: %d frequencies grouped into %d tuning positions\n", i, channel->freq_count, dev->scan_position_count);
+    }
+    if (priority_count == 0 || priority_count == dev->scan_position_count) {
+        dev->scan_priority_hops = 0;  // nothing to prioritize
+    } else if (cfg.exists("priority_hops")) {
+        dev->scan_priority_hops = (int)cfg["priority_hops"];
+        if (dev->scan_priority_hops < 1) {
+            cerr << "Configuration error: devices.[" << i << "]: priority_hops must be greater than 0\n";
+            error();
+        }
+    } else {
+        dev->scan_priority_hops = DEFAULT_SCAN_PRIORITY_HOPS;
+    }
+
+    if (wideband && monitors > 1) {
+        // Monitors are copies of the scan channel without outputs. The scan channel itself
+        // is not demodulated, it gets the batches of the monitor being listened to.
+        const int count = dev->channel_count + monitors;
+        dev->channels = (channel_t*)XREALLOC(dev->channels, count * sizeof(channel_t));
+        dev->bins = (size_t*)XREALLOC(dev->bins, count * sizeof(size_t));
+        dev->base_bins = (size_t*)XREALLOC(dev->base_bins, count * sizeof(size_t));
+        channel = dev->channels;
+        for (int j = dev->channel_count; j < count; j++) {
+            channel_t* monitor = dev->channels + j;
+            *monitor = *channel;
+            alloc_channel_rings(monitor, dev);
+            if (monitor->has_iq_outputs) {
+                monitor->iq_out = (float*)XCALLOC(2 * monitor->wave_batch, sizeof(float));
             }
+            monitor->output_count = 0;
+            monitor->outputs = NULL;
+            monitor->need_mp3 = 0;
+            monitor->need_vorbis = 0;
+            monitor->need_pcm = 0;
+            monitor->idle = true;
         }
-#endif /* NFM */
+        channel->idle = true;
+        dev->scan_monitor_count = monitors;
+    }
+
+    // have the demodulator set up the first position as if it had just been tuned to it
+    dev->scan_position = 0;
+    dev->scan_group = NULL;
+    dev->retune_mark = 0;
+    dev->scan_retunes = 1;
+}
 
-        if (channel->needs_raw_iq) {
-            // Downmixing is done only for NFM and raw IQ outputs. It's not critical to have some residual
-            // freq offset in AM, as it doesn't affect sound quality significantly.
-            double dm_dphi = (double)(channel->freqlist[0].frequency - dev->input->centerfreq);  // downmix freq in Hz
-
-            // In general, sample_rate is not required to be an integer multiple of WAVE_RATE.
-            // However the FFT window may only slide by an integer number of input samples. A non-zero rounding error
-            // introduces additional phase rotation which we have to compensate in order to shift the channel of interest
-            // to the center of the spectrum of the output I/Q stream. This is important for correct NFM demodulation.
-            // The error value (in Hz):
-            // - has an absolute value 0..WAVE_RATE/2
-            // - is linear with the error introduced by rounding the value of sample_rate/WAVE_RATE to the nearest integer
-            //   (range of -0.5..0.5)
-            // - is linear with the distance between center frequency and the channel frequency, normalized to 0..1
-            double decimation_factor = ((double)dev->input->sample_rate / (double)WAVE_RATE);
-            double dm_dphi_correction = (double)WAVE_RATE / 2.0;
-            dm_dphi_correction *= (decimation_factor - round(decimation_factor));
-            dm_dphi_correction *= (double)(channel->freqlist[0].frequency - dev->input->centerfreq) / ((double)dev->input->sample_rate / 2.0);
-
-            debug_print("dev[%d].chan[%d]: dm_dphi: %f Hz dm_dphi_correction: %f Hz\n", i, jj, dm_dphi, dm_dphi_correction);
-            dm_dphi -= dm_dphi_correction;
-            debug_print("dev[%d].chan[%d]: dm_dphi_corrected: %f Hz\n", i, jj, dm_dphi);
-            // Normalize
-            dm_dphi /= (double)WAVE_RATE;
-            // Unalias it, to prevent overflow of int during cast
-            dm_dphi -= trunc(dm_dphi);
-            debug_print("dev[%d].chan[%d]: dm_dphi_normalized=%f\n", i, jj, dm_dphi);
-            // Translate this to uint32_t range 0x00000000-0x00ffffff
-            dm_dphi *= 256.0 * 65536.0;
-            // Cast it to signed int first, because casting negative float to uint is not portable
-            channel->dm_dphi = (uint32_t)((int)dm_dphi);
-            debug_print("dev[%d].chan[%d]: dm_dphi_scaled=%f cast=0x%x\n", i, jj, dm_dphi, channel->dm_dphi);
-            channel->dm_phi = 0.f;
+// Banked multichannel: each bank is a tuning position with its own channels. Channels of
+// the banks not being listened to are idle and their outputs get silence.
+static void plan_banks(libconfig::Setting& banks, device_t* dev, const int* bank_channels) {
+    dev->scan_position_count = banks.getLength();
+    dev->scan_positions = (scan_position_t*)XCALLOC(dev->scan_position_count, sizeof(scan_position_t));
+    int first = 0;
+    for (int b = 0; b < dev->scan_position_count; b++) {
+        scan_position_t* pos = dev->scan_positions + b;
+        pos->centerfreq = parse_anynum2int(banks[b]["centerfreq"]);
+        pos->freq_idx = NULL;
+        pos->freq_count = 0;
+        pos->priority = false;
+        pos->first_channel = first;
+        pos->channel_count = bank_channels[b];
+        first += bank_channels[b];
+    }
+    dev->input->centerfreq = dev->scan_positions[0].centerfreq;
+    dev->scan_priority_hops = 0;
+    dev->scan_position = 0;
+    dev->scan_group = NULL;
+    dev->retune_mark = 0;
+    dev->scan_retunes = 1;
+}
+
+static bool same_scan_positions(const device_t* a, const device_t* b) {
+    if (a->scan_position_count != b->scan_position_count) {
+        return false;
+    }
+    for (int p = 0; p < a->scan_position_count; p++) {
+        const scan_position_t* pa = a->scan_positions + p;
+        const scan_position_t* pb = b->scan_positions + p;
+        if (pa->centerfreq != pb->centerfreq || pa->freq_count != pb->freq_count || memcmp(pa->freq_idx, pb->freq_idx, pa->freq_count * sizeof(int)) != 0) {
+            return false;
         }
+    }
+    return true;
+}
 
-#ifdef DEBUG_SQUELCH
-        // Setup squelch debug file, if enabled
-        char tmp_filepath[1024];
-        for (int f = 0; f < channel->freq_count; f++) {
-            snprintf(tmp_filepath, sizeof(tmp_filepath), "./squelch_debug-%d-%d.dat", j, f);
-            channel->freqlist[f].squelch.set_debug_file(tmp_filepath);
+// Adds device devcnt to the scan group of the given name, creating the group if this
+// is its first member, and claims its first position.
+static void join_scan_group(const char* name, int devcnt, int i) {
+    device_t* dev = devices + devcnt;
+    scan_group_t* group = NULL;
+    for (int d = 0; d < devcnt && group == NULL; d++) {
+        if (devices[d].scan_group != NULL && !strcmp(devices[d].scan_group->name, name)) {
+            group = devices[d].scan_group;
+            if (!same_scan_positions(devices + d, dev)) {
+                cerr << "Configuration error: devices.[" << i << "]: all devices of scan_group \"" << name << "\" must scan the same frequencies with the same sample_rate\n";
+                error();
+            }
         }
-#endif /* DEBUG_SQUELCH */
+    }
+    if (group == NULL) {
+        group = (scan_group_t*)XCALLOC(1, sizeof(scan_group_t));
+        group->name = strdup(name);
+        group->position_count = dev->scan_position_count;
+        group->next = 0;
+        group->holder = (volatile int*)XCALLOC(group->position_count, sizeof(int));
+        for (int p = 0; p < group->position_count; p++) {
+            group->holder[p] = -1;
+        }
+    }
+    dev->scan_group = group;
 
-        jj++;
+    // start at the first free position, or share one if there are more devices than positions
+    int start = group->next % group->position_count;
+    for (int p = 0; p < group->position_count; p++) {
+        const int pos = (group->next + p) % group->position_count;
+        if (group->holder[pos] == -1) {
+            start = pos;
+            break;
+        }
+    }
+    group->holder[start] = devcnt;
+    group->next = start + 1;
+    dev->scan_position = start;
+    dev->input->centerfreq = dev->scan_positions[start].centerfreq;
+}
+
+static discovery_t* parse_discovery(libconfig::Setting& cfg, device_t* dev, int i) {
+    if (dev->mode != R_MULTICHANNEL) {
+        cerr << "Configuration error: devices.[" << i << "] discovery: carrier discovery is only supported in multichannel mode\n";
+        error();
+    }
+    discovery_t* discovery = (discovery_t*)XCALLOC(1, sizeof(discovery_t));
+    discovery->threshold = DEFAULT_DISCOVERY_THRESHOLD;
+    if (cfg.exists("threshold")) {
+        discovery->threshold = (cfg["threshold"].getType() == libconfig::Setting::TypeFloat) ? (float)cfg["threshold"] : (int)cfg["threshold"];
+    }
+    if (discovery->threshold <= 0.0f) {
+        cerr << "Configuration error: devices.[" << i << "] discovery: threshold must be positive\n";
+        error();
     }
-    return jj;
+    int hold_time = cfg.exists("hold_time") ? (int)cfg["hold_time"] : DEFAULT_DISCOVERY_HOLD_TIME;
+    if (hold_time < 1) {
+        cerr << "Configuration error: devices.[" << i << "] discovery: hold_time must be at least 1 second\n";
+        error();
+    }
+    discovery->max_carriers = cfg.exists("max_carriers") ? (int)cfg["max_carriers"] : DEFAULT_DISCOVERY_MAX_CARRIERS;
+    if (discovery->max_carriers < 1) {
+        cerr << "Configuration error: devices.[" << i << "] discovery: max_carriers must be positive\n";
+        error();
+    }
+    discovery->raster = cfg.exists("raster") ? parse_anynum2int(cfg["raster"]) : 0;
+    if (discovery->raster < 0) {
+        cerr << "Configuration error: devices.[" << i << "] discovery: raster must not be negative\n";
+        error();
+    }
+
+    // Without a spectrum section, FFTs are averaged just for the discovery
+    if (dev->spectrum == NULL) {
+        dev->spectrum = (spectrum_t*)XCALLOC(1, sizeof(spectrum_t));
+        dev->spectrum->type = SPECTRUM_NONE;
+        dev->spectrum->rate = cfg.exists("rate") ? (int)cfg["rate"] : DEFAULT_SPECTRUM_RATE;
+        if (dev->spectrum->rate < 1 || dev->spectrum->rate > MAX_SPECTRUM_RATE) {
+            cerr << "Configuration error: devices.[" << i << "] discovery: rate is out of allowed range (1-" << MAX_SPECTRUM_RATE << ")\n";
+            error();
+        }
+        dev->spectrum->bin_count = fft_size;
+    } else if (cfg.exists("rate")) {
+        cerr << "Configuration error: devices.[" << i << "] discovery: rate is taken from the spectrum section when it is present\n";
+        error();
+    }
+    discovery->hold_frames = (size_t)hold_time * dev->spectrum->rate;
+
+    // Temporary channels are appended after the configured ones. All of them
+    // are parsed from the same template and stay idle until a carrier shows up.
+    discovery->first_temp_channel = dev->channel_count;
+    int temp_channels = cfg.exists("channels") ? (int)cfg["channels"] : 0;
+    if (temp_channels < 0) {
+        cerr << "Configuration error: devices.[" << i << "] discovery: channels must not be negative\n";
+        error();
+    }
+    if (temp_channels > 0) {
+        if (discovery->raster == 0) {
+            cerr << "Configuration error: devices.[" << i << "] discovery: raster is required for temporary channels\n";
+            error();
+        }
+        if (!cfg.exists("channel")) {
+            cerr << "Configuration error: devices.[" << i << "] discovery: channel template is required for temporary channels\n";
+            error();
+        }
+        int count = dev->channel_count + temp_channels;
+        dev->channels = (channel_t*)XREALLOC(dev->channels, count * sizeof(channel_t));
+        dev->bins = (size_t*)XREALLOC(dev->bins, count * sizeof(size_t));
+        dev->base_bins = (size_t*)XREALLOC(dev->base_bins, count * sizeof(size_t));
+        memset(dev->channels + dev->channel_count, 0, temp_channels * sizeof(channel_t));
+        discovery->temp_freqs = (freq_t*)XCALLOC(temp_channels, sizeof(freq_t));
+        for (int jj = dev->channel_count; jj < count; jj++) {
+            parse_channel(cfg["channel"], dev, i, jj, jj, true);
+            discovery->temp_freqs[jj - dev->channel_count] = dev->channels[jj].freqlist[0];
+        }
+        dev->channel_count = count;
+    }
+    return discovery;
 }
 
 int parse_devices(libconfig::Setting& devs) {
@@ -747,10 +1206,22 @@ int parse_devices(libconfig::Setting& devs) {
 #endif /* WITH_RTLSDR */
         }
         assert(dev->input != NULL);
+        dev->wave_rate = device_audio_rate(devs[i], i);
+        dev->wave_batch = WAVE_BATCH(dev->wave_rate);
+        // a demodulation pass adds FFT_BATCH samples and hands at most one batch to the outputs,
+        // and the AGC_EXTRA samples written ahead of a batch must fit into the next one
+        const size_t min_wave_batch = std::max((size_t)FFT_BATCH, (size_t)AGC_EXTRA);
+        if (dev->wave_batch < min_wave_batch) {
+            cerr << "Configuration error: devices.[" << i << "]: audio_batch_ms must be at least " << (min_wave_batch * 1000 + dev->wave_rate - 1) / dev->wave_rate << " for "
+                 << dev->wave_rate << " Hz audio\n";
+            error();
+        }
+        dev->wave_ring_len = WAVE_RING_LEN(dev->wave_rate);
+        debug_print("devices[%d]: wave_rate=%d wave_ring_len=%zu\n", i, dev->wave_rate, dev->wave_ring_len);
         if (devs[i].exists("sample_rate")) {
             int sample_rate = parse_anynum2int(devs[i]["sample_rate"]);
-            if (sample_rate < WAVE_RATE) {
-                cerr << "Configuration error: devices.[" << i << "]: sample_rate must be greater than " << WAVE_RATE << "\n";
+            if (sample_rate < dev->wave_rate) {
+                cerr << "Configuration error: devices.[" << i << "]: sample_rate must be greater than " << dev->wave_rate << "\n";
                 error();
             }
             dev->input->sample_rate = sample_rate;
@@ -767,15 +1238,31 @@ int parse_devices(libconfig::Setting& devs) {
         } else {
             dev->mode = R_MULTICHANNEL;
         }
-        if (dev->mode == R_MULTICHANNEL) {
+        const bool banked = dev->mode == R_MULTICHANNEL && devs[i].exists("banks");
+        if (dev->mode == R_MULTICHANNEL && !banked) {
             dev->input->centerfreq = parse_anynum2int(devs[i]["centerfreq"]);
-        }  // centerfreq for R_SCAN will be set by parse_channels() after frequency list has been read
-#ifdef NFM
-        if (devs[i].exists("tau")) {
-            dev->alpha = ((int)devs[i]["tau"] == 0 ? 0.0f : exp(-1.0f / (WAVE_RATE * 1e-6 * (int)devs[i]["tau"])));
-        } else {
-            dev->alpha = alpha;
+        }  // centerfreq for R_SCAN and banks will be set after channels have been read
+        if (dev->mode == R_SCAN || banked) {
+            dev->scan_dwell_ms = devs[i].exists("dwell_ms") ? (int)devs[i]["dwell_ms"] : DEFAULT_SCAN_DWELL_MS;
+            dev->scan_hang_ms = devs[i].exists("hang_ms") ? (int)devs[i]["hang_ms"] : DEFAULT_SCAN_HANG_MS;
+            dev->scan_settle_ms = devs[i].exists("settle_ms") ? (int)devs[i]["settle_ms"] : DEFAULT_SCAN_SETTLE_MS;
+            dev->scan_max_dwell_ms = devs[i].exists("max_dwell_ms") ? (int)devs[i]["max_dwell_ms"] : dev->scan_dwell_ms;
+            dev->scan_stats_file = (dev->mode == R_SCAN && devs[i].exists("scan_stats_file")) ? strdup(devs[i]["scan_stats_file"]) : NULL;
+            if (dev->scan_dwell_ms < 0 || dev->scan_hang_ms < 0) {
+                cerr << "Configuration error: devices.[" << i << "]: dwell_ms and hang_ms must not be negative\n";
+                error();
+            }
+            if (dev->scan_max_dwell_ms < dev->scan_dwell_ms) {
+                cerr << "Configuration error: devices.[" << i << "]: max_dwell_ms must not be less than dwell_ms\n";
+                error();
+            }
+            if (dev->scan_settle_ms < 0 || dev->scan_settle_ms > MAX_SCAN_SETTLE_MS) {
+                cerr << "Configuration error: devices.[" << i << "]: settle_ms is out of allowed range (0-" << MAX_SCAN_SETTLE_MS << ")\n";
+                error();
+            }
         }
+#ifdef NFM
+        dev->alpha = tau_to_alpha(devs[i].exists("tau") ? (int)devs[i]["tau"] : tau, dev->wave_rate);
 #endif /* NFM */
 
         // Parse hardware-dependent configuration parameters
@@ -788,33 +1275,74 @@ int parse_devices(libconfig::Setting& devs) {
         assert(dev->input->sfmt != SFMT_UNDEF);
         assert(dev->input->fullscale > 0);
         assert(dev->input->bytes_per_sample > 0);
-        assert(dev->input->sample_rate > WAVE_RATE);
+        assert(dev->input->sample_rate > dev->wave_rate);
 
         // For the input buffer size use a base value and round it up to the nearest multiple
         // of FFT_BATCH blocks of input samples.
-        // ceil is required here because sample rate is not guaranteed to be an integer multiple of WAVE_RATE.
-        size_t fft_batch_len = FFT_BATCH * (2 * dev->input->bytes_per_sample * (size_t)ceil((double)dev->input->sample_rate / (double)WAVE_RATE));
+        // ceil is required here because sample rate is not guaranteed to be an integer multiple of the audio rate.
+        size_t fft_batch_len = FFT_BATCH * (2 * dev->input->bytes_per_sample * (size_t)ceil((double)dev->input->sample_rate / (double)dev->wave_rate));
         dev->input->buf_size = MIN_BUF_SIZE;
         if (dev->input->buf_size % fft_batch_len != 0)
             dev->input->buf_size += fft_batch_len - dev->input->buf_size % fft_batch_len;
         debug_print("dev->input->buf_size: %zu\n", dev->input->buf_size);
         dev->input->buffer = (unsigned char*)XCALLOC(sizeof(unsigned char), dev->input->buf_size + 2 * dev->input->bytes_per_sample * fft_size);
         dev->input->bufs = dev->input->bufe = 0;
+        dev->input->write_count = dev->read_count = 0;
         dev->input->overflow_count = 0;
         dev->output_overrun_count = 0;
-        dev->waveend = dev->waveavail = dev->row = dev->tq_head = dev->tq_tail = 0;
+        dev->waveend = dev->wavestart = 0;
+        dev->waveavail = dev->row = dev->tq_head = dev->tq_tail = 0;
         dev->last_frequency = -1;
+        dev->output_samples = dev->scan_open_sample = 0;
+        dev->scan_open_freq = -1;
 
-        libconfig::Setting& chans = devs[i]["channels"];
-        if (chans.getLength() < 1) {
-            cerr << "Configuration error: devices.[" << i << "]: no channels configured\n";
-            error();
+        int channel_count = 0;
+        std::vector<int> bank_channels;
+        if (banked) {
+            libconfig::Setting& banks = devs[i]["banks"];
+            if (banks.getLength() < 2) {
+                cerr << "Configuration error: devices.[" << i << "]: banks should be a list with at least two elements\n";
+                error();
+            }
+            if (devs[i].exists("centerfreq") || devs[i].exists("channels")) {
+                cerr << "Configuration error: devices.[" << i << "]: centerfreq and channels must be set per bank when banks are used\n";
+                error();
+            }
+            int total = 0;
+            for (int b = 0; b < banks.getLength(); b++) {
+                if (!banks[b].exists("centerfreq") || !banks[b].exists("channels") || banks[b]["channels"].getLength() < 1) {
+                    cerr << "Configuration error: devices.[" << i << "] banks.[" << b << "]: both centerfreq and a non-empty channels list are required\n";
+                    error();
+                }
+                total += banks[b]["channels"].getLength();
+            }
+            dev->channels = (channel_t*)XCALLOC(total, sizeof(channel_t));
+            dev->bins = (size_t*)XCALLOC(total, sizeof(size_t));
+            dev->base_bins = (size_t*)XCALLOC(total, sizeof(size_t));
+            dev->channel_count = 0;
+            for (int b = 0; b < banks.getLength(); b++) {
+                // channel FFT bins are relative to the center frequency of their bank
+                dev->input->centerfreq = parse_anynum2int(banks[b]["centerfreq"]);
+                const int count = parse_channels(banks[b]["channels"], dev, i, channel_count);
+                if (count < 1) {
+                    cerr << "Configuration error: devices.[" << i << "] banks.[" << b << "]: no channels enabled\n";
+                    error();
+                }
+                bank_channels.push_back(count);
+                channel_count += count;
+            }
+        } else {
+            libconfig::Setting& chans = devs[i]["channels"];
+            if (chans.getLength() < 1) {
+                cerr << "Configuration error: devices.[" << i << "]: no channels configured\n";
+                error();
+            }
+            dev->channels = (channel_t*)XCALLOC(chans.getLength(), sizeof(channel_t));
+            dev->bins = (size_t*)XCALLOC(chans.getLength(), sizeof(size_t));
+            dev->base_bins = (size_t*)XCALLOC(chans.getLength(), sizeof(size_t));
+            dev->channel_count = 0;
+            channel_count = parse_channels(chans, dev, i, 0);
         }
-        dev->channels = (channel_t*)XCALLOC(chans.getLength(), sizeof(channel_t));
-        dev->bins = (size_t*)XCALLOC(chans.getLength(), sizeof(size_t));
-        dev->base_bins = (size_t*)XCALLOC(chans.getLength(), sizeof(size_t));
-        dev->channel_count = 0;
-        int channel_count = parse_channels(chans, dev, i);
         if (channel_count < 1) {
             cerr << "Configuration error: devices.[" << i << "]: no channels enabled\n";
             error();
@@ -827,14 +1355,95 @@ int parse_devices(libconfig::Setting& devs) {
         dev->bins = (size_t*)XREALLOC(dev->bins, channel_count * sizeof(size_t));
         dev->base_bins = (size_t*)XREALLOC(dev->base_bins, channel_count * sizeof(size_t));
         dev->channel_count = channel_count;
+        if (dev->mode == R_SCAN) {
+            plan_scan(devs[i], dev, i);
+            if (devs[i].exists("scan_group")) {
+                join_scan_group(devs[i]["scan_group"], devcnt, i);
+            }
+        } else if (devs[i].exists("scan_group")) {
+            cerr << "Configuration error: devices.[" << i << "]: scan_group is only allowed in scan mode\n";
+            error();
+        }
+        if (banked) {
+            plan_banks(devs[i]["banks"], dev, bank_channels.data());
+            if (devs[i].exists("discovery")) {
+                cerr << "Configuration error: devices.[" << i << "]: discovery can't be used with banks\n";
+                error();
+            }
+        }
+        dev->spectrum = devs[i].exists("spectrum") ? parse_spectrum(devs[i]["spectrum"], i) : NULL;
+        dev->discovery = devs[i].exists("discovery") ? parse_discovery(devs[i]["discovery"], dev, i) : NULL;
         devcnt++;
     }
     return devcnt;
 }
 
+// Orders mixers so that each of them comes after all the sub-mixes feeding it, so the
+// mixer thread can pass a sub-mix on to its parents within the same pass. Mixer outputs
+// of mixers are the only pointers to mixers at this point, they get remapped accordingly.
+static void sort_mixers(int count) {
+    int* pending = (int*)XCALLOC(count, sizeof(int));  // sub-mixes feeding each mixer which have not been placed yet
+    int* order = (int*)XCALLOC(count, sizeof(int));
+    for (int m = 0; m < count; m++) {
+        channel_t* channel = &mixers[m].channel;
+        for (int k = 0; k < channel->output_count; k++) {
+            if (channel->outputs[k].type == O_MIXER) {
+                pending[((mixer_data*)channel->outputs[k].data)->mixer - mixers]++;
+            }
+        }
+    }
+    int placed = 0;
+    for (int m = 0; m < count; m++) {
+        if (pending[m] == 0) {
+            order[placed++] = m;
+        }
+    }
+    for (int n = 0; n < placed; n++) {
+        channel_t* channel = &mixers[order[n]].channel;
+        for (int k = 0; k < channel->output_count; k++) {
+            if (channel->outputs[k].type == O_MIXER) {
+                const int parent = ((mixer_data*)channel->outputs[k].data)->mixer - mixers;
+                if (--pending[parent] == 0) {
+                    order[placed++] = parent;
+                }
+            }
+        }
+    }
+    if (placed < count) {
+        for (int m = 0; m < count; m++) {
+            if (pending[m] > 0) {
+                cerr << "Configuration error: mixers: mixer \"" << mixers[m].name << "\" is fed by a loop of mixer outputs\n";
+                error();
+            }
+        }
+    }
+
+    int* position = (int*)XCALLOC(count, sizeof(int));
+    mixer_t* sorted = (mixer_t*)XCALLOC(count, sizeof(mixer_t));
+    for (int n = 0; n < count; n++) {
+        position[order[n]] = n;
+        sorted[n] = mixers[order[n]];
+    }
+    for (int n = 0; n < count; n++) {
+        channel_t* channel = &sorted[n].channel;
+        for (int k = 0; k < channel->output_count; k++) {
+            if (channel->outputs[k].type == O_MIXER) {
+                mixer_data* mdata = (mixer_data*)channel->outputs[k].data;
+                mdata->mixer = mixers + position[mdata->mixer - mixers];
+            }
+        }
+    }
+    memcpy(mixers, sorted, count * sizeof(mixer_t));
+    free(sorted);
+    free(position);
+    free(order);
+    free(pending);
+}
+
 int parse_mixers(libconfig::Setting& mx) {
     const char* name;
     int mm = 0;
+    // name all mixers first, so that mixer outputs of mixers can refer to any of them
     for (int i = 0; i < mx.getLength(); i++) {
         if (mx[i].exists("disable") && (bool)mx[i]["disable"] == true)
             continue;
@@ -842,7 +1451,10 @@ int parse_mixers(libconfig::Setting& mx) {
             cerr << "Configuration error: mixers.[" << i << "]: undefined mixer name\n";
             error();
         }
-        debug_print("mm=%d name=%s\n", mm, name);
+        if (getmixerbyname(name) != NULL) {
+            cerr << "Configuration error: mixers.[" << i << "]: duplicate mixer name \"" << name << "\"\n";
+            error();
+        }
         mixer_t* mixer = &mixers[mm];
         mixer->name = strdup(name);
         mixer->enabled = false;
@@ -852,10 +1464,21 @@ int parse_mixers(libconfig::Setting& mx) {
         mixer->inputs = NULL;
         mixer->inputs_todo = NULL;
         mixer->input_mask = NULL;
+        mixer->thread = NULL;
+        mixer->channel.mode = MM_MONO;
+        mixer_count = ++mm;
+    }
+    mm = 0;
+    for (int i = 0; i < mx.getLength(); i++) {
+        if (mx[i].exists("disable") && (bool)mx[i]["disable"] == true)
+            continue;
+        mixer_t* mixer = &mixers[mm];
+        debug_print("mm=%d name=%s\n", mm, mixer->name);
         channel_t* channel = &mixer->channel;
         channel->highpass = mx[i].exists("highpass") ? (int)mx[i]["highpass"] : 100;
         channel->lowpass = mx[i].exists("lowpass") ? (int)mx[i]["lowpass"] : 2500;
-        channel->mode = MM_MONO;
+        channel->wave_rate = parse_audio_rate(mx[i], "mixers", i);  // 0 - settled by mixer_setup()
+        channel->wave_ring_len = 0;
 
         // Make sure lowpass / highpass aren't flipped.
         // If lowpass is enabled (greater than zero) it must be larger than highpass
@@ -880,6 +1503,7 @@ int parse_mixers(libconfig::Setting& mx) {
         channel->output_count = outputs_enabled;
         mm++;
     }
+    sort_mixers(mm);
     return mm;
 }
 
@@ -0,0 +1,205 @@
+/*
+ * discovery.cpp
+ * Active carrier discovery from the averaged device spectrum
+ *
+ * Copyright (c) 2024 charlie-foxtrot
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <syslog.h>   // LOG_INFO
+#include <algorithm>  // std::nth_element
+#include <cassert>    // assert()
+#include <cmath>      // round()
+#include <cstdlib>    // abs()
+#include <cstring>    // memcpy()
+
+#include "rtl_airband.h"
+
+// Discovery runs in the demodulator thread once per spectrum frame, ie. a few times
+// per second. A carrier is a run of adjacent bins standing out of the noise floor
+// (the median bin power) by more than the threshold. Its frequency is the one of the
+// strongest bin of the run, snapped to the channel raster if one is configured.
+// Carriers are dropped after they have not been seen for hold_time seconds.
+
+void discovery_init(discovery_t* discovery) {
+    assert(discovery);
+    discovery->carriers = (carrier_t*)XCALLOC(discovery->max_carriers, sizeof(carrier_t));
+    discovery->carrier_count = 0;
+    discovery->frame = 0;
+    discovery->noise_floor = 0.0f;
+    discovery->levels = (float*)XCALLOC(fft_size, sizeof(float));
+    discovery->sorted = (float*)XCALLOC(fft_size, sizeof(float));
+    pthread_mutex_init(&discovery->mutex, NULL);
+}
+
+static int bin_to_freq(const device_t* dev, size_t bin) {
+    double freq = dev->input->centerfreq + ((double)bin - fft_size / 2) * dev->input->sample_rate / fft_size;
+    int raster = dev->discovery->raster;
+    if (raster > 0) {
+        freq = round(freq / raster) * raster;
+    }
+    return (int)freq;
+}
+
+// true if one of the configured channels already listens on the frequency
+static bool freq_is_configured(const device_t* dev, int freq) {
+    const int tolerance = std::max(dev->discovery->raster / 2, (int)(dev->input->sample_rate / fft_size));
+    for (int j = 0; j < dev->discovery->first_temp_channel; j++) {
+        if (abs(dev->channels[j].freqlist[0].frequency - freq) < tolerance) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static carrier_t* find_carrier(discovery_t* discovery, int freq, int tolerance) {
+    for (int c = 0; c < discovery->carrier_count; c++) {
+        if (abs(discovery->carriers[c].freq - freq) <= tolerance) {
+            return discovery->carriers + c;
+        }
+    }
+    return NULL;
+}
+
+// Clears what the temporary channel j has kept of its previous carrier: the squelch, AGC,
+// filter and demodulator state, and the samples demodulated ahead of the next batch.
+// The batch before them may still be read by the outputs, it is silence already.
+static void reset_channel(device_t* dev, int j) {
+    channel_t* channel = dev->channels + j;
+    freq_t* fparms = channel->freqlist;
+    const size_t active_counter = fparms->active_counter;
+    *fparms = dev->discovery->temp_freqs[j - dev->discovery->first_temp_channel];
+    fparms->active_counter = active_counter;
+#ifdef NFM
+    channel->pr = 0;
+    channel->pj = 0;
+    channel->prev_waveout = 0.5;
+#endif /* NFM */
+
+    const size_t wave_mask = dev->wave_ring_len - 1;
+    memset(channel->wavein, 0, dev->wave_ring_len * sizeof(float));
+    memset(channel->iq_in, 0, 2 * dev->wave_ring_len * sizeof(float));
+    for (size_t s = dev->wavestart; s < dev->wavestart + AGC_EXTRA; s++) {
+        const size_t k = s & wave_mask;
+        channel->waveout[k] = 0;
+        if (k < dev->wave_batch) {
+            channel->waveout[k + dev->wave_ring_len] = 0;
+        }
+    }
+}
+
+static void assign_channel(device_t* dev, carrier_t* carrier) {
+    for (int j = dev->discovery->first_temp_channel; j < dev->channel_count; j++) {
+        channel_t* channel = dev->channels + j;
+        // the outputs must be done with the audio of the previous carrier
+        if (!channel->idle || channel->silence_pending) {
+            continue;
+        }
+        reset_channel(dev, j);
+        channel->freqlist[0].frequency = carrier->freq;
+        dev->base_bins[j] = dev->bins[j] = freq_to_fft_bin(dev->input, carrier->freq);
+        if (channel->needs_raw_iq) {
+            channel->dm_dphi = downmix_dphi(dev->input, dev->wave_rate, carrier->freq);
+            channel->dm_phi = 0;
+        }
+        channel->axcindicate = NO_SIGNAL;
+        // the output thread names files after the frequency once the channel has signal
+        __sync_synchronize();
+        channel->idle = false;
+        carrier->channel = j;
+        log(LOG_INFO, "devices[%d]: channel %d tuned to discovered carrier at %.3f MHz\n", (int)(dev - devices), j, carrier->freq / 1000000.0);
+        return;
+    }
+}
+
+static void release_channel(device_t* dev, carrier_t* carrier) {
+    if (carrier->channel < 0) {
+        return;
+    }
+    channel_t* channel = dev->channels + carrier->channel;
+    channel->idle = true;
+    channel->axcindicate = NO_SIGNAL;
+    channel->silence_pending = true;
+    carrier->channel = -1;
+}
+
+// power holds fft_size bins of power summed over fft_count FFTs, in FFT output order
+void discovery_process(device_t* dev, const float* power, size_t fft_count) {
+    discovery_t* discovery = dev->discovery;
+    float* levels = discovery->levels;
+    const int dev_idx = (int)(dev - devices);
+    const float scale = 1.0f / fft_count;
+
+    for (size_t b = 0; b < fft_size; b++) {
+        levels[b] = level_to_dBFS(sqrtf(power[(b + fft_size / 2) & (fft_size - 1)] * scale));
+    }
+    // DC spike of the tuner is not a carrier
+    levels[fft_size / 2] = (levels[fft_size / 2 - 1] + levels[fft_size / 2 + 1]) / 2.0f;
+
+    memcpy(discovery->sorted, levels, fft_size * sizeof(float));
+    std::nth_element(discovery->sorted, discovery->sorted + fft_size / 2, discovery->sorted + fft_size);
+    const float noise_floor = discovery->sorted[fft_size / 2];
+    const float threshold = noise_floor + discovery->threshold;
+    const int tolerance = std::max(discovery->raster / 2, (int)(dev->input->sample_rate / fft_size));
+
+    pthread_mutex_lock(&discovery->mutex);
+    discovery->noise_floor = noise_floor;
+    discovery->frame++;
+    for (size_t b = 0; b < fft_size; b++) {
+        if (levels[b] <= threshold) {
+            continue;
+        }
+        size_t peak = b;
+        for (; b < fft_size && levels[b] > threshold; b++) {
+            if (levels[b] > levels[peak]) {
+                peak = b;
+            }
+        }
+        int freq = bin_to_freq(dev, peak);
+        carrier_t* carrier = find_carrier(discovery, freq, tolerance);
+        if (carrier == NULL) {
+            if (discovery->carrier_count == discovery->max_carriers) {
+                continue;
+            }
+            carrier = discovery->carriers + discovery->carrier_count++;
+            carrier->freq = freq;
+            carrier->first_frame = discovery->frame;
+            carrier->last_frame = 0;
+            carrier->active_frames = 0;
+            carrier->channel = -1;
+            log(LOG_INFO, "devices[%d]: carrier found at %.3f MHz, %.1f dBFS (noise floor %.1f dBFS)\n", dev_idx, freq / 1000000.0, levels[peak], noise_floor);
+        }
+        if (carrier->last_frame != discovery->frame) {
+            carrier->active_frames++;
+            carrier->level = levels[peak];
+        } else {
+            carrier->level = std::max(carrier->level, levels[peak]);
+        }
+        carrier->last_frame = discovery->frame;
+    }
+
+    for (int c = 0; c < discovery->carrier_count; c++) {
+        carrier_t* carrier = discovery->carriers + c;
+        if (discovery->frame - carrier->last_frame > discovery->hold_frames) {
+            log(LOG_INFO, "devices[%d]: carrier at %.3f MHz lost, duty cycle %.0f%%\n", dev_idx, carrier->freq / 1000000.0,
+                100.0 * carrier->active_frames / (carrier->last_frame - carrier->first_frame + 1));
+            release_channel(dev, carrier);
+            discovery->carriers[c--] = discovery->carriers[--discovery->carrier_count];
+        } else if (carrier->channel < 0 && !freq_is_configured(dev, carrier->freq)) {
+            assign_channel(dev, carrier);
+        }
+    }
+    pthread_mutex_unlock(&discovery->mutex);
+}
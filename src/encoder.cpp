@@ -0,0 +1,141 @@
+/*
+ * encoder.cpp
+ * Pool of MP3 encoder threads
+ *
+ * Copyright (c) 2024 charlie-foxtrot
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <syslog.h>  // LOG_INFO
+#include <cassert>   // assert()
+
+#include "rtl_airband.h"
+
+// Each output thread pass hands the batches of all its ready channels over to the pool at
+// once and waits until they are all encoded, then dispatches the frames to the outputs in
+// channel order. A channel has at most one batch in flight, so its frames can't get out of
+// order. While waiting, the output thread encodes queued batches itself, so the pool adds
+// to the encoding capacity of the output threads instead of replacing it. Without encoder
+// threads, output threads encode their own batches inline.
+
+static pthread_mutex_t encoder_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t encoder_work = PTHREAD_COND_INITIALIZER;  // jobs were queued, or the pool is stopping
+static pthread_cond_t encoder_done = PTHREAD_COND_INITIALIZER;  // a batch of jobs has been completed
+static encode_job* queue_head = NULL;
+static encode_job* queue_tail = NULL;
+static bool encoder_exit = false;
+static int encoder_thread_count = 0;
+static THREAD* encoder_threads = NULL;
+
+// called with encoder_mutex held
+static encode_job* encoder_pop(void) {
+    encode_job* job = queue_head;
+    if (job != NULL) {
+        queue_head = job->next;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+    }
+    return job;
+}
+
+// runs the job and reports its completion, called with encoder_mutex held
+static void encoder_run_job(encode_job* job) {
+    pthread_mutex_unlock(&encoder_mutex);
+    encode_outputs(job->channel);
+    pthread_mutex_lock(&encoder_mutex);
+    if (--*job->remaining == 0) {
+        pthread_cond_broadcast(&encoder_done);
+    }
+}
+
+static void* encoder_thread(void*) {
+    pthread_mutex_lock(&encoder_mutex);
+    while (!encoder_exit) {
+        encode_job* job = encoder_pop();
+        if (job == NULL) {
+            pthread_cond_wait(&encoder_work, &encoder_mutex);
+            continue;
+        }
+        encoder_run_job(job);
+    }
+    pthread_mutex_unlock(&encoder_mutex);
+    return 0;
+}
+
+void encoder_start(int thread_count) {
+    encoder_thread_count = thread_count;
+    if (thread_count <= 0) {
+        return;
+    }
+    encoder_threads = (THREAD*)XCALLOC(thread_count, sizeof(THREAD));
+    for (int i = 0; i < thread_count; i++) {
+        pthread_create(&encoder_threads[i], NULL, &encoder_thread, NULL);
+    }
+    log(LOG_INFO, "Started %d MP3 encoder thread(s)\n", thread_count);
+}
+
+void encoder_stop(void) {
+    pthread_mutex_lock(&encoder_mutex);
+    encoder_exit = true;
+    pthread_cond_broadcast(&encoder_work);
+    pthread_mutex_unlock(&encoder_mutex);
+    for (int i = 0; i < encoder_thread_count; i++) {
+        pthread_join(encoder_threads[i], NULL);
+    }
+    free(encoder_threads);
+    encoder_threads = NULL;
+    encoder_thread_count = 0;
+}
+
+// Encodes the current batch of each of the channels and returns when all are done.
+// jobs provides room for count entries.
+void encoder_encode(channel_t** channels, int count, encode_job* jobs) {
+    if (count == 0) {
+        return;
+    }
+    if (encoder_thread_count <= 0 || count == 1) {
+        for (int i = 0; i < count; i++) {
+            encode_outputs(channels[i]);
+        }
+        return;
+    }
+
+    int remaining = count;
+    pthread_mutex_lock(&encoder_mutex);
+    for (int i = 0; i < count; i++) {
+        jobs[i].channel = channels[i];
+        jobs[i].remaining = &remaining;
+        jobs[i].next = NULL;
+        if (queue_tail != NULL) {
+            queue_tail->next = jobs + i;
+        } else {
+            queue_head = jobs + i;
+        }
+        queue_tail = jobs + i;
+    }
+    pthread_cond_broadcast(&encoder_work);
+    while (remaining > 0) {
+        // help out instead of just waiting - the job taken may belong to another output thread
+        encode_job* job = encoder_pop();
+        if (job != NULL) {
+            encoder_run_job(job);
+        } else {
+            pthread_cond_wait(&encoder_done, &encoder_mutex);
+        }
+    }
+    pthread_mutex_unlock(&encoder_mutex);
+}
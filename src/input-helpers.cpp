@@ -55,6 +55,7 @@ void circbuffer_append(input_t* const input, unsigned char* buf, size_t len) {
 
     size_t old_end = input->bufe;
     input->bufe = (input->bufe + len) % input->buf_size;
+    input->write_count += len;
     if (old_end < input->bufs && input->bufe >= input->bufs) {
         std::cerr << "Warning: buffer overflow\n";
         input->overflow_count++;
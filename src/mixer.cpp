@@ -21,13 +21,17 @@
 #include <math.h>
 #include <sys/time.h>
 #include <syslog.h>
-#include <unistd.h>
+#include <time.h>     // clock_gettime()
+#include <algorithm>  // std::min(), std::max()
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
 #include "config.h"
 #include "rtl_airband.h"
 
+// room for a batch resampled with the largest adjustment on top of less than a batch of leftovers
+#define MIX_CARRY_LEN(wave_batch) (2 * (wave_batch) + 16)
+
 static char* err;
 
 static inline void mixer_set_error(const char* msg) {
@@ -54,7 +58,7 @@ void mixer_disable(mixer_t* mixer) {
     disable_channel_outputs(&mixer->channel);
 }
 
-int mixer_connect_input(mixer_t* mixer, float ampfactor, float balance) {
+int mixer_connect_input(mixer_t* mixer, float ampfactor, float balance, int wave_rate, int slot_count, bool drift_compensation) {
     if (!mixer) {
         mixer_set_error("mixer is undefined");
         return (-1);
@@ -73,19 +77,27 @@ int mixer_connect_input(mixer_t* mixer, float ampfactor, float balance) {
         mixer->input_mask = (bool*)XREALLOC(mixer->input_mask, (i + 1) * sizeof(bool));
     }
 
-    mixer->inputs[i].wavein = (float*)XCALLOC(WAVE_LEN, sizeof(float));
-    if ((pthread_mutex_init(&mixer->inputs[i].mutex, NULL)) != 0) {
-        mixer_set_error("failed to initialize input mutex");
-        return (-1);
-    }
+    mixer->inputs[i].slots = NULL;  // allocated by mixer_setup() once the mixer rate is known
+    mixer->inputs[i].slot_count = slot_count;
+    mixer->inputs[i].head = mixer->inputs[i].tail = 0;
+    mixer->inputs[i].wave_rate = wave_rate;
     mixer->inputs[i].ampfactor = ampfactor;
     mixer->inputs[i].ampl = fminf(1.0f, 1.0f - balance);
     mixer->inputs[i].ampr = fminf(1.0f, 1.0f + balance);
     if (balance != 0.0f)
         mixer->channel.mode = MM_STEREO;
-    mixer->inputs[i].ready = false;
-    mixer->inputs[i].has_signal = false;
     mixer->inputs[i].input_overrun_count = 0;
+    mixer->inputs[i].input_underrun_count = 0;
+    mixer->inputs[i].drift_compensation = drift_compensation;
+    mixer->inputs[i].carry = NULL;
+    mixer->inputs[i].carry_len = 0;
+    mixer->inputs[i].carry_has_signal = false;
+    mixer->inputs[i].clock_start.tv_sec = 0;
+    mixer->inputs[i].clock_start.tv_nsec = 0;
+    mixer->inputs[i].clock_samples = 0;
+    mixer->inputs[i].phase_avg = 0.0;
+    mixer->inputs[i].drift_integral = 0.0;
+    mixer->inputs[i].drift = 0.0;
     mixer->input_mask[i] = true;
     mixer->inputs_todo[i] = true;
     mixer->enabled = true;
@@ -93,6 +105,47 @@ int mixer_connect_input(mixer_t* mixer, float ampfactor, float balance) {
     return (mixer->input_count++);
 }
 
+// Called once all inputs are connected. Unless set in the config, the mixer runs at
+// the highest sample rate of its inputs. Inputs running at a different rate get
+// resampled when their samples are put into the mixer.
+void mixer_setup(mixer_t* mixer) {
+    assert(mixer);
+    channel_t* channel = &mixer->channel;
+    if (channel->wave_rate == 0) {
+        for (int i = 0; i < mixer->input_count; i++) {
+            if (mixer->inputs[i].wave_rate > channel->wave_rate) {
+                channel->wave_rate = mixer->inputs[i].wave_rate;
+            }
+        }
+    }
+    channel->wave_batch = WAVE_BATCH(channel->wave_rate);
+    channel->waveout = (float*)XCALLOC(channel->wave_batch, sizeof(float));
+    if (channel->mode == MM_STEREO) {
+        channel->waveout_r = (float*)XCALLOC(channel->wave_batch, sizeof(float));
+    }
+    mixer->waveout_mixed = false;
+    mixer->waveout_silent = true;
+    for (int i = 0; i < mixer->input_count; i++) {
+        mixinput_t* input = mixer->inputs + i;
+        input->slots = (float*)XCALLOC(input->slot_count * channel->wave_batch, sizeof(float));
+        input->resampler = Resampler(input->wave_rate, channel->wave_rate, input->drift_compensation);
+        if (input->drift_compensation) {
+            input->carry = (float*)XCALLOC(MIX_CARRY_LEN(channel->wave_batch), sizeof(float));
+        }
+    }
+    // mixers are set up in execution order, so parents of a sub-mix learn its rate before their own setup
+    for (int k = 0; k < channel->output_count; k++) {
+        if (channel->outputs[k].type == O_MIXER) {
+            mixer_data* mdata = (mixer_data*)channel->outputs[k].data;
+            mdata->mixer->inputs[mdata->input].wave_rate = channel->wave_rate;
+            if (channel->mode == MM_STEREO) {
+                log(LOG_WARNING, "mixer %s: stereo sub-mix, only its left channel is passed on to mixer %s\n", mixer->name, mdata->mixer->name);
+            }
+        }
+    }
+    debug_print("mixer %s: wave_rate=%d\n", mixer->name, channel->wave_rate);
+}
+
 void mixer_disable_input(mixer_t* mixer, int input_idx) {
     assert(mixer);
     assert(input_idx < mixer->input_count);
@@ -111,67 +164,382 @@ void mixer_disable_input(mixer_t* mixer, int input_idx) {
     mixer_disable(mixer);
 }
 
+// Inputs wake the mixer thread up when they deliver a batch, so that a mixer does not have
+// to wait for its next tick once all of its inputs are ready. Each mixer thread has its own
+// condition variable, running on CLOCK_MONOTONIC as do the mixer tick deadlines.
+void mixer_thread_init(mixer_params_t* params, Signal* signal, int mixer_start, int mixer_end) {
+    assert(params != NULL);
+    assert(signal != NULL);
+
+    params->mp3_signal = signal;
+    params->mixer_start = mixer_start;
+    params->mixer_end = mixer_end;
+    pthread_mutex_init(&params->wakeup_mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&params->wakeup_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    params->wakeup_pending = false;
+    for (int i = mixer_start; i < mixer_end; i++) {
+        mixers[i].thread = params;
+    }
+}
+
+static void mixer_wakeup(const mixer_t* mixer) {
+    mixer_params_t* params = mixer->thread;
+    if (params == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&params->wakeup_mutex);
+    params->wakeup_pending = true;
+    pthread_cond_signal(&params->wakeup_cond);
+    pthread_mutex_unlock(&params->wakeup_mutex);
+}
+
+// Waits until the deadline or a wakeup, whichever comes first. Returns false on timeout.
+static bool mixer_wait(mixer_params_t* params, const struct timespec* deadline) {
+    pthread_mutex_lock(&params->wakeup_mutex);
+    int ret = 0;
+    while (!params->wakeup_pending && ret == 0) {
+        ret = pthread_cond_timedwait(&params->wakeup_cond, &params->wakeup_mutex, deadline);
+    }
+    const bool woken = params->wakeup_pending;
+    params->wakeup_pending = false;
+    pthread_mutex_unlock(&params->wakeup_mutex);
+    return woken;
+}
+
+// Splits the mixers into thread_count contiguous ranges with roughly equal numbers of
+// inputs, as the cost of a mixer is dominated by mixing them. bounds receives
+// thread_count + 1 entries, range i being bounds[i] .. bounds[i + 1] - 1.
+void mixer_partition(int thread_count, int* bounds) {
+    assert(thread_count > 0 && thread_count <= mixer_count);
+    int total = 0;
+    for (int i = 0; i < mixer_count; i++) {
+        total += mixers[i].input_count;
+    }
+    bounds[0] = 0;
+    int m = 0, sum = 0;
+    for (int t = 1; t < thread_count; t++) {
+        // each thread gets at least one mixer
+        while (m < mixer_count - (thread_count - t) && (m == bounds[t - 1] || sum + mixers[m].input_count / 2 < total * t / thread_count)) {
+            sum += mixers[m++].input_count;
+        }
+        bounds[t] = m;
+    }
+    bounds[thread_count] = mixer_count;
+}
+
+// Drift compensation: inputs coming from different receivers run on different clocks, so
+// their batches arrive at slightly different rates than the mixer ticks. Each input keeps
+// count of the samples it has produced and compares it with the time elapsed on the mixer
+// clock (CLOCK_MONOTONIC). The lead or lag is fed to a PI controller trimming the resampler
+// ratio, so that the input produces exactly wave_rate samples per second of mixer time, and
+// the audio is handed over to the mixer in whole slots as it accumulates. A steady clock
+// offset thus ends up absorbed by the ratio instead of causing periodic overruns or underruns.
+static void mixer_put_drifting(mixer_t* mixer, mixinput_t* input, const float* samples, bool has_signal, unsigned int len) {
+    const size_t wave_batch = mixer->channel.wave_batch;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const double elapsed = (now.tv_sec - input->clock_start.tv_sec) + (now.tv_nsec - input->clock_start.tv_nsec) / 1e9;
+    const double phase = ((double)input->clock_samples - elapsed * mixer->channel.wave_rate) / wave_batch;
+    if (input->clock_start.tv_sec == 0 || fabs(phase) > MIX_DRIFT_RESYNC) {
+        // first batch, or the input has stalled - start measuring again, keeping the rate estimate
+        debug_print("input %d: clock resync\n", (int)(input - mixer->inputs));
+        input->clock_start = now;
+        input->clock_samples = 0;
+        input->phase_avg = 0.0;
+    } else {
+        input->phase_avg += (phase - input->phase_avg) * MIX_DRIFT_AVERAGING;
+        input->drift_integral += input->phase_avg;
+        input->drift_integral = std::min(std::max(input->drift_integral, -MIX_DRIFT_MAX / MIX_DRIFT_KI), MIX_DRIFT_MAX / MIX_DRIFT_KI);
+        input->drift = MIX_DRIFT_KP * input->phase_avg + MIX_DRIFT_KI * input->drift_integral;
+        input->drift = std::min(std::max(input->drift, -MIX_DRIFT_MAX), MIX_DRIFT_MAX);
+        input->resampler.set_adjustment(input->drift);
+    }
+
+    float* out = input->carry + input->carry_len;
+    const size_t room = MIX_CARRY_LEN(wave_batch) - input->carry_len;
+    size_t count;
+    if (has_signal) {
+        count = input->resampler.process_variable(samples, len, out, room);
+    } else {
+        count = std::min(input->resampler.skip(len), room);
+        memset(out, 0, count * sizeof(float));
+    }
+    input->carry_len += count;
+    input->carry_has_signal |= has_signal;
+    input->clock_samples += count;
+
+    while (input->carry_len >= wave_batch) {
+        const unsigned int head = input->head;
+        if (head - input->tail >= (unsigned int)input->slot_count) {
+            debug_print("input %d overrun\n", (int)(input - mixer->inputs));
+            input->input_overrun_count++;
+        } else {
+            const unsigned int slot = head % input->slot_count;
+            memcpy(input->slots + slot * wave_batch, input->carry, wave_batch * sizeof(float));
+            input->slot_has_signal[slot] = input->carry_has_signal;
+            __sync_synchronize();  // slot contents must be visible before the mixer sees the new head
+            input->head = head + 1;
+        }
+        input->carry_len -= wave_batch;
+        memmove(input->carry, input->carry + wave_batch, input->carry_len * sizeof(float));
+        input->carry_has_signal = has_signal;
+    }
+}
+
 void mixer_put_samples(mixer_t* mixer, int input_idx, const float* samples, bool has_signal, unsigned int len) {
     assert(mixer);
     assert(samples);
     assert(input_idx < mixer->input_count);
     mixinput_t* input = &mixer->inputs[input_idx];
-    pthread_mutex_lock(&input->mutex);
-    input->has_signal = has_signal;
-    if (has_signal) {
-        memcpy(input->wavein, samples, len * sizeof(float));
+    if (input->drift_compensation) {
+        mixer_put_drifting(mixer, input, samples, has_signal, len);
+        mixer_wakeup(mixer);
+        return;
     }
-    if (input->ready == true) {
+    const unsigned int head = input->head;
+    if (head - input->tail >= (unsigned int)input->slot_count) {
         debug_print("input %d overrun\n", input_idx);
         input->input_overrun_count++;
-    } else {
-        input->ready = true;
+        mixer_wakeup(mixer);
+        return;
+    }
+    const unsigned int slot = head % input->slot_count;
+    input->slot_has_signal[slot] = has_signal;
+    if (has_signal) {
+        input->resampler.process(samples, len, input->slots + slot * mixer->channel.wave_batch, mixer->channel.wave_batch);
+    }
+    __sync_synchronize();  // slot contents must be visible before the mixer sees the new head
+    input->head = head + 1;
+    mixer_wakeup(mixer);
+}
+
+// Mixing kernel. Reads the input batch once and writes both output channels, four samples
+// at a time using the compiler's generic vector types, which map onto SSE or NEON registers
+// depending on the target. The first input mixed into a batch overwrites the output, so the
+// buffers need no clearing beforehand.
+typedef float v4sf __attribute__((vector_size(16)));
+
+template <bool stereo, bool accumulate>
+static void mix_batch(float* left, float* right, const float* in, float mult_l, float mult_r, size_t size) {
+    const v4sf vmult_l = {mult_l, mult_l, mult_l, mult_l};
+    const v4sf vmult_r = {mult_r, mult_r, mult_r, mult_r};
+    size_t s = 0;
+    for (; s + 4 <= size; s += 4) {
+        // buffers come from calloc() and carry no alignment guarantees beyond float
+        v4sf vin, vl, vr;
+        memcpy(&vin, in + s, sizeof(vin));
+        vl = vin * vmult_l;
+        if (accumulate) {
+            v4sf prev;
+            memcpy(&prev, left + s, sizeof(prev));
+            vl += prev;
+        }
+        memcpy(left + s, &vl, sizeof(vl));
+        if (stereo) {
+            vr = vin * vmult_r;
+            if (accumulate) {
+                v4sf prev;
+                memcpy(&prev, right + s, sizeof(prev));
+                vr += prev;
+            }
+            memcpy(right + s, &vr, sizeof(vr));
+        }
+    }
+    for (; s < size; s++) {
+        left[s] = (accumulate ? left[s] : 0.0f) + in[s] * mult_l;
+        if (stereo) {
+            right[s] = (accumulate ? right[s] : 0.0f) + in[s] * mult_r;
+        }
     }
-    pthread_mutex_unlock(&input->mutex);
 }
 
-void mix_waveforms(float* sum, const float* in, float mult, int size) {
-    if (mult == 0.0f) {
+static void mixer_mix_input(mixer_t* mixer, const mixinput_t* input, const float* wavein) {
+    channel_t* channel = &mixer->channel;
+    const float mult_l = input->ampfactor * input->ampl;
+    const float mult_r = input->ampfactor * input->ampr;
+    const bool stereo = (channel->mode == MM_STEREO);
+    if (mult_l == 0.0f && (!stereo || mult_r == 0.0f)) {
         return;
     }
-    for (int s = 0; s < size; s++) {
-        sum[s] += in[s] * mult;
+    if (stereo) {
+        if (mixer->waveout_mixed) {
+            mix_batch<true, true>(channel->waveout, channel->waveout_r, wavein, mult_l, mult_r, channel->wave_batch);
+        } else {
+            mix_batch<true, false>(channel->waveout, channel->waveout_r, wavein, mult_l, mult_r, channel->wave_batch);
+        }
+    } else {
+        if (mixer->waveout_mixed) {
+            mix_batch<false, true>(channel->waveout, NULL, wavein, mult_l, 0.0f, channel->wave_batch);
+        } else {
+            mix_batch<false, false>(channel->waveout, NULL, wavein, mult_l, 0.0f, channel->wave_batch);
+        }
+    }
+    mixer->waveout_mixed = true;
+}
+
+#ifdef DEBUG
+static struct timeval ts, te;
+#endif /* DEBUG */
+
+// Mixes the inputs which are ready and have not been mixed into the current batch yet.
+// Returns true if all good inputs (ie. not masked out) have been handled.
+static bool mixer_collect_inputs(mixer_t* mixer) {
+    channel_t* channel = &mixer->channel;
+    for (int j = 0; j < mixer->input_count; j++) {
+        mixinput_t* input = mixer->inputs + j;
+        const unsigned int tail = input->tail;
+        if (mixer->inputs_todo[j] && mixer->input_mask[j] && input->head != tail) {
+            __sync_synchronize();  // pairs with the barrier in mixer_put_samples()
+            const unsigned int slot = tail % input->slot_count;
+            const float* wavein = input->slots + slot * channel->wave_batch;
+            if (channel->state == CH_DIRTY) {
+                channel->axcindicate = NO_SIGNAL;
+                channel->state = CH_WORKING;
+            }
+            debug_bulk_print("mixer %s: ampleft=%.1f ampright=%.1f\n", mixer->name, input->ampfactor * input->ampl, input->ampfactor * input->ampr);
+            // silent slots are not even filled in by mixer_put_samples()
+            if (input->slot_has_signal[slot]) {
+                mixer_mix_input(mixer, input, wavein);
+                channel->axcindicate = SIGNAL;
+            }
+            __sync_synchronize();  // done with the slot before handing it back to the producer
+            input->tail = tail + 1;
+            mixer->inputs_todo[j] = false;
+        }
+    }
+
+    // check if all "good" inputs have been handled.  this means there is no enabled mixer (mixer->input_mask is true) that has a
+    // input to handle (mixer->inputs_todo is true)
+    for (int k = 0; k < mixer->input_count; k++) {
+        if (mixer->inputs_todo[k] && mixer->input_mask[k]) {
+            return false;
+        }
     }
+    return true;
 }
 
-/* Samples are delivered to mixer inputs in batches of WAVE_BATCH size (default 1000, ie. 1/8 secs
- * of audio). mixer_thread emits mixed audio in batches of the same size, but the loop runs
- * twice more often (MIX_DIVISOR = 2) in order to accomodate for any possible input jitter
- * caused by irregular process scheduling, RTL clock instability, etc. For this purpose
- * we allow each input batch to become delayed by 1/16 secs (max). This is accomplished by
- * the mixer->interval counter, which counts from 2 to 0:
+// Hands the mixed batch over to the output thread and starts a new one
+static void mixer_emit(mixer_t* mixer, Signal* signal) {
+#ifdef DEBUG
+    gettimeofday(&te, NULL);
+
+    char* inputs_todo_char = (char*)XCALLOC(mixer->input_count + 1, sizeof(char));
+    char* input_mask_char = (char*)XCALLOC(mixer->input_count + 1, sizeof(char));
+    for (int k = 0; k < mixer->input_count; k++) {
+        inputs_todo_char[k] = mixer->inputs_todo[k] ? '+' : '-';
+        input_mask_char[k] = mixer->input_mask[k] ? '+' : '-';
+    }
+    inputs_todo_char[mixer->input_count] = '\0';
+    input_mask_char[mixer->input_count] = '\0';
+
+    debug_bulk_print("mixerinput: %lu.%lu %lu int=%d inp_unhandled=%s inp_mask=%s\n", te.tv_sec, (unsigned long)te.tv_usec, (te.tv_sec - ts.tv_sec) * 1000000UL + te.tv_usec - ts.tv_usec,
+                     mixer->interval, inputs_todo_char, input_mask_char);
+
+    free(inputs_todo_char);
+    free(input_mask_char);
+
+    ts.tv_sec = te.tv_sec;
+    ts.tv_usec = te.tv_usec;
+#endif /* DEBUG */
+
+    // A batch without any input mixed in is silence. Buffers are cleared only when the
+    // previous batch had audio, so an idle mixer costs nothing beyond this check.
+    channel_t* channel = &mixer->channel;
+    if (!mixer->waveout_mixed) {
+        channel->axcindicate = NO_SIGNAL;
+        if (!mixer->waveout_silent) {
+            memset(channel->waveout, 0, channel->wave_batch * sizeof(float));
+            if (channel->mode == MM_STEREO) {
+                memset(channel->waveout_r, 0, channel->wave_batch * sizeof(float));
+            }
+            mixer->waveout_silent = true;
+        }
+    } else {
+        mixer->waveout_silent = false;
+    }
+    mixer->waveout_mixed = false;
+
+    // sub-mixes go straight to their parents, which come later in the execution order
+    for (int k = 0; k < channel->output_count; k++) {
+        output_t* output = channel->outputs + k;
+        if (output->type == O_MIXER && output->enabled) {
+            mixer_data* mdata = (mixer_data*)output->data;
+            mixer_put_samples(mdata->mixer, mdata->input, channel->waveout, channel->axcindicate != NO_SIGNAL, channel->wave_batch);
+        }
+    }
+
+    channel->state = CH_READY;
+    signal->send();
+    mixer->interval = MIX_DIVISOR;
+    for (int k = 0; k < mixer->input_count; k++) {
+        if (mixer->inputs_todo[k] && mixer->input_mask[k]) {
+            mixer->inputs[k].input_underrun_count++;
+        }
+        mixer->inputs_todo[k] = true;
+    }
+}
+
+static void timespec_add_usec(struct timespec* t, long usec) {
+    t->tv_sec += usec / 1000000L;
+    t->tv_nsec += (usec % 1000000L) * 1000L;
+    if (t->tv_nsec >= 1000000000L) {
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000L;
+    }
+}
+
+/* Samples are delivered to mixer inputs in batches of wave_batch_ms of audio (125 ms by default),
+ * resampled to the mixer rate if needed. mixer_thread emits mixed audio in batches of the same
+ * size, but the loop runs twice more often (MIX_DIVISOR = 2) in order to accomodate for any
+ * possible input jitter caused by irregular process scheduling, RTL clock instability, etc.
+ * For this purpose we allow each input batch to become delayed by half a batch (max). This is
+ * accomplished by the mixer->interval counter, which counts from 2 to 0:
  * - 2 - initial state after mixed audio output. We don't expect inputs to be ready yet,
  *       but we check their readiness anyway.
  * - 1 - here we expect most (if not all) inputs to be ready, so we mix them. If there are no
- *       inputs left to handle in this WAVE_BATCH interval, we emit the mixed audio and reset
+ *       inputs left to handle in this batch interval, we emit the mixed audio and reset
  *       mixer->interval to the initial state (2).
  * - 0 - here we expect to get output from all delayed inputs, which were not ready in the
  *       interval. Any input which is still not ready, is skipped (filled with 0s), because
  *       here we must emit the mixed audio to keep the desired audio bitrate.
+ * Ticks are scheduled at absolute deadlines on CLOCK_MONOTONIC, so processing time and
+ * wakeup latency do not accumulate into drift. Between ticks the thread is woken up by
+ * inputs delivering batches - a mixer with all of its good inputs ready emits right away
+ * instead of waiting for the next tick.
  */
 void* mixer_thread(void* param) {
     assert(param != NULL);
-    Signal* signal = (Signal*)param;
-    int interval_usec = 1e+6 * WAVE_BATCH / WAVE_RATE / MIX_DIVISOR;
+    mixer_params_t* params = (mixer_params_t*)param;
+    Signal* signal = params->mp3_signal;
+    const long interval_usec = 1000L * wave_batch_ms / MIX_DIVISOR;
 
-    debug_print("Starting mixer thread, signal %p\n", signal);
+    debug_print("Starting mixer thread, mixers %d:%d, signal %p\n", params->mixer_start, params->mixer_end, signal);
 
-    if (mixer_count <= 0)
+    if (params->mixer_start >= params->mixer_end)
         return 0;
 #ifdef DEBUG
-    struct timeval ts, te;
     gettimeofday(&ts, NULL);
 #endif /* DEBUG */
+    struct timespec deadline, now;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
     while (!do_exit) {
-        usleep(interval_usec);
+        timespec_add_usec(&deadline, interval_usec);
+        while (mixer_wait(params, &deadline) && !do_exit) {
+            for (int i = params->mixer_start; i < params->mixer_end; i++) {
+                mixer_t* mixer = mixers + i;
+                if (mixer->enabled && mixer->channel.state != CH_READY && mixer_collect_inputs(mixer)) {
+                    mixer_emit(mixer, signal);
+                }
+            }
+        }
         if (do_exit)
             return 0;
-        for (int i = 0; i < mixer_count; i++) {
+        for (int i = params->mixer_start; i < params->mixer_end; i++) {
             mixer_t* mixer = mixers + i;
             if (mixer->enabled == false)
                 continue;
@@ -186,76 +554,17 @@ void* mixer_thread(void* param) {
                 }
             }
 
-            for (int j = 0; j < mixer->input_count; j++) {
-                mixinput_t* input = mixer->inputs + j;
-                pthread_mutex_lock(&input->mutex);
-                if (mixer->inputs_todo[j] && mixer->input_mask[j] && input->ready) {
-                    if (channel->state == CH_DIRTY) {
-                        memset(channel->waveout, 0, WAVE_BATCH * sizeof(float));
-                        if (channel->mode == MM_STEREO)
-                            memset(channel->waveout_r, 0, WAVE_BATCH * sizeof(float));
-                        channel->axcindicate = NO_SIGNAL;
-                        channel->state = CH_WORKING;
-                    }
-                    debug_bulk_print("mixer[%d]: ampleft=%.1f ampright=%.1f\n", i, input->ampfactor * input->ampl, input->ampfactor * input->ampr);
-                    if (input->has_signal) {
-                        /* left channel */
-                        mix_waveforms(channel->waveout, input->wavein, input->ampfactor * input->ampl, WAVE_BATCH);
-                        /* right channel */
-                        if (channel->mode == MM_STEREO) {
-                            mix_waveforms(channel->waveout_r, input->wavein, input->ampfactor * input->ampr, WAVE_BATCH);
-                        }
-                        channel->axcindicate = SIGNAL;
-                    }
-                    input->ready = false;
-                    mixer->inputs_todo[j] = false;
-                }
-                pthread_mutex_unlock(&input->mutex);
-            }
-
-            // check if all "good" inputs have been handled.  this means there is no enabled mixer (mixer->input_mask is true) that has a
-            // input to handle (mixer->inputs_todo is true)
-            bool all_good_inputs_handled = true;
-            for (int k = 0; k < mixer->input_count && all_good_inputs_handled; k++) {
-                if (mixer->inputs_todo[k] && mixer->input_mask[k]) {
-                    all_good_inputs_handled = false;
-                }
-            }
-
-            if ((all_good_inputs_handled == true) || mixer->interval == 0) {  // all good inputs handled or last interval passed
-
-#ifdef DEBUG
-                gettimeofday(&te, NULL);
-
-                char* inputs_todo_char = (char*)XCALLOC(mixer->input_count + 1, sizeof(char));
-                char* input_mask_char = (char*)XCALLOC(mixer->input_count + 1, sizeof(char));
-                for (int k = 0; k < mixer->input_count; k++) {
-                    inputs_todo_char[k] = mixer->inputs_todo[k] ? '+' : '-';
-                    input_mask_char[k] = mixer->input_mask[k] ? '+' : '-';
-                }
-                inputs_todo_char[mixer->input_count] = '\0';
-                input_mask_char[mixer->input_count] = '\0';
-
-                debug_bulk_print("mixerinput: %lu.%lu %lu int=%d inp_unhandled=%s inp_mask=%s\n", te.tv_sec, (unsigned long)te.tv_usec, (te.tv_sec - ts.tv_sec) * 1000000UL + te.tv_usec - ts.tv_usec,
-                                 mixer->interval, inputs_todo_char, input_mask_char);
-
-                free(inputs_todo_char);
-                free(input_mask_char);
-
-                ts.tv_sec = te.tv_sec;
-                ts.tv_usec = te.tv_usec;
-#endif /* DEBUG */
-
-                channel->state = CH_READY;
-                signal->send();
-                mixer->interval = MIX_DIVISOR;
-                for (int k = 0; k < mixer->input_count; k++) {
-                    mixer->inputs_todo[k] = true;
-                }
+            if (mixer_collect_inputs(mixer) || mixer->interval == 0) {  // all good inputs handled or last interval passed
+                mixer_emit(mixer, signal);
             } else {
                 mixer->interval--;
             }
         }
+        // after a stall (eg. system suspend) restart the schedule instead of catching up with a burst of ticks
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - deadline.tv_sec) * 1000000L + (now.tv_nsec - deadline.tv_nsec) / 1000L > interval_usec) {
+            deadline = now;
+        }
     }
     return 0;
 }
@@ -18,6 +18,7 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <fcntl.h>  // open()
 #include <math.h>
 #include <ogg/ogg.h>
 #include <shout/shout.h>
@@ -53,8 +54,9 @@
 #include "input-common.h"
 #include "rtl_airband.h"
 
-void shout_setup(icecast_data* icecast, mix_modes mixmode) {
+void shout_setup(icecast_data* icecast, mix_modes mixmode, int wave_rate) {
     int ret;
+    const bool vorbis = (icecast->codec == AC_VORBIS);
     shout_t* shouttemp = shout_new();
     if (shouttemp == NULL) {
         printf("cannot allocate\n");
@@ -92,9 +94,9 @@ void shout_setup(icecast_data* icecast, mix_modes mixmode) {
         return;
     }
 #ifdef LIBSHOUT_HAS_CONTENT_FORMAT
-    if (shout_set_content_format(shouttemp, SHOUT_FORMAT_MP3, SHOUT_USAGE_AUDIO, NULL) != SHOUTERR_SUCCESS) {
+    if (shout_set_content_format(shouttemp, vorbis ? SHOUT_FORMAT_OGG : SHOUT_FORMAT_MP3, SHOUT_USAGE_AUDIO, NULL) != SHOUTERR_SUCCESS) {
 #else
-    if (shout_set_format(shouttemp, SHOUT_FORMAT_MP3) != SHOUTERR_SUCCESS) {
+    if (shout_set_format(shouttemp, vorbis ? SHOUT_FORMAT_OGG : SHOUT_FORMAT_MP3) != SHOUTERR_SUCCESS) {
 #endif /* LIBSHOUT_HAS_CONTENT_FORMAT */
         shout_free(shouttemp);
         return;
@@ -112,7 +114,7 @@ void shout_setup(icecast_data* icecast, mix_modes mixmode) {
         return;
     }
     char samplerates[20];
-    sprintf(samplerates, "%d", MP3_RATE);
+    sprintf(samplerates, "%d", vorbis ? wave_rate : MP3_RATE);
     shout_set_audio_info(shouttemp, SHOUT_AI_SAMPLERATE, samplerates);
     shout_set_audio_info(shouttemp, SHOUT_AI_CHANNELS, (mixmode == MM_STEREO ? "2" : "1"));
 
@@ -136,6 +138,7 @@ void shout_setup(icecast_data* icecast, mix_modes mixmode) {
     if (ret == SHOUTERR_CONNECTED) {
         log(LOG_NOTICE, "Connected to %s:%d/%s\n", icecast->hostname, icecast->port, icecast->mountpoint);
         SLEEP(100);
+        icecast->send_header = vorbis;  // an Ogg stream has to start with its headers
         icecast->shout = shouttemp;
     } else {
         log(LOG_WARNING, "Could not connect to %s:%d/%s: %s\n", icecast->hostname, icecast->port, icecast->mountpoint, shout_get_error(shouttemp));
@@ -145,14 +148,14 @@ void shout_setup(icecast_data* icecast, mix_modes mixmode) {
     }
 }
 
-lame_t airlame_init(mix_modes mixmode, int highpass, int lowpass) {
+lame_t airlame_init(mix_modes mixmode, int wave_rate, int highpass, int lowpass) {
     lame_t lame = lame_init();
     if (!lame) {
         log(LOG_WARNING, "lame_init failed\n");
         return NULL;
     }
 
-    lame_set_in_samplerate(lame, WAVE_RATE);
+    lame_set_in_samplerate(lame, wave_rate);
     lame_set_VBR(lame, vbr_mtrh);
     lame_set_brate(lame, 16);
     lame_set_quality(lame, 7);
@@ -166,11 +169,229 @@ lame_t airlame_init(mix_modes mixmode, int highpass, int lowpass) {
         lame_set_num_channels(lame, 1);
         lame_set_mode(lame, MONO);
     }
-    debug_print("lame init with mixmode=%s\n", mixmode == MM_STEREO ? "MM_STEREO" : "MM_MONO");
+    debug_print("lame init with mixmode=%s wave_rate=%d\n", mixmode == MM_STEREO ? "MM_STEREO" : "MM_MONO", wave_rate);
     lame_init_params(lame);
     return lame;
 }
 
+// LAME contexts are created when a channel first has audio to encode. Channels recording
+// each transmission into a separate file give their context back when the file closes,
+// to a pool of idle contexts shared by channels with the same encoder settings. At most
+// lame_pool_size idle contexts are kept, so memory follows the number of concurrent
+// transmissions rather than the number of configured channels.
+struct lame_pool_entry {
+    mix_modes mode;
+    int wave_rate, highpass, lowpass;
+    lame_t lame;
+    unsigned char* lamebuf;
+    lame_pool_entry* next;
+};
+
+static pthread_mutex_t lame_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static lame_pool_entry* lame_pool = NULL;
+static int lame_pool_count = 0;
+
+void lame_setup(channel_t* channel) {
+    channel->lame = NULL;
+    channel->lamebuf = NULL;
+    channel->lame_poolable = true;
+    for (int k = 0; k < channel->output_count; k++) {
+        const output_t* output = channel->outputs + k;
+        if (output->type == O_ICECAST && ((icecast_data*)output->data)->codec == AC_MP3) {
+            channel->lame_poolable = false;
+        } else if (output->type == O_FILE && ((file_data*)output->data)->codec == AC_MP3) {
+            const file_data* fdata = (file_data*)output->data;
+            if (!fdata->split_on_transmission || fdata->pre_trigger_ms > 0) {
+                channel->lame_poolable = false;  // encodes between transmissions too
+            }
+        }
+    }
+}
+
+static bool lame_acquire(channel_t* channel) {
+    pthread_mutex_lock(&lame_pool_mutex);
+    for (lame_pool_entry** prev = &lame_pool; *prev != NULL; prev = &(*prev)->next) {
+        lame_pool_entry* entry = *prev;
+        if (entry->mode == channel->mode && entry->wave_rate == channel->wave_rate && entry->highpass == channel->highpass && entry->lowpass == channel->lowpass) {
+            *prev = entry->next;
+            lame_pool_count--;
+            pthread_mutex_unlock(&lame_pool_mutex);
+            channel->lame = entry->lame;
+            channel->lamebuf = entry->lamebuf;
+            free(entry);
+            lame_init_bitstream(channel->lame);  // each transmission starts a new file
+            return true;
+        }
+    }
+    pthread_mutex_unlock(&lame_pool_mutex);
+
+    channel->lame = airlame_init(channel->mode, channel->wave_rate, channel->highpass, channel->lowpass);
+    if (channel->lame == NULL) {
+        return false;
+    }
+    channel->lamebuf = (unsigned char*)XCALLOC(LAMEBUF_SIZE, sizeof(unsigned char));
+    return true;
+}
+
+// the context must have been flushed
+static void lame_release(channel_t* channel) {
+    pthread_mutex_lock(&lame_pool_mutex);
+    if (lame_pool_count < lame_pool_size) {
+        lame_pool_entry* entry = (lame_pool_entry*)XCALLOC(1, sizeof(lame_pool_entry));
+        entry->mode = channel->mode;
+        entry->wave_rate = channel->wave_rate;
+        entry->highpass = channel->highpass;
+        entry->lowpass = channel->lowpass;
+        entry->lame = channel->lame;
+        entry->lamebuf = channel->lamebuf;
+        entry->next = lame_pool;
+        lame_pool = entry;
+        lame_pool_count++;
+    } else {
+        lame_close(channel->lame);
+        free(channel->lamebuf);
+    }
+    pthread_mutex_unlock(&lame_pool_mutex);
+    channel->lame = NULL;
+    channel->lamebuf = NULL;
+    channel->lame_pending = false;
+}
+
+// Ogg/Vorbis outputs of a channel share one encoder, as the MP3 outputs share lamebuf. The
+// header pages of the stream are kept, so that each file or Icecast stream which starts
+// while the encoder is running gets them first, followed by the pages of the running
+// stream. If all Ogg outputs of the channel are split_on_transmission files, the stream is
+// ended when the file closes instead, so that each file holds a complete stream.
+// Each batch is flushed into pages of its own, which keeps the latency at that of the MP3
+// outputs. The last block before a gap is only encoded when the audio resumes, though.
+struct page_buffer {
+    unsigned char* data;
+    size_t len, size;
+};
+
+struct vorbis_encoder {
+    vorbis_info vi;
+    vorbis_comment vc;
+    vorbis_dsp_state vd;
+    vorbis_block vb;
+    ogg_stream_state os;
+    bool started;        // vd, vb and os are set up and header holds the headers of the stream
+    bool per_file;       // all Ogg outputs are split_on_transmission files, each file gets a stream of its own
+    int serialno;        // of the current stream
+    page_buffer header;  // header pages of the current stream
+    page_buffer pages;   // pages of the current batch, set by encode_outputs()
+    page_buffer tail;    // last pages of a stream ended by vorbis_finish()
+};
+
+static int vorbis_serialno = (int)time(NULL);
+
+static void page_buffer_append(page_buffer* buf, const ogg_page* og) {
+    size_t needed = buf->len + og->header_len + og->body_len;
+    if (needed > buf->size) {
+        buf->size = 2 * needed;
+        buf->data = (unsigned char*)XREALLOC(buf->data, buf->size);
+    }
+    memcpy(buf->data + buf->len, og->header, og->header_len);
+    memcpy(buf->data + buf->len + og->header_len, og->body, og->body_len);
+    buf->len = needed;
+}
+
+bool vorbis_setup(channel_t* channel) {
+    vorbis_encoder* enc = (vorbis_encoder*)XCALLOC(1, sizeof(vorbis_encoder));
+    vorbis_info_init(&enc->vi);
+    int ret = vorbis_encode_init_vbr(&enc->vi, (channel->mode == MM_STEREO ? 2 : 1), channel->wave_rate, VORBIS_QUALITY);
+    if (ret != 0) {
+        log(LOG_ERR, "vorbis_encode_init_vbr failed for %d Hz audio: %d\n", channel->wave_rate, ret);
+        vorbis_info_clear(&enc->vi);
+        free(enc);
+        return false;
+    }
+    vorbis_comment_init(&enc->vc);
+    vorbis_comment_add_tag(&enc->vc, "ENCODER", "RTLSDR-Airband");
+    enc->per_file = true;
+    for (int k = 0; k < channel->output_count; k++) {
+        const output_t* output = channel->outputs + k;
+        if (output->type == O_ICECAST && ((icecast_data*)output->data)->codec == AC_VORBIS) {
+            enc->per_file = false;
+        } else if (output->type == O_FILE && ((file_data*)output->data)->codec == AC_VORBIS && !((file_data*)output->data)->split_on_transmission) {
+            enc->per_file = false;
+        }
+    }
+    debug_print("vorbis init with mode=%s wave_rate=%d per_file=%d\n", channel->mode == MM_STEREO ? "MM_STEREO" : "MM_MONO", channel->wave_rate, enc->per_file);
+    channel->vorbis = enc;
+    return true;
+}
+
+static void vorbis_start(vorbis_encoder* enc) {
+    vorbis_analysis_init(&enc->vd, &enc->vi);
+    vorbis_block_init(&enc->vd, &enc->vb);
+    enc->serialno = __sync_fetch_and_add(&vorbis_serialno, 1);
+    ogg_stream_init(&enc->os, enc->serialno);
+
+    ogg_packet header, header_comm, header_code;
+    vorbis_analysis_headerout(&enc->vd, &enc->vc, &header, &header_comm, &header_code);
+    ogg_stream_packetin(&enc->os, &header);
+    ogg_stream_packetin(&enc->os, &header_comm);
+    ogg_stream_packetin(&enc->os, &header_code);
+
+    // the audio has to start on a page of its own
+    ogg_page og;
+    enc->header.len = 0;
+    while (ogg_stream_flush(&enc->os, &og) != 0) {
+        page_buffer_append(&enc->header, &og);
+    }
+    enc->started = true;
+}
+
+// Encodes the audio written to the encoder so far and appends the resulting pages to out
+static void vorbis_drain(vorbis_encoder* enc, page_buffer* out) {
+    ogg_packet op;
+    ogg_page og;
+    while (vorbis_analysis_blockout(&enc->vd, &enc->vb) == 1) {
+        vorbis_analysis(&enc->vb, NULL);
+        vorbis_bitrate_addblock(&enc->vb);
+        while (vorbis_bitrate_flushpacket(&enc->vd, &op) == 1) {
+            ogg_stream_packetin(&enc->os, &op);
+        }
+    }
+    while (ogg_stream_flush(&enc->os, &og) != 0) {
+        page_buffer_append(out, &og);
+    }
+}
+
+static void vorbis_stop(vorbis_encoder* enc) {
+    ogg_stream_clear(&enc->os);
+    vorbis_block_clear(&enc->vb);
+    vorbis_dsp_clear(&enc->vd);
+    enc->started = false;
+}
+
+// Ends the stream, leaving its last pages in tail
+static void vorbis_finish(vorbis_encoder* enc) {
+    enc->tail.len = 0;
+    vorbis_analysis_wrote(&enc->vd, 0);
+    vorbis_drain(enc, &enc->tail);
+    vorbis_stop(enc);
+}
+
+void vorbis_close(channel_t* channel) {
+    vorbis_encoder* enc = channel->vorbis;
+    if (enc == NULL) {
+        return;
+    }
+    if (enc->started) {
+        vorbis_stop(enc);
+    }
+    vorbis_comment_clear(&enc->vc);
+    vorbis_info_clear(&enc->vi);
+    free(enc->header.data);
+    free(enc->pages.data);
+    free(enc->tail.data);
+    free(enc);
+    channel->vorbis = NULL;
+}
+
+// Tones are generated at the MP3 output rate, so they don't depend on the channel audio rate
 class LameTone {
     unsigned char* _data;
     int _bytes;
@@ -179,20 +400,20 @@ class LameTone {
     LameTone(mix_modes mixmode, int msec, unsigned int hz = 0) : _data(NULL), _bytes(0) {
         _data = (unsigned char*)XCALLOC(1, LAMEBUF_SIZE);
 
-        int samples = (msec * WAVE_RATE) / 1000;
+        int samples = (msec * MP3_RATE) / 1000;
         float* buf = (float*)XCALLOC(samples, sizeof(float));
 
         debug_print("LameTone with mixmode=%s msec=%d hz=%u\n", mixmode == MM_STEREO ? "MM_STEREO" : "MM_MONO", msec, hz);
         if (hz > 0) {
             const float period = 1.0 / (float)hz;
-            const float sample_time = 1.0 / (float)WAVE_RATE;
+            const float sample_time = 1.0 / (float)MP3_RATE;
             float t = 0;
             for (int i = 0; i < samples; ++i, t += sample_time) {
                 buf[i] = 0.9 * sinf(t * 2.0 * M_PI / period);
             }
         } else
             memset(buf, 0, samples * sizeof(float));
-        lame_t lame = airlame_init(mixmode, 0, 0);
+        lame_t lame = airlame_init(mixmode, MP3_RATE, 0, 0);
         if (lame) {
             _bytes = lame_encode_buffer_ieee_float(lame, buf, (mixmode == MM_STEREO ? buf : NULL), samples, _data, LAMEBUF_SIZE);
             if (_bytes > 0) {
@@ -244,12 +465,18 @@ int rename_if_exists(char const* oldpath, char const* newpath) {
 }
 
 /*
- * Open output file (mp3 or raw IQ) for append or initial write.
- * If appending to an audio file, insert discontinuity indictor tones
+ * Open output file (mp3, ogg, wav, flac or raw IQ) for append or initial write.
+ * If appending to an mp3 file, insert discontinuity indictor tones
  * as well as the appropriate amount of silence when in continuous mode.
+ * Ogg files get a new chained stream instead (see output_file_ready()),
+ * WAV and FLAC files are handled in pcm_file.cpp.
  */
-static int open_file(file_data* fdata, mix_modes mixmode, int is_audio) {
+static int open_file(file_data* fdata, const channel_t* channel, int is_audio) {
+    const mix_modes mixmode = channel->mode;
     int rename_result = rename_if_exists(fdata->file_path.c_str(), fdata->file_path_tmp.c_str());
+    if (is_audio && (fdata->codec == AC_WAV || fdata->codec == AC_FLAC)) {
+        return pcm_file_open(fdata, channel);
+    }
     fdata->f = fopen(fdata->file_path_tmp.c_str(), fdata->append ? "a+" : "w");
     if (fdata->f == NULL) {
         return -1;
@@ -272,7 +499,7 @@ static int open_file(file_data* fdata, mix_modes mixmode, int is_audio) {
         debug_print("Appending from pos %llu to %s\n", (unsigned long long)st.st_size, fdata->file_path_tmp.c_str());
     }
 
-    if (is_audio) {
+    if (is_audio && fdata->codec == AC_MP3) {
         // fill missing space with marker tones
         LameTone lt_a(mixmode, 120, 2222);
         LameTone lt_b(mixmode, 120, 1111);
@@ -312,31 +539,224 @@ static int open_file(file_data* fdata, mix_modes mixmode, int is_audio) {
     return 0;
 }
 
+// File I/O of the file outputs. With async_file_writes, it is done by the writer thread
+// (see writer.cpp) on its own copy of the file_data of the output, so that slow storage
+// doesn't hold up the output threads. Otherwise the output thread does it itself.
+static void file_io_sync(file_data* fdata) {
+    if (fflush(fdata->f) != 0 || fsync(fileno(fdata->f)) != 0) {
+        log(LOG_WARNING, "Could not sync %s (%s)\n", fdata->file_path.c_str(), strerror(errno));
+    }
+    fdata->sync_time = time(NULL);
+}
+
+bool file_io_open(file_data* fdata, const channel_t* channel, int is_audio) {
+    if (fdata->dated_subdirectories) {
+        struct tm tm;
+        if (use_localtime) {
+            localtime_r(&fdata->open_time.tv_sec, &tm);
+        } else {
+            gmtime_r(&fdata->open_time.tv_sec, &tm);
+        }
+        if (make_dated_subdirs(fdata->basedir, &tm).empty()) {
+            log(LOG_ERR, "Failed to create dated subdirectory\n");
+            return false;
+        }
+    } else {
+        make_dir(fdata->basedir);
+    }
+
+    if (open_file(fdata, channel, is_audio) < 0) {
+        log(LOG_WARNING, "Cannot open output file %s (%s)\n", fdata->file_path_tmp.c_str(), strerror(errno));
+        return false;
+    }
+    fdata->sync_time = time(NULL);
+    return true;
+}
+
+bool file_io_write(file_data* fdata, const channel_t* channel, const void* data, size_t len) {
+    bool ok;
+    if (fdata->type == O_FILE && (fdata->codec == AC_WAV || fdata->codec == AC_FLAC)) {
+        ok = pcm_file_write(fdata, channel, data, len);
+    } else {
+        ok = (fwrite(data, 1, len, fdata->f) == len);
+    }
+    if (!ok) {
+        if (ferror(fdata->f))
+            log(LOG_WARNING, "Cannot write to %s (%s)\n", fdata->file_path.c_str(), strerror(errno));
+        else
+            log(LOG_WARNING, "Short write on %s\n", fdata->file_path.c_str());
+        return false;
+    }
+    if (file_fsync == FSYNC_PERIODIC && time(NULL) - fdata->sync_time >= FILE_FSYNC_INTERVAL) {
+        file_io_sync(fdata);
+    }
+    return true;
+}
+
+void file_io_close(file_data* fdata) {
+    if (fdata->type == O_FILE && (fdata->codec == AC_WAV || fdata->codec == AC_FLAC)) {
+        pcm_file_close(fdata);  // patches the header
+    } else {
+        fclose(fdata->f);
+    }
+    fdata->f = NULL;
+    // synced after closing, so that the header patched on close is included
+    if (file_fsync != FSYNC_NEVER) {
+        int fd = open(fdata->file_path_tmp.c_str(), O_RDONLY);
+        if (fd < 0 || fsync(fd) != 0) {
+            log(LOG_WARNING, "Could not sync %s (%s)\n", fdata->file_path.c_str(), strerror(errno));
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    rename_if_exists(fdata->file_path_tmp.c_str(), fdata->file_path.c_str());
+}
+
+static bool file_is_open(const file_data* fdata) {
+    return fdata->f != NULL || fdata->wfile != NULL;
+}
+
+static bool file_open(channel_t* channel, file_data* fdata, int is_audio) {
+    if (async_file_writes) {
+        fdata->wfile = writer_open(fdata, channel, is_audio);
+        return true;  // errors show up in file_write()
+    }
+    return file_io_open(fdata, channel, is_audio);
+}
+
+static bool file_write(channel_t* channel, file_data* fdata, const void* data, size_t len) {
+    if (fdata->wfile != NULL) {
+        return writer_write(fdata->wfile, channel, data, len);
+    }
+    return file_io_write(fdata, channel, data, len);
+}
+
+static void file_close(file_data* fdata) {
+    if (fdata->wfile != NULL) {
+        writer_close(fdata->wfile);
+        fdata->wfile = NULL;
+    } else {
+        file_io_close(fdata);
+    }
+}
+
+// Batches a file output skipped while idle, written ahead of the audio when it resumes, so
+// that the lead-in lost to the squelch opening delay is included. These are the batches the
+// channel encodes anyway - codec_needed() just doesn't let the encoders skip them.
+struct pre_trigger_ring {
+    page_buffer* batches;
+    int capacity;
+    int first;     // oldest batch
+    int count;
+    int serialno;  // Ogg stream the batches belong to (Vorbis only)
+};
+
+static void pre_trigger_push(const channel_t* channel, file_data* fdata, const unsigned char* data, size_t len) {
+    pre_trigger_ring* ring = fdata->pre_trigger;
+    if (ring == NULL) {
+        ring = (pre_trigger_ring*)XCALLOC(1, sizeof(pre_trigger_ring));
+        ring->capacity = (fdata->pre_trigger_ms + wave_batch_ms - 1) / wave_batch_ms;
+        ring->batches = (page_buffer*)XCALLOC(ring->capacity, sizeof(page_buffer));
+        fdata->pre_trigger = ring;
+    }
+
+    // pages of a stream which has ended are of no use
+    const int serialno = (fdata->codec == AC_VORBIS ? channel->vorbis->serialno : 0);
+    if (ring->serialno != serialno) {
+        ring->count = 0;
+        ring->serialno = serialno;
+    }
+
+    page_buffer* batch;
+    if (ring->count < ring->capacity) {
+        batch = ring->batches + (ring->first + ring->count) % ring->capacity;
+        ring->count++;
+    } else {
+        batch = ring->batches + ring->first;  // overwrite the oldest one
+        ring->first = (ring->first + 1) % ring->capacity;
+    }
+    if (len > batch->size) {
+        batch->size = len;
+        batch->data = (unsigned char*)XREALLOC(batch->data, batch->size);
+    }
+    memcpy(batch->data, data, len);
+    batch->len = len;
+}
+
+// Writes the batches of the ring to the file and empties it
+static bool pre_trigger_flush(channel_t* channel, file_data* fdata) {
+    pre_trigger_ring* ring = fdata->pre_trigger;
+    if (ring == NULL || ring->count == 0) {
+        return true;
+    }
+    bool ok = true;
+    if (fdata->codec != AC_VORBIS || ring->serialno == channel->vorbis->serialno) {
+        for (int i = 0; i < ring->count && ok; i++) {
+            const page_buffer* batch = ring->batches + (ring->first + i) % ring->capacity;
+            ok = file_write(channel, fdata, batch->data, batch->len);
+        }
+    }
+    ring->first = ring->count = 0;
+    return ok;
+}
+
+// True if an Ogg file output of the channel other than fdata is open
+static bool vorbis_file_open(const channel_t* channel, const file_data* fdata) {
+    for (int k = 0; k < channel->output_count; k++) {
+        const file_data* other = (const file_data*)channel->outputs[k].data;
+        if (channel->outputs[k].type == O_FILE && other != fdata && other->codec == AC_VORBIS && file_is_open(other)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static void close_file(channel_t* channel, file_data* fdata) {
     if (!fdata) {
         return;
     }
 
-    if (fdata->type == O_FILE && fdata->f && channel->lame) {
-        int encoded = lame_encode_flush_nogap(channel->lame, channel->lamebuf, LAMEBUF_SIZE);
+    if (fdata->type == O_FILE && fdata->codec == AC_MP3 && file_is_open(fdata) && channel->lame) {
+        // not into lamebuf, which may still hold the batch for the outputs after this one
+        unsigned char flushbuf[LAMEBUF_SIZE];
+        int encoded = lame_encode_flush_nogap(channel->lame, flushbuf, LAMEBUF_SIZE);
+        channel->lame_pending = false;
         debug_print("closing file %s flushed %d\n", fdata->file_path.c_str(), encoded);
 
         if (encoded > 0) {
-            size_t written = fwrite((void*)channel->lamebuf, 1, (size_t)encoded, fdata->f);
-            if (written == 0 || written < (size_t)encoded)
-                log(LOG_WARNING, "Problem writing %s (%s)\n", fdata->file_path.c_str(), strerror(errno));
+            file_write(channel, fdata, flushbuf, (size_t)encoded);
         }
     }
 
-    if (fdata->f) {
-        fclose(fdata->f);
-        fdata->f = NULL;
-        rename_if_exists(fdata->file_path_tmp.c_str(), fdata->file_path.c_str());
+    // end the stream of the transmission, unless another file of the channel still takes it
+    if (fdata->type == O_FILE && fdata->codec == AC_VORBIS && file_is_open(fdata) && channel->vorbis->per_file && channel->vorbis->started && !vorbis_file_open(channel, fdata)) {
+        vorbis_finish(channel->vorbis);
+        file_write(channel, fdata, channel->vorbis->tail.data, channel->vorbis->tail.len);
+    }
+
+    if (file_is_open(fdata)) {
+        file_close(fdata);
     }
     fdata->file_path.clear();
     fdata->file_path_tmp.clear();
 }
 
+// Hands the encoder over to other channels until the next transmission, once the files of
+// the transmission are closed. Called after the batch has been dispatched, as releasing
+// the encoder takes lamebuf along.
+static void lame_release_if_idle(channel_t* channel) {
+    if (!channel->lame_poolable || channel->lame == NULL || channel->lame_pending) {
+        return;
+    }
+    for (int k = 0; k < channel->output_count; k++) {
+        if (channel->outputs[k].type == O_FILE && file_is_open((file_data*)channel->outputs[k].data)) {
+            return;
+        }
+    }
+    lame_release(channel);
+}
+
 /*
  * Close current output file based on certain conditions:
  * If "split_on_transmission" mode is true check:
@@ -349,7 +769,7 @@ static void close_if_necessary(channel_t* channel, file_data* fdata) {
     static const double MAX_TRANSMISSION_TIME_SEC = 60.0 * 60.0;
     static const double MAX_TRANSMISSION_IDLE_SEC = 0.5;
 
-    if (!fdata || !fdata->f) {
+    if (!fdata || !file_is_open(fdata)) {
         return;
     }
 
@@ -393,14 +813,14 @@ static void close_if_necessary(channel_t* channel, file_data* fdata) {
  * Otherwise, create a file name based on the current timestamp and
  * open that new file.  If that file open succeeded, return true.
  */
-static bool output_file_ready(channel_t* channel, file_data* fdata, mix_modes mixmode, int is_audio) {
+static bool output_file_ready(channel_t* channel, file_data* fdata, int is_audio) {
     if (!fdata) {
         return false;
     }
 
     close_if_necessary(channel, fdata);
 
-    if (fdata->f) {  // still open
+    if (file_is_open(fdata)) {  // still open
         return true;
     }
 
@@ -419,16 +839,13 @@ static bool output_file_ready(channel_t* channel, file_data* fdata, mix_modes mi
         return false;
     }
 
-    std::string output_dir;
+    // the directories are made when the file is opened, see file_io_open()
+    std::string output_dir = fdata->basedir;
     if (fdata->dated_subdirectories) {
-        output_dir = make_dated_subdirs(fdata->basedir, time);
-        if (output_dir.empty()) {
-            log(LOG_ERR, "Failed to create dated subdirectory\n");
-            return false;
-        }
-    } else {
-        output_dir = fdata->basedir;
-        make_dir(output_dir);
+        char date_path[11];
+        strftime(date_path, sizeof(date_path), "%Y/%m/%d", time);
+        output_dir += '/';
+        output_dir += date_path;
     }
 
     // use a string stream to build the output filepath
@@ -444,31 +861,133 @@ static bool output_file_ready(channel_t* channel, file_data* fdata, mix_modes mi
 
     fdata->open_time = fdata->last_write_time = current_time;
 
-    if (open_file(fdata, mixmode, is_audio) < 0) {
-        log(LOG_WARNING, "Cannot open output file %s (%s)\n", fdata->file_path_tmp.c_str(), strerror(errno));
+    if (!file_open(channel, fdata, is_audio)) {
         return false;
     }
 
+    // the pages that follow are only decodable after the headers of their stream
+    if (is_audio && fdata->codec == AC_VORBIS) {
+        const page_buffer* header = &channel->vorbis->header;
+        if (!file_write(channel, fdata, header->data, header->len)) {
+            close_file(channel, fdata);
+            return false;
+        }
+    }
+
     return true;
 }
 
-// Create all the output for a particular channel.
-void process_outputs(channel_t* channel, int cur_scan_freq) {
+// True if any output of the codec is going to use the current batch once encoded. Icecast
+// streams take every batch, file outputs skip silence unless continuous (but take the first
+// batch of silence after a transmission, as in process_outputs()) or keep a pre-trigger ring.
+static bool codec_needed(const channel_t* channel, audio_codecs codec) {
+    for (int k = 0; k < channel->output_count; k++) {
+        const output_t* output = channel->outputs + k;
+        if (output->enabled == false)
+            continue;
+        if (output->type == O_ICECAST) {
+            const icecast_data* icecast = (icecast_data*)output->data;
+            if (icecast->codec == codec && icecast->shout != NULL)
+                return true;
+        } else if (output->type == O_FILE) {
+            const file_data* fdata = (file_data*)output->data;
+            if (fdata->codec == codec && (fdata->continuous || fdata->pre_trigger_ms > 0 || channel->axcindicate != NO_SIGNAL || output->active))
+                return true;
+        }
+    }
+    return false;
+}
+
+// Encodes the current batch of the channel into lamebuf, the Vorbis pages and PCM samples,
+// for process_outputs() to dispatch.
+// Runs in the output thread or in an encoder thread (see encoder.cpp).
+void encode_outputs(channel_t* channel) {
+    // current batch of audio, contiguous thanks to the mirrored tail of the waveout ring
+    const float* waveout = channel->waveout + channel->waveout_ofs;
     int mp3_bytes = 0;
+    bool mp3_flushed = false;  // mp3_bytes holds the tail of the audio before a gap
     if (channel->need_mp3) {
-        // debug_bulk_print("channel->mode=%s\n", channel->mode == MM_STEREO ? "MM_STEREO" : "MM_MONO");
-        mp3_bytes = lame_encode_buffer_ieee_float(channel->lame, channel->waveout, (channel->mode == MM_STEREO ? channel->waveout_r : NULL), WAVE_BATCH, channel->lamebuf, LAMEBUF_SIZE);
-        if (mp3_bytes < 0)
-            log(LOG_WARNING, "lame_encode_buffer_ieee_float: %d\n", mp3_bytes);
+        if (codec_needed(channel, AC_MP3) && (channel->lame != NULL || lame_acquire(channel))) {
+            // debug_bulk_print("channel->mode=%s\n", channel->mode == MM_STEREO ? "MM_STEREO" : "MM_MONO");
+            mp3_bytes = lame_encode_buffer_ieee_float(channel->lame, waveout, (channel->mode == MM_STEREO ? channel->waveout_r : NULL), channel->wave_batch, channel->lamebuf, LAMEBUF_SIZE);
+            if (mp3_bytes < 0)
+                log(LOG_WARNING, "lame_encode_buffer_ieee_float: %d\n", mp3_bytes);
+            channel->lame_pending = true;
+        } else {
+            // Nobody takes this batch, so skip encoding it. At the start of the gap, flush what
+            // LAME still buffers, so the end of the transmission is not held back until the
+            // next one. nogap keeps the encoder usable for the audio after the gap.
+            channel->mp3_skipped_count++;
+            if (channel->lame_pending) {
+                mp3_bytes = lame_encode_flush_nogap(channel->lame, channel->lamebuf, LAMEBUF_SIZE);
+                mp3_flushed = true;
+                channel->lame_pending = false;
+            }
+        }
+    }
+    channel->mp3_bytes = mp3_bytes;
+    channel->mp3_flushed = mp3_flushed;
+
+    if (channel->need_vorbis) {
+        vorbis_encoder* enc = channel->vorbis;
+        enc->pages.len = 0;
+        if (codec_needed(channel, AC_VORBIS)) {
+            if (!enc->started) {
+                vorbis_start(enc);
+            }
+            float** buffer = vorbis_analysis_buffer(&enc->vd, channel->wave_batch);
+            memcpy(buffer[0], waveout, channel->wave_batch * sizeof(float));
+            if (channel->mode == MM_STEREO) {
+                memcpy(buffer[1], channel->waveout_r, channel->wave_batch * sizeof(float));
+            }
+            vorbis_analysis_wrote(&enc->vd, channel->wave_batch);
+            vorbis_drain(enc, &enc->pages);
+        }
+    }
+
+    channel->pcm_bytes = 0;
+    if (channel->need_pcm && (codec_needed(channel, AC_WAV) || codec_needed(channel, AC_FLAC))) {
+        channel->pcm_bytes = pcm_encode(channel);
+    }
+}
+
+// Audio of the current batch for the outputs using the codec, as left by encode_outputs()
+static int encoded_batch(const channel_t* channel, audio_codecs codec, const unsigned char** data) {
+    switch (codec) {
+        case AC_VORBIS:
+            *data = channel->vorbis->pages.data;
+            return (int)channel->vorbis->pages.len;
+        case AC_WAV:
+        case AC_FLAC:
+            *data = (const unsigned char*)channel->pcm;
+            return channel->pcm_bytes;
+        default:
+            *data = channel->lamebuf;
+            return channel->mp3_bytes;
     }
+}
+
+// Create all the output for a particular channel, once encoded by encode_outputs().
+static void process_outputs(channel_t* channel, int cur_scan_freq) {
+    const float* waveout = channel->waveout + channel->waveout_ofs;
+    const int mp3_bytes = channel->mp3_bytes;
+    const bool mp3_flushed = channel->mp3_flushed;
     for (int k = 0; k < channel->output_count; k++) {
         if (channel->outputs[k].enabled == false)
             continue;
         if (channel->outputs[k].type == O_ICECAST) {
             icecast_data* icecast = (icecast_data*)(channel->outputs[k].data);
-            if (icecast->shout == NULL || mp3_bytes <= 0)
+            const unsigned char* data;
+            const int bytes = encoded_batch(channel, icecast->codec, &data);
+            if (icecast->shout == NULL || bytes <= 0)
                 continue;
-            int ret = shout_send(icecast->shout, channel->lamebuf, mp3_bytes);
+            int ret = SHOUTERR_SUCCESS;
+            if (icecast->send_header) {
+                ret = shout_send(icecast->shout, channel->vorbis->header.data, channel->vorbis->header.len);
+                icecast->send_header = false;
+            }
+            if (ret == SHOUTERR_SUCCESS)
+                ret = shout_send(icecast->shout, data, bytes);
             if (ret != SHOUTERR_SUCCESS || shout_queuelen(icecast->shout) > MAX_SHOUT_QUEUELEN) {
                 if (shout_queuelen(icecast->shout) > MAX_SHOUT_QUEUELEN)
                     log(LOG_WARNING, "Exceeded max backlog for %s:%d/%s, disconnecting\n", icecast->hostname, icecast->port, icecast->mountpoint);
@@ -497,34 +1016,37 @@ void process_outputs(channel_t* channel, int cur_scan_freq) {
             }
         } else if (channel->outputs[k].type == O_FILE || channel->outputs[k].type == O_RAWFILE) {
             file_data* fdata = (file_data*)(channel->outputs[k].data);
+            const unsigned char* data = NULL;
+            const int bytes = (fdata->type == O_FILE ? encoded_batch(channel, fdata->codec, &data) : 0);
 
             if (fdata->continuous == false && channel->axcindicate == NO_SIGNAL && channel->outputs[k].active == false) {
+                if (fdata->codec == AC_MP3 && mp3_flushed && mp3_bytes > 0 && fdata->type == O_FILE && file_is_open(fdata)) {
+                    file_write(channel, fdata, channel->lamebuf, (size_t)mp3_bytes);
+                }
+                if (fdata->pre_trigger_ms > 0 && bytes > 0) {
+                    pre_trigger_push(channel, fdata, data, (size_t)bytes);
+                }
                 close_if_necessary(channel, fdata);
                 continue;
             }
 
-            if (channel->outputs[k].type == O_FILE && mp3_bytes <= 0)
+            if (channel->outputs[k].type == O_FILE && bytes <= 0)
                 continue;
 
-            if (!output_file_ready(channel, fdata, channel->mode, (channel->outputs[k].type == O_RAWFILE ? 0 : 1))) {
+            if (!output_file_ready(channel, fdata, (channel->outputs[k].type == O_RAWFILE ? 0 : 1))) {
                 log(LOG_WARNING, "Output disabled\n");
                 channel->outputs[k].enabled = false;
                 continue;
             };
 
-            size_t buflen = 0, written = 0;
+            bool written = true;
             if (channel->outputs[k].type == O_FILE) {
-                buflen = (size_t)mp3_bytes;
-                written = fwrite(channel->lamebuf, 1, buflen, fdata->f);
+                written = pre_trigger_flush(channel, fdata) && file_write(channel, fdata, data, (size_t)bytes);
             } else if (channel->outputs[k].type == O_RAWFILE) {
-                buflen = 2 * sizeof(float) * WAVE_BATCH;
-                written = fwrite(channel->iq_out, 1, buflen, fdata->f);
-            }
-            if (written < buflen) {
-                if (ferror(fdata->f))
-                    log(LOG_WARNING, "Cannot write to %s (%s), output disabled\n", fdata->file_path.c_str(), strerror(errno));
-                else
-                    log(LOG_WARNING, "Short write on %s, output disabled\n", fdata->file_path.c_str());
+                written = file_write(channel, fdata, channel->iq_out, 2 * sizeof(float) * channel->wave_batch);
+            }
+            if (!written) {
+                log(LOG_WARNING, "Output to %s disabled\n", fdata->file_path.c_str());
                 close_file(channel, fdata);
                 channel->outputs[k].enabled = false;
             }
@@ -532,7 +1054,9 @@ void process_outputs(channel_t* channel, int cur_scan_freq) {
             gettimeofday(&fdata->last_write_time, NULL);
         } else if (channel->outputs[k].type == O_MIXER) {
             mixer_data* mdata = (mixer_data*)(channel->outputs[k].data);
-            mixer_put_samples(mdata->mixer, mdata->input, channel->waveout, channel->axcindicate != NO_SIGNAL, WAVE_BATCH);
+            if (!mdata->from_mixer) {
+                mixer_put_samples(mdata->mixer, mdata->input, waveout, channel->axcindicate != NO_SIGNAL, channel->wave_batch);
+            }
         } else if (channel->outputs[k].type == O_UDP_STREAM) {
             udp_stream_data* sdata = (udp_stream_data*)channel->outputs[k].data;
 
@@ -541,9 +1065,9 @@ void process_outputs(channel_t* channel, int cur_scan_freq) {
             }
 
             if (channel->mode == MM_MONO) {
-                udp_stream_write(sdata, channel->waveout, (size_t)WAVE_BATCH * sizeof(float));
+                udp_stream_write(sdata, waveout, channel->wave_batch * sizeof(float));
             } else {
-                udp_stream_write(sdata, channel->waveout, channel->waveout_r, (size_t)WAVE_BATCH * sizeof(float));
+                udp_stream_write(sdata, waveout, channel->waveout_r, channel->wave_batch * sizeof(float));
             }
 
 #ifdef WITH_PULSEAUDIO
@@ -552,10 +1076,11 @@ void process_outputs(channel_t* channel, int cur_scan_freq) {
             if (pdata->continuous == false && channel->axcindicate == NO_SIGNAL)
                 continue;
 
-            pulse_write_stream(pdata, channel->mode, channel->waveout, channel->waveout_r, (size_t)WAVE_BATCH * sizeof(float));
+            pulse_write_stream(pdata, channel->mode, waveout, channel->waveout_r, channel->wave_batch * sizeof(float));
 #endif /* WITH_PULSEAUDIO */
         }
     }
+    lame_release_if_idle(channel);
 }
 
 void disable_channel_outputs(channel_t* channel) {
@@ -811,6 +1336,52 @@ static void output_output_overruns(FILE* f) {
     fprintf(f, "\n");
 }
 
+static void output_mp3_skips(FILE* f) {
+    fprintf(f,
+            "# HELP mp3_skipped_count Number of batches not MP3 encoded because no output needed them.\n"
+            "# TYPE mp3_skipped_count counter\n");
+
+    for (int i = 0; i < device_count; i++) {
+        device_t* dev = devices + i;
+        for (int j = 0; j < dev->channel_count; j++) {
+            channel_t* channel = dev->channels + j;
+            if (channel->need_mp3) {
+                fprintf(f, "mp3_skipped_count{device=\"%d\",channel=\"%d\"}\t%zu\n", i, j, channel->mp3_skipped_count);
+            }
+        }
+    }
+    for (int i = 0; i < mixer_count; i++) {
+        mixer_t* mixer = mixers + i;
+        if (mixer->channel.need_mp3) {
+            fprintf(f, "mp3_skipped_count{mixer=\"%d\"}\t%zu\n", i, mixer->channel.mp3_skipped_count);
+        }
+    }
+    fprintf(f, "\n");
+}
+
+static void output_writer_stats(FILE* f) {
+    if (!async_file_writes) {
+        return;
+    }
+
+    writer_stats stats;
+    writer_get_stats(&stats);
+    fprintf(f,
+            "# HELP file_writer_queue_depth Number of file operations queued for the file writer thread.\n"
+            "# TYPE file_writer_queue_depth gauge\n"
+            "file_writer_queue_depth\t%d\n"
+            "\n"
+            "# HELP file_writer_queued_bytes Bytes of file data queued for the file writer thread.\n"
+            "# TYPE file_writer_queued_bytes gauge\n"
+            "file_writer_queued_bytes\t%zu\n"
+            "\n"
+            "# HELP file_writer_dropped_bytes Bytes of file data dropped because too much was queued.\n"
+            "# TYPE file_writer_dropped_bytes counter\n"
+            "file_writer_dropped_bytes\t%zu\n"
+            "\n",
+            stats.queue_depth, stats.queued_bytes, stats.dropped_bytes);
+}
+
 static void output_input_overruns(FILE* f) {
     if (mixer_count == 0) {
         return;
@@ -830,6 +1401,101 @@ static void output_input_overruns(FILE* f) {
     fprintf(f, "\n");
 }
 
+static void output_input_buffers(FILE* f) {
+    if (mixer_count == 0) {
+        return;
+    }
+
+    fprintf(f,
+            "# HELP input_underrun_count Number of mixer batches emitted without the input because it was late.\n"
+            "# TYPE input_underrun_count counter\n");
+    for (int i = 0; i < mixer_count; i++) {
+        mixer_t* mixer = mixers + i;
+        for (int j = 0; j < mixer->input_count; j++) {
+            fprintf(f, "input_underrun_count{mixer=\"%d\",input=\"%d\"}\t%zu\n", i, j, mixer->inputs[j].input_underrun_count);
+        }
+    }
+    fprintf(f, "\n");
+
+    fprintf(f,
+            "# HELP input_buffer_fill Number of batches waiting in the mixer input jitter buffer.\n"
+            "# TYPE input_buffer_fill gauge\n");
+    for (int i = 0; i < mixer_count; i++) {
+        mixer_t* mixer = mixers + i;
+        for (int j = 0; j < mixer->input_count; j++) {
+            mixinput_t* input = mixer->inputs + j;
+            fprintf(f, "input_buffer_fill{mixer=\"%d\",input=\"%d\",depth=\"%d\"}\t%u\n", i, j, input->slot_count, input->head - input->tail);
+        }
+    }
+    fprintf(f, "\n");
+
+    fprintf(f,
+            "# HELP input_drift_ppm Rate adjustment applied by mixer input drift compensation.\n"
+            "# TYPE input_drift_ppm gauge\n");
+    for (int i = 0; i < mixer_count; i++) {
+        mixer_t* mixer = mixers + i;
+        for (int j = 0; j < mixer->input_count; j++) {
+            if (mixer->inputs[j].drift_compensation) {
+                fprintf(f, "input_drift_ppm{mixer=\"%d\",input=\"%d\"}\t%.1f\n", i, j, mixer->inputs[j].drift * 1e6);
+            }
+        }
+    }
+    fprintf(f, "\n");
+}
+
+static void output_spectrum_overruns(FILE* f) {
+    bool header_written = false;
+    for (int i = 0; i < device_count; i++) {
+        device_t* dev = devices + i;
+        if (dev->spectrum == NULL || dev->spectrum->type == SPECTRUM_NONE) {
+            continue;
+        }
+        if (!header_written) {
+            fprintf(f,
+                    "# HELP spectrum_overrun_count Number of spectrum frames dropped because the previous frame was not published yet.\n"
+                    "# TYPE spectrum_overrun_count counter\n");
+            header_written = true;
+        }
+        fprintf(f, "spectrum_overrun_count{device=\"%d\"}\t%zu\n", i, dev->spectrum->overrun_count);
+    }
+    if (header_written) {
+        fprintf(f, "\n");
+    }
+}
+
+static void output_discovered_carriers(FILE* f) {
+    static const char* const metrics[] = {"discovered_carrier_dbfs", "discovered_carrier_duty_cycle"};
+    static const char* const help[] = {
+        "# HELP discovered_carrier_dbfs Peak power of a discovered carrier in the last frame it was seen in.\n"
+        "# TYPE discovered_carrier_dbfs gauge\n",
+        "# HELP discovered_carrier_duty_cycle Fraction of spectrum frames a discovered carrier was seen in since its discovery.\n"
+        "# TYPE discovered_carrier_duty_cycle gauge\n",
+    };
+    for (size_t m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++) {
+        bool header_written = false;
+        for (int i = 0; i < device_count; i++) {
+            discovery_t* discovery = devices[i].discovery;
+            if (discovery == NULL) {
+                continue;
+            }
+            if (!header_written) {
+                fprintf(f, "%s", help[m]);
+                header_written = true;
+            }
+            pthread_mutex_lock(&discovery->mutex);
+            for (int c = 0; c < discovery->carrier_count; c++) {
+                carrier_t* carrier = discovery->carriers + c;
+                float value = (m == 0 ? carrier->level : (float)carrier->active_frames / (discovery->frame - carrier->first_frame + 1));
+                fprintf(f, "%s{device=\"%d\",freq=\"%.3f\"}\t%.3f\n", metrics[m], i, carrier->freq / 1000000.0, value);
+            }
+            pthread_mutex_unlock(&discovery->mutex);
+        }
+        if (header_written) {
+            fprintf(f, "\n");
+        }
+    }
+}
+
 void write_stats_file(timeval* last_stats_write) {
     if (!stats_filepath) {
         return;
@@ -863,7 +1529,12 @@ void write_stats_file(timeval* last_stats_write) {
     output_channel_no_ctcss_counter(file);
     output_device_buffer_overflows(file);
     output_output_overruns(file);
+    output_mp3_skips(file);
+    output_writer_stats(file);
     output_input_overruns(file);
+    output_input_buffers(file);
+    output_spectrum_overruns(file);
+    output_discovered_carriers(file);
 
     fclose(file);
 }
@@ -872,24 +1543,53 @@ void* output_thread(void* param) {
     assert(param != NULL);
     output_params_t* output_param = (output_params_t*)param;
     struct freq_tag tag;
-    struct timeval tv;
     int new_freq = -1;
     timeval last_stats_write = {0, 0};
 
     debug_print("Starting output thread, devices %d:%d, mixers %d:%d, signal %p\n", output_param->device_start, output_param->device_end, output_param->mixer_start, output_param->mixer_end,
                 output_param->mp3_signal);
 
+    // Each pass takes a snapshot of the mixers and devices with a batch ready, gets all of
+    // their channels encoded (in parallel if there are encoder threads), then dispatches the
+    // frames. Batches becoming ready in the meantime wait for the next pass.
+    const int mixer_range = output_param->mixer_end - output_param->mixer_start;
+    const int device_range = output_param->device_end - output_param->device_start;
+    int channel_range = mixer_range;
+    for (int i = output_param->device_start; i < output_param->device_end; i++) {
+        channel_range += devices[i].channel_count;
+    }
+    bool* mixer_ready = (bool*)XCALLOC(mixer_range + 1, sizeof(bool));
+    bool* device_ready = (bool*)XCALLOC(device_range + 1, sizeof(bool));
+    channel_t** encode_channels = (channel_t**)XCALLOC(channel_range + 1, sizeof(channel_t*));
+    encode_job* encode_jobs = (encode_job*)XCALLOC(channel_range + 1, sizeof(encode_job));
+
 #ifdef DEBUG
     timeval ts, te;
     gettimeofday(&ts, NULL);
 #endif /* DEBUG */
     while (!do_exit) {
         output_param->mp3_signal->wait();
+        int encode_count = 0;
         for (int i = output_param->mixer_start; i < output_param->mixer_end; i++) {
-            if (mixers[i].enabled == false)
-                continue;
-            channel_t* channel = &mixers[i].channel;
-            if (channel->state == CH_READY) {
+            mixer_ready[i - output_param->mixer_start] = (mixers[i].enabled && mixers[i].channel.state == CH_READY);
+            if (mixer_ready[i - output_param->mixer_start]) {
+                encode_channels[encode_count++] = &mixers[i].channel;
+            }
+        }
+        for (int i = output_param->device_start; i < output_param->device_end; i++) {
+            device_t* dev = devices + i;
+            device_ready[i - output_param->device_start] = (dev->input->state == INPUT_RUNNING && dev->waveavail);
+            if (device_ready[i - output_param->device_start]) {
+                for (int j = 0; j < dev->channel_count; j++) {
+                    encode_channels[encode_count++] = dev->channels + j;
+                }
+            }
+        }
+        encoder_encode(encode_channels, encode_count, encode_jobs);
+
+        for (int i = output_param->mixer_start; i < output_param->mixer_end; i++) {
+            if (mixer_ready[i - output_param->mixer_start]) {
+                channel_t* channel = &mixers[i].channel;
                 process_outputs(channel, -1);
                 channel->state = CH_DIRTY;
             }
@@ -902,22 +1602,19 @@ void* output_thread(void* param) {
 #endif /* DEBUG */
         for (int i = output_param->device_start; i < output_param->device_end; i++) {
             device_t* dev = devices + i;
-            if (dev->input->state == INPUT_RUNNING && dev->waveavail) {
+            if (device_ready[i - output_param->device_start]) {
                 if (dev->mode == R_SCAN) {
-                    tag_queue_get(dev, &tag);
-                    if (tag.freq >= 0) {
-                        tag.tv.tv_sec += shout_metadata_delay;
-                        gettimeofday(&tv, NULL);
-                        if (tag.tv.tv_sec < tv.tv_sec || (tag.tv.tv_sec == tv.tv_sec && tag.tv.tv_usec <= tv.tv_usec)) {
-                            new_freq = tag.freq;
-                            tag_queue_advance(dev);
-                        }
+                    // switch metadata with the batch holding the first audio of the new frequency
+                    // (delayed by shout_metadata_delay), taking the latest tag if several are due
+                    const size_t batch_end = dev->output_samples - (size_t)shout_metadata_delay * dev->wave_rate;
+                    for (tag_queue_get(dev, &tag); tag.freq >= 0 && (ssize_t)(batch_end - tag.sample) > 0; tag_queue_get(dev, &tag)) {
+                        new_freq = tag.freq;
+                        tag_queue_advance(dev);
                     }
                 }
                 for (int j = 0; j < dev->channel_count; j++) {
                     channel_t* channel = devices[i].channels + j;
                     process_outputs(channel, new_freq);
-                    memcpy(channel->waveout, channel->waveout + WAVE_BATCH, AGC_EXTRA * 4);
                 }
                 dev->waveavail = 0;
             }
@@ -929,6 +1626,10 @@ void* output_thread(void* param) {
             write_stats_file(&last_stats_write);
         }
     }
+    free(encode_jobs);
+    free(encode_channels);
+    free(device_ready);
+    free(mixer_ready);
     return 0;
 }
 
@@ -952,7 +1653,7 @@ void* output_check_thread(void*) {
                         } else if (dev->input->state == INPUT_RUNNING) {
                             if (icecast->shout == NULL) {
                                 log(LOG_NOTICE, "Trying to reconnect to %s:%d/%s...\n", icecast->hostname, icecast->port, icecast->mountpoint);
-                                shout_setup(icecast, dev->channels[j].mode);
+                                shout_setup(icecast, dev->channels[j].mode, dev->channels[j].wave_rate);
                             }
                         }
                     } else if (dev->channels[j].outputs[k].type == O_UDP_STREAM) {
@@ -970,7 +1671,7 @@ void* output_check_thread(void*) {
                             }
                         } else if (dev->input->state == INPUT_RUNNING) {
                             if (pdata->context == NULL) {
-                                pulse_setup(pdata, dev->channels[j].mode);
+                                pulse_setup(pdata, dev->channels[j].mode, dev->channels[j].wave_rate);
                             }
                         }
 #endif /* WITH_PULSEAUDIO */
@@ -988,13 +1689,13 @@ void* output_check_thread(void*) {
                     icecast_data* icecast = (icecast_data*)(mixers[i].channel.outputs[k].data);
                     if (icecast->shout == NULL) {
                         log(LOG_NOTICE, "Trying to reconnect to %s:%d/%s...\n", icecast->hostname, icecast->port, icecast->mountpoint);
-                        shout_setup(icecast, mixers[i].channel.mode);
+                        shout_setup(icecast, mixers[i].channel.mode, mixers[i].channel.wave_rate);
                     }
 #ifdef WITH_PULSEAUDIO
                 } else if (mixers[i].channel.outputs[k].type == O_PULSE) {
                     pulse_data* pdata = (pulse_data*)(mixers[i].channel.outputs[k].data);
                     if (pdata->context == NULL) {
-                        pulse_setup(pdata, mixers[i].channel.mode);
+                        pulse_setup(pdata, mixers[i].channel.mode, mixers[i].channel.wave_rate);
                     }
 #endif /* WITH_PULSEAUDIO */
                 }
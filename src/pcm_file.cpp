@@ -0,0 +1,292 @@
+/*
+ * pcm_file.cpp
+ * WAV and FLAC file outputs
+ *
+ * Copyright (c) 2024 charlie-foxtrot
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <math.h>      // lrintf()
+#include <string.h>    // memcpy(), memcmp(), strerror()
+#include <sys/stat.h>  // fstat()
+#include <syslog.h>    // LOG_INFO / LOG_WARNING
+#include <unistd.h>    // ftruncate()
+#include <ctime>
+
+#include "rtl_airband.h"
+
+// WAV files get the canonical 44 byte header. While a file is being written, its size
+// fields hold the largest possible value, which readers of a growing file take as "up to
+// the end of the file". They are patched with the real sizes when the file is closed,
+// which also happens at the end of the hour and of each split_on_transmission file.
+#define WAV_HEADER_LEN 44
+#define WAV_STREAMING_LEN 0xFFFFFFFFu
+
+static void put_le16(unsigned char* p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char* p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = v >> 24;
+}
+
+static int pcm_channels(const channel_t* channel) {
+    return (channel->mode == MM_STEREO ? 2 : 1);
+}
+
+static void wav_header(unsigned char* h, int channels, int wave_rate) {
+    memcpy(h, "RIFF", 4);
+    put_le32(h + 4, WAV_STREAMING_LEN);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le32(h + 16, 16);  // fmt chunk length
+    put_le16(h + 20, 1);   // PCM
+    put_le16(h + 22, channels);
+    put_le32(h + 24, wave_rate);
+    put_le32(h + 28, wave_rate * channels * sizeof(int16_t));  // bytes per second
+    put_le16(h + 32, channels * sizeof(int16_t));              // bytes per sample frame
+    put_le16(h + 34, 16);                                      // bits per sample
+    memcpy(h + 36, "data", 4);
+    put_le32(h + 40, WAV_STREAMING_LEN);
+}
+
+// header h of an existing file describes the same format as our header ref (size fields aside)
+static bool wav_header_matches(const unsigned char* h, const unsigned char* ref) {
+    return memcmp(h, ref, 4) == 0 && memcmp(h + 8, ref + 8, 32) == 0;
+}
+
+static void log_writing(const file_data* fdata) {
+    if (!fdata->split_on_transmission) {
+        log(LOG_INFO, "Writing to %s\n", fdata->file_path.c_str());
+    } else {
+        debug_print("Writing to %s\n", fdata->file_path_tmp.c_str());
+    }
+}
+
+// Continues an existing WAV file of the same format, filling the time it was not written
+// to with silence in continuous mode. Returns 1 if fdata->f does not hold a WAV file to
+// append to (it may be empty after a crash), -1 on error.
+static int wav_append(file_data* fdata, const channel_t* channel, const unsigned char* header) {
+    struct stat st = {};
+    unsigned char existing[WAV_HEADER_LEN];
+    if (fstat(fileno(fdata->f), &st) != 0 || st.st_size < WAV_HEADER_LEN || fread(existing, 1, WAV_HEADER_LEN, fdata->f) != WAV_HEADER_LEN) {
+        return 1;
+    }
+    if (!wav_header_matches(existing, header)) {
+        log(LOG_WARNING, "%s is not a WAV file of the same format, can't append to it\n", fdata->file_path.c_str());
+        errno = EINVAL;
+        return -1;
+    }
+
+    // drop a partial sample frame left by an interrupted write
+    const off_t frame = pcm_channels(channel) * sizeof(int16_t);
+    const off_t end = WAV_HEADER_LEN + (st.st_size - WAV_HEADER_LEN) / frame * frame;
+    if ((end != st.st_size && ftruncate(fileno(fdata->f), end) != 0) || fseeko(fdata->f, end, SEEK_SET) != 0) {
+        return -1;
+    }
+    log(LOG_INFO, "Appending from pos %llu to %s\n", (unsigned long long)end, fdata->file_path.c_str());
+
+    if (fdata->continuous) {
+        time_t now = time(NULL);
+        if (now > st.st_mtime) {
+            time_t delta = now - st.st_mtime;
+            if (delta > 3600) {
+                log(LOG_WARNING, "Too big time difference: %llu sec, limiting to one hour\n", (unsigned long long)delta);
+                delta = 3600;
+            }
+            const size_t second_len = channel->wave_rate * frame;
+            unsigned char* silence = (unsigned char*)XCALLOC(1, second_len);
+            for (; delta > 0; --delta) {
+                if (fwrite(silence, 1, second_len, fdata->f) != second_len) {
+                    log(LOG_WARNING, "Problem writing %s (%s)\n", fdata->file_path.c_str(), strerror(errno));
+                    break;
+                }
+            }
+            free(silence);
+        }
+    }
+    return 0;
+}
+
+static int wav_open(file_data* fdata, const channel_t* channel) {
+    unsigned char header[WAV_HEADER_LEN];
+    wav_header(header, pcm_channels(channel), channel->wave_rate);
+
+    // the header is patched in place on close, so the file can't be opened in append mode
+    if (fdata->append && (fdata->f = fopen(fdata->file_path_tmp.c_str(), "r+")) != NULL) {
+        int ret = wav_append(fdata, channel, header);
+        if (ret <= 0) {
+            if (ret < 0) {
+                int saved_errno = errno;
+                fclose(fdata->f);
+                fdata->f = NULL;
+                errno = saved_errno;
+            }
+            return ret;
+        }
+        fclose(fdata->f);
+    }
+
+    fdata->f = fopen(fdata->file_path_tmp.c_str(), "w+");
+    if (fdata->f == NULL) {
+        return -1;
+    }
+    if (fwrite(header, 1, WAV_HEADER_LEN, fdata->f) != WAV_HEADER_LEN) {
+        int saved_errno = errno;
+        fclose(fdata->f);
+        fdata->f = NULL;
+        errno = saved_errno;
+        return -1;
+    }
+    log_writing(fdata);
+    return 0;
+}
+
+static void wav_close(file_data* fdata) {
+    unsigned char len[4];
+    off_t size = (fseeko(fdata->f, 0, SEEK_END) == 0 ? ftello(fdata->f) : -1);
+    if (size >= WAV_HEADER_LEN) {
+        // files of more than 4 GB keep the streaming sizes
+        uint32_t data_len = (size - WAV_HEADER_LEN < (off_t)WAV_STREAMING_LEN - 36 ? (uint32_t)(size - WAV_HEADER_LEN) : WAV_STREAMING_LEN - 36);
+        put_le32(len, data_len + 36);
+        bool ok = (fseeko(fdata->f, 4, SEEK_SET) == 0 && fwrite(len, 1, 4, fdata->f) == 4);
+        put_le32(len, data_len);
+        ok = ok && (fseeko(fdata->f, 40, SEEK_SET) == 0 && fwrite(len, 1, 4, fdata->f) == 4);
+        if (!ok) {
+            log(LOG_WARNING, "Could not update the header of %s (%s)\n", fdata->file_path.c_str(), strerror(errno));
+        }
+    }
+    fclose(fdata->f);
+}
+
+#ifdef WITH_FLAC
+// libFLAC writes the STREAMINFO block again with the final sample count and MD5 sum
+// when the encoder is finished. A FLAC stream can't be continued, so FLAC files are
+// always written from the start (append is rejected in the configuration).
+static int flac_open(file_data* fdata, const channel_t* channel) {
+    fdata->f = fopen(fdata->file_path_tmp.c_str(), "w+b");
+    if (fdata->f == NULL) {
+        return -1;
+    }
+    FLAC__StreamEncoder* flac = FLAC__stream_encoder_new();
+    if (flac == NULL) {
+        log(LOG_WARNING, "FLAC__stream_encoder_new failed\n");
+        fclose(fdata->f);
+        fdata->f = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+    FLAC__stream_encoder_set_channels(flac, pcm_channels(channel));
+    FLAC__stream_encoder_set_bits_per_sample(flac, 16);
+    FLAC__stream_encoder_set_sample_rate(flac, channel->wave_rate);
+    FLAC__stream_encoder_set_compression_level(flac, FLAC_COMPRESSION_LEVEL);
+    // from here on, the encoder owns the file and closes it when finished
+    FLAC__StreamEncoderInitStatus status = FLAC__stream_encoder_init_FILE(flac, fdata->f, NULL, NULL);
+    if (status != FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+        log(LOG_WARNING, "Could not initialize FLAC encoder for %s: %s\n", fdata->file_path.c_str(), FLAC__StreamEncoderInitStatusString[status]);
+        FLAC__stream_encoder_delete(flac);
+        fdata->f = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    fdata->flac = flac;
+    fdata->flac_buf = (FLAC__int32*)XCALLOC(channel->wave_batch * pcm_channels(channel), sizeof(FLAC__int32));  // freed by pcm_file_close()
+    log_writing(fdata);
+    return 0;
+}
+#endif /* WITH_FLAC */
+
+void pcm_setup(channel_t* channel) {
+    channel->pcm = (int16_t*)XCALLOC(channel->wave_batch * pcm_channels(channel), sizeof(int16_t));
+    channel->pcm_bytes = 0;
+}
+
+// Converts the current batch into interleaved 16-bit samples, returns their length in bytes
+int pcm_encode(channel_t* channel) {
+    const float* left = channel->waveout + channel->waveout_ofs;
+    const int channels = pcm_channels(channel);
+    for (size_t i = 0; i < channel->wave_batch; i++) {
+        for (int c = 0; c < channels; c++) {
+            float sample = (c == 0 ? left[i] : channel->waveout_r[i]);
+            if (sample > 1.0f) {
+                sample = 1.0f;
+            } else if (sample < -1.0f) {
+                sample = -1.0f;
+            }
+            channel->pcm[i * channels + c] = (int16_t)lrintf(sample * 32767.0f);
+        }
+    }
+    return channel->wave_batch * channels * sizeof(int16_t);
+}
+
+// Opens fdata->file_path_tmp, which output_file_ready() has moved an existing file to
+int pcm_file_open(file_data* fdata, const channel_t* channel) {
+#ifdef WITH_FLAC
+    if (fdata->codec == AC_FLAC) {
+        return flac_open(fdata, channel);
+    }
+#endif /* WITH_FLAC */
+    return wav_open(fdata, channel);
+}
+
+// Writes len bytes of samples as produced by pcm_encode(), possibly several batches of them
+bool pcm_file_write(file_data* fdata, const channel_t* channel, const void* data, size_t len) {
+#ifdef WITH_FLAC
+    if (fdata->codec == AC_FLAC) {
+        const int16_t* samples = (const int16_t*)data;
+        const size_t batch = channel->wave_batch * pcm_channels(channel);
+        size_t count = len / sizeof(int16_t);
+        while (count > 0) {
+            const size_t n = (count < batch ? count : batch);
+            for (size_t i = 0; i < n; i++) {
+                fdata->flac_buf[i] = samples[i];
+            }
+            if (!FLAC__stream_encoder_process_interleaved(fdata->flac, fdata->flac_buf, n / pcm_channels(channel))) {
+                log(LOG_WARNING, "FLAC encoding for %s failed: %s\n", fdata->file_path.c_str(), FLAC__stream_encoder_get_resolved_state_string(fdata->flac));
+                return false;
+            }
+            samples += n;
+            count -= n;
+        }
+        return true;
+    }
+#else
+    UNUSED(channel);
+#endif /* WITH_FLAC */
+    // WAV samples are little endian, as are the hosts we run on
+    return fwrite(data, 1, len, fdata->f) == len;
+}
+
+// Completes the header of the file and closes it
+void pcm_file_close(file_data* fdata) {
+#ifdef WITH_FLAC
+    if (fdata->codec == AC_FLAC) {
+        if (!FLAC__stream_encoder_finish(fdata->flac)) {
+            log(LOG_WARNING, "Could not finish FLAC file %s\n", fdata->file_path.c_str());
+        }
+        FLAC__stream_encoder_delete(fdata->flac);
+        fdata->flac = NULL;
+        // with async_file_writes, fdata is a copy which goes away with the file
+        free(fdata->flac_buf);
+        fdata->flac_buf = NULL;
+        return;
+    }
+#endif /* WITH_FLAC */
+    wav_close(fdata);
+}
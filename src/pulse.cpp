@@ -122,11 +122,11 @@ static void pulse_setup_streams(pulse_data* pdata) {
     const pa_sample_spec ss = {
 #if __cplusplus >= 199711L
         .format = PA_SAMPLE_FLOAT32LE,
-        .rate = WAVE_RATE,
+        .rate = (uint32_t)pdata->wave_rate,
         .channels = 1
 #else  // for g++ 4.6 (eg. Raspbian Wheezy)
         PA_SAMPLE_FLOAT32LE,
-        WAVE_RATE,
+        (uint32_t)pdata->wave_rate,
         1
 #endif /* __cplusplus */
     };
@@ -174,12 +174,13 @@ void pulse_init() {
     }
 }
 
-int pulse_setup(pulse_data* pdata, mix_modes mixmode) {
+int pulse_setup(pulse_data* pdata, mix_modes mixmode, int wave_rate) {
     if (!(pdata->context = pa_context_new(pa_threaded_mainloop_get_api(mainloop), pdata->name))) {
         log(LOG_ERR, "%s", "pulse: failed to create context\n");
         return -1;
     }
     pdata->mode = mixmode;
+    pdata->wave_rate = wave_rate;
     PA_LOOP_LOCK(mainloop);
     int ret = 0;
     pa_context_set_state_callback(pdata->context, &pulse_ctx_state_cb, pdata);
@@ -0,0 +1,112 @@
+/*
+ * resampler.cpp
+ *
+ * Copyright (C) 2024 charlie-foxtrot
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <cstring>
+
+#include "logging.h"  // debug_print()
+
+#include "resampler.h"
+
+using namespace std;
+
+// Default constructor is no resampling
+Resampler::Resampler(void) : enabled_(false), base_step_(1.0), step_(1.0), pos_(0.0), taps_(1), history_{0.0}, prev_(0.0) {}
+
+Resampler::Resampler(int in_rate, int out_rate, bool adaptive)
+    : enabled_(adaptive || in_rate != out_rate), base_step_(1.0), step_(1.0), pos_(0.0), taps_(1), history_{0.0}, prev_(0.0) {
+    if (!enabled_ || in_rate <= 0 || out_rate <= 0) {
+        enabled_ = false;
+        return;
+    }
+    step_ = base_step_ = (double)in_rate / (double)out_rate;
+    // align the last output sample of a batch with the last input sample
+    pos_ = step_ - 1.0;
+
+    // when decimating, average as many input samples as there are per output sample
+    if (step_ > 1.0) {
+        taps_ = (int)round(step_);
+        if (taps_ > max_taps_) {
+            taps_ = max_taps_;
+        }
+    }
+    debug_print("Resampling %d Hz to %d Hz, step %f, %d filter taps\n", in_rate, out_rate, step_, taps_);
+}
+
+void Resampler::process(const float* in, size_t in_len, float* out, size_t out_len) {
+    if (!enabled_) {
+        memcpy(out, in, (in_len < out_len ? in_len : out_len) * sizeof(float));
+        return;
+    }
+
+    size_t written = process_variable(in, in_len, out, out_len);
+
+    // rounding may leave the batch a sample short
+    for (; written < out_len; written++) {
+        out[written] = prev_;
+    }
+}
+
+// Emits every output sample falling within the input batch (up to out_max) and returns
+// their count. With an adjusted ratio this varies from batch to batch.
+size_t Resampler::process_variable(const float* in, size_t in_len, float* out, size_t out_max) {
+    size_t written = 0;
+    for (size_t i = 0; i < in_len; i++) {
+        for (int t = taps_ - 1; t > 0; t--) {
+            history_[t] = history_[t - 1];
+        }
+        history_[0] = in[i];
+
+        float cur = 0.0f;
+        for (int t = 0; t < taps_; t++) {
+            cur += history_[t];
+        }
+        cur /= taps_;
+
+        // emit every output sample lying between the previous filtered sample and this one
+        while (pos_ <= (double)i && written < out_max) {
+            float frac = (float)(pos_ - ((double)i - 1.0));
+            out[written++] = prev_ + (cur - prev_) * frac;
+            pos_ += step_;
+        }
+        prev_ = cur;
+    }
+    pos_ -= (double)in_len;
+    return written;
+}
+
+// Advances over a batch of silence without computing it. Returns the count of output
+// samples process_variable() would have emitted.
+size_t Resampler::skip(size_t in_len) {
+    size_t count = 0;
+    while (pos_ <= (double)in_len - 1.0) {
+        pos_ += step_;
+        count++;
+    }
+    pos_ -= (double)in_len;
+    memset(history_, 0, sizeof(history_));
+    prev_ = 0.0f;
+    return count;
+}
+
+// Trims the ratio by the given relative amount. Positive values consume input faster,
+// ie. produce fewer output samples per input batch.
+void Resampler::set_adjustment(double adjustment) {
+    step_ = base_step_ * (1.0 + adjustment);
+}
@@ -0,0 +1,54 @@
+/*
+ * resampler.h
+ *
+ * Copyright (C) 2024 charlie-foxtrot
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RESAMPLER_H
+#define _RESAMPLER_H 1
+
+#include <cstddef>  // size_t
+
+// Streaming sample rate converter for audio batches. Uses linear interpolation, preceded
+// by a boxcar anti-aliasing filter when decimating. State is carried over between calls,
+// so consecutive batches join without discontinuities.
+//
+// An adaptive resampler is enabled even for equal rates. Its ratio can be trimmed with
+// set_adjustment() to follow clock drift between the producer and the consumer, in which
+// case the number of output samples per batch varies and process_variable() is used.
+class Resampler {
+   public:
+    Resampler(void);
+    Resampler(int in_rate, int out_rate, bool adaptive = false);
+    bool enabled(void) const { return enabled_; }
+    void process(const float* in, size_t in_len, float* out, size_t out_len);
+    size_t process_variable(const float* in, size_t in_len, float* out, size_t out_max);
+    size_t skip(size_t in_len);
+    void set_adjustment(double adjustment);
+
+   private:
+    static const int max_taps_ = 8;
+
+    bool enabled_;
+    double base_step_;          // input samples per output sample at the nominal rates
+    double step_;               // input samples per output sample
+    double pos_;                // position of the next output sample, relative to the start of the current input batch
+    int taps_;                  // length of the anti-aliasing filter
+    float history_[max_taps_];  // most recent input samples, newest first
+    float prev_;                // last filtered sample of the previous batch
+};
+
+#endif /* _RESAMPLER_H */
@@ -74,17 +74,23 @@ int device_count, mixer_count;
 static int devices_running = 0;
 int tui = 0;  // do not display textual user interface
 int shout_metadata_delay = 3;
+int wave_batch_ms = DEFAULT_WAVE_BATCH_MS;
 volatile int do_exit = 0;
 bool use_localtime = false;
 bool multiple_demod_threads = false;
 bool multiple_output_threads = false;
+int mixer_threads = 1;
+int mp3_encoder_threads = 0;
+int lame_pool_size = DEFAULT_LAME_POOL_SIZE;
+bool async_file_writes = false;
+enum fsync_policies file_fsync = FSYNC_NEVER;
 bool log_scan_activity = false;
 char* stats_filepath = NULL;
 size_t fft_size_log = DEFAULT_FFT_SIZE_LOG;
 size_t fft_size = 1 << fft_size_log;
 
 #ifdef NFM
-float alpha = exp(-1.0f / (WAVE_RATE * 2e-4));
+int tau = 200;  // NFM de-emphasis time constant in microseconds
 enum fm_demod_algo { FM_FAST_ATAN2, FM_QUADRI_DEMOD };
 enum fm_demod_algo fm_demod = FM_FAST_ATAN2;
 #endif /* NFM */
@@ -98,46 +104,306 @@ void sighandler(int sig) {
     do_exit = 1;
 }
 
+// Store a sample in the waveout ring of a channel. The first wave_batch ring positions are
+// mirrored past the end of the ring, so that outputs can read any batch without wrapping.
+static inline void waveout_put(channel_t* channel, size_t idx, float value) {
+    channel->waveout[idx] = value;
+    if (idx < channel->wave_batch) {
+        channel->waveout[idx + channel->wave_ring_len] = value;
+    }
+}
+
+struct scan_schedule_t {
+    int cursor;           // next position in round-robin order, unless scanning in a group
+    int priority_cursor;  // next priority position to revisit
+    int hops;             // hops since a priority position has last been visited
+};
+
+// Takes position p for the device. Devices of a scan group claim positions, so that no
+// position is scanned by two devices at a time.
+static bool scan_claim(device_t* dev, int p, int current) {
+    scan_group_t* group = dev->scan_group;
+    if (group == NULL) {
+        return true;
+    }
+    if (!__sync_bool_compare_and_swap(&group->holder[p], -1, (int)(dev - devices))) {
+        return false;
+    }
+    __sync_synchronize();
+    group->holder[current] = -1;
+    return true;
+}
+
+// Picks the position to scan next. Positions come in round-robin order (taken from the
+// shared cursor by devices of a scan group), with a priority position slipped in every
+// scan_priority_hops hops.
+static int scan_next_position(device_t* dev, scan_schedule_t* schedule, int current) {
+    const int count = dev->scan_position_count;
+    if (dev->scan_priority_hops > 0 && ++schedule->hops >= dev->scan_priority_hops) {
+        for (int k = 0; k < count; k++) {
+            const int p = (schedule->priority_cursor + k) % count;
+            if (dev->scan_positions[p].priority && p != current && scan_claim(dev, p, current)) {
+                schedule->priority_cursor = (p + 1) % count;
+                schedule->hops = 0;
+                return p;
+            }
+        }
+    }
+    for (int attempt = 0; attempt < count; attempt++) {
+        int p;
+        if (dev->scan_group != NULL) {
+            p = __sync_fetch_and_add(&dev->scan_group->next, 1) % count;
+        } else {
+            p = schedule->cursor;
+            schedule->cursor = (p + 1) % count;
+        }
+        if (p != current && scan_claim(dev, p, current)) {
+            if (dev->scan_positions[p].priority) {
+                schedule->hops = 0;
+            }
+            return p;
+        }
+    }
+    return current;
+}
+
+// Dwell time at a position grows from scan_dwell_ms towards scan_max_dwell_ms with the
+// activity of its busiest frequency, so that busy frequencies get a better chance of
+// being caught while quiet ones cost little retune time.
+static int scan_dwell_batches(const device_t* dev, const scan_position_t* pos, int batch_ms) {
+    float activity = 0.0f;
+    for (int k = 0; k < pos->freq_count; k++) {
+        activity = std::max(activity, dev->channels[0].freqlist[pos->freq_idx[k]].activity);
+    }
+    const int dwell_ms = dev->scan_dwell_ms + (int)((dev->scan_max_dwell_ms - dev->scan_dwell_ms) * activity);
+    return std::max(1, (dwell_ms + batch_ms - 1) / batch_ms);
+}
+
+// Updates the activity of the frequencies of a position being left. active_counter grows
+// with every batch a squelch is open, so any change since the arrival is a visit with signal.
+static void scan_update_activity(device_t* dev, const scan_position_t* pos, const size_t* arrival_counters) {
+    for (int k = 0; k < pos->freq_count; k++) {
+        freq_t* fparms = dev->channels[0].freqlist + pos->freq_idx[k];
+        const float active = fparms->active_counter != arrival_counters[k] ? 1.0f : 0.0f;
+        fparms->activity += (active - fparms->activity) / SCAN_ACTIVITY_VISITS;
+    }
+}
+
+static void scan_save_arrival_counters(const device_t* dev, const scan_position_t* pos, size_t* arrival_counters) {
+    for (int k = 0; k < pos->freq_count; k++) {
+        arrival_counters[k] = dev->channels[0].freqlist[pos->freq_idx[k]].active_counter;
+    }
+}
+
+// Scan controller. The demodulator reports each audio batch through dev->scan_signal,
+// so the squelch is judged on every batch rather than polled. A position is left
+// after its dwell time if no squelch has opened there, or scan_hang_ms after a squelch
+// has last been open. Banked multichannel devices are driven the same way, the squelch
+// of any channel of the current bank keeping the tuner there. After each retune the
+// demodulator discards the samples received before the tuner settled (see
+// scan_discard_stale()), so that batches counted here always come from the current position.
 void* controller_thread(void* params) {
     device_t* dev = (device_t*)params;
-    int i = 0;
-    int consecutive_squelch_off = 0;
-    int new_centerfreq = 0;
-    struct timeval tv;
+    channel_t* channel = dev->channels;
+    int i = dev->scan_position;
+    int active_idx = -1;  // frequency with activity already reported at the current position
+    struct timeval tv, last_stats_save;
 
-    if (dev->channels[0].freq_count < 2)
+    if (dev->scan_position_count < 2)
         return 0;
+
+    scan_stats_load(dev);
+    gettimeofday(&last_stats_save, NULL);
+    scan_schedule_t schedule = {(i + 1) % dev->scan_position_count, 0, 0};
+    size_t* arrival_counters = (size_t*)XCALLOC(channel->freq_count, sizeof(size_t));
+    scan_save_arrival_counters(dev, dev->scan_positions + i, arrival_counters);
+
+    const int batch_ms = 1000 * dev->wave_batch / dev->wave_rate;
+    int dwell_batches = scan_dwell_batches(dev, dev->scan_positions + i, batch_ms);
+    const int hang_batches = std::max(1, (dev->scan_hang_ms + batch_ms - 1) / batch_ms);
+    const size_t settle_bytes = (size_t)((uint64_t)dev->scan_settle_ms * dev->input->sample_rate / 1000) * 2 * dev->input->bytes_per_sample;
+
     while (!do_exit) {
-        SLEEP(200);
-        if (dev->channels[0].axcindicate == NO_SIGNAL) {
-            if (consecutive_squelch_off < 10) {
-                consecutive_squelch_off++;
-            } else {
-                i++;
-                i %= dev->channels[0].freq_count;
-                dev->channels[0].freq_idx = i;
-                new_centerfreq = dev->channels[0].freqlist[i].frequency + 20 * (double)(dev->input->sample_rate / fft_size);
-                if (input_set_centerfreq(dev->input, new_centerfreq) < 0) {
-                    break;
-                }
-            }
-        } else {
-            if (consecutive_squelch_off == 10) {
+        dev->scan_signal->timed_wait(100);
+        if (dev->scan_retunes_seen != dev->scan_retunes) {
+            continue;  // demodulator is still discarding samples from before the last retune
+        }
+        const int batches = dev->scan_batches;
+        const int last_open = dev->scan_last_open;
+        if (last_open > 0) {
+            const int freq_idx = channel->freq_idx;
+            if (dev->mode == R_SCAN && freq_idx != active_idx) {
+                active_idx = freq_idx;
                 if (log_scan_activity)
-                    log(LOG_INFO, "Activity on %7.3f MHz\n", dev->channels[0].freqlist[i].frequency / 1000000.0);
-                if (i != dev->last_frequency) {
+                    log(LOG_INFO, "Activity on %7.3f MHz\n", channel->freqlist[freq_idx].frequency / 1000000.0);
+                if (freq_idx != dev->last_frequency) {
                     // squelch has just opened on a new frequency - we might need to update outputs' metadata
-                    gettimeofday(&tv, NULL);
-                    tag_queue_put(dev, i, tv);
-                    dev->last_frequency = i;
+                    tag_queue_put(dev, freq_idx, dev->scan_open_sample);
+                    dev->last_frequency = freq_idx;
                 }
             }
-            consecutive_squelch_off = 0;
+            if (batches - last_open < hang_batches) {
+                continue;
+            }
+        } else if (batches < dwell_batches) {
+            continue;
         }
+
+        const int next = scan_next_position(dev, &schedule, i);
+        if (next == i) {
+            continue;  // all other positions are held by other devices of the scan group
+        }
+        scan_update_activity(dev, dev->scan_positions + i, arrival_counters);
+        i = next;
+        if (input_set_centerfreq(dev->input, dev->scan_positions[i].centerfreq) < 0) {
+            break;
+        }
+        // anything received up to now, and during the settle period, is stale
+        pthread_mutex_lock(&dev->input->buffer_lock);
+        dev->retune_mark = dev->input->write_count + settle_bytes;
+        pthread_mutex_unlock(&dev->input->buffer_lock);
+        dev->scan_position = i;
+        __sync_synchronize();
+        dev->scan_retunes++;
+        active_idx = -1;
+        scan_save_arrival_counters(dev, dev->scan_positions + i, arrival_counters);
+        dwell_batches = scan_dwell_batches(dev, dev->scan_positions + i, batch_ms);
+
+        gettimeofday(&tv, NULL);
+        if (tv.tv_sec - last_stats_save.tv_sec >= SCAN_STATS_SAVE_INTERVAL) {
+            scan_stats_save(dev);
+            last_stats_save = tv;
+        }
+    }
+    if (dev->scan_group != NULL) {
+        dev->scan_group->holder[i] = -1;
     }
+    scan_stats_save(dev);
+    free(arrival_counters);
     return 0;
 }
 
+// Points the scan channel, or its monitors when scanning wideband, to the frequencies
+// of the position the tuner has just been moved to. Banked multichannel devices get the
+// channels of the current bank demodulated.
+static void scan_apply_position(device_t* dev) {
+    const scan_position_t* pos = dev->scan_positions + dev->scan_position;
+    if (dev->mode == R_MULTICHANNEL) {
+        for (int j = 0; j < dev->channel_count; j++) {
+            channel_t* channel = dev->channels + j;
+            const bool idle = j < pos->first_channel || j >= pos->first_channel + pos->channel_count;
+            if (idle && !channel->idle) {
+                // outputs of the banks not being listened to carry silence until their next visit
+                channel->axcindicate = NO_SIGNAL;
+                channel->silence_pending = true;
+            }
+            channel->idle = idle;
+        }
+        return;
+    }
+    dev->channels[0].freq_idx = pos->freq_idx[0];
+    for (int m = 0; m < dev->scan_monitor_count; m++) {
+        const int j = dev->channel_count + m;
+        channel_t* monitor = dev->channels + j;
+        if (m >= pos->freq_count) {
+            monitor->idle = true;
+            continue;
+        }
+        monitor->freq_idx = pos->freq_idx[m];
+        const int freq = monitor->freqlist[monitor->freq_idx].frequency;
+        dev->base_bins[j] = dev->bins[j] = freq_to_fft_bin(dev->input, freq);
+        if (monitor->needs_raw_iq) {
+            monitor->dm_dphi = downmix_dphi(dev->input, dev->wave_rate, freq);
+            monitor->dm_phi = 0;
+        }
+        monitor->axcindicate = NO_SIGNAL;
+        monitor->idle = false;
+    }
+}
+
+// Wideband scanning: route the batch of one of the monitors to the scan channel outputs.
+// The frequency being listened to is kept while it is active, otherwise the first active
+// one is taken.
+static void scan_select_monitor(device_t* dev) {
+    channel_t* channel = dev->channels;
+    channel_t* current = NULL;
+    channel_t* selected = NULL;
+    for (int j = dev->channel_count; j < dev->channel_count + dev->scan_monitor_count; j++) {
+        channel_t* monitor = dev->channels + j;
+        if (monitor->idle) {
+            continue;
+        }
+        if (monitor->freq_idx == channel->freq_idx) {
+            current = monitor;
+        }
+        if (selected == NULL && monitor->axcindicate != NO_SIGNAL) {
+            selected = monitor;
+        }
+    }
+    if (current != NULL && (current->axcindicate != NO_SIGNAL || selected == NULL)) {
+        selected = current;
+    }
+    if (selected == NULL) {
+        selected = dev->channels + dev->channel_count;
+    }
+
+    const size_t ofs = selected->waveout_ofs;
+    const size_t wave_mask = channel->wave_ring_len - 1;
+    for (size_t k = 0; k < channel->wave_batch; k++) {
+        waveout_put(channel, (ofs + k) & wave_mask, selected->waveout[ofs + k]);
+    }
+    if (channel->has_iq_outputs) {
+        memcpy(channel->iq_out, selected->iq_out, 2 * channel->wave_batch * sizeof(float));
+    }
+    channel->waveout_ofs = ofs;
+    channel->axcindicate = selected->axcindicate;
+    channel->freq_idx = selected->freq_idx;
+}
+
+// true if a squelch is open at the current position: the scan channel, or any channel of the current bank
+static bool scan_position_open(const device_t* dev) {
+    const scan_position_t* pos = dev->scan_positions + dev->scan_position;
+    for (int j = pos->first_channel; j < pos->first_channel + pos->channel_count; j++) {
+        if (dev->channels[j].axcindicate != NO_SIGNAL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Starts the next batch at the next sample to be received. The demodulator silences the
+// first AGC_EXTRA samples of the batch, which are normally written with the batch before.
+static void scan_restart_batch(device_t* dev) {
+    dev->wavestart = dev->waveend;
+    dev->wave_restarted = true;
+}
+
+// Called by the demodulator for scanning devices. After a retune it drops input samples
+// received before the tuner settled and restarts the batch in progress, so that neither
+// the squelch nor the outputs see any of them. Returns true if samples have been dropped.
+static bool scan_discard_stale(device_t* dev, size_t available, size_t bps) {
+    const int retunes = dev->scan_retunes;
+    if (retunes != dev->scan_retunes_seen) {
+        __sync_synchronize();
+        scan_apply_position(dev);
+        scan_restart_batch(dev);
+        dev->scan_batches = dev->scan_last_open = 0;
+        dev->scan_retunes_seen = retunes;
+    }
+    // read_count and retune_mark wrap around, compare their difference
+    const size_t stale = dev->retune_mark - dev->read_count;
+    if ((ssize_t)stale <= 0) {
+        return false;
+    }
+    const size_t unit = bps * FFT_BATCH;
+    const size_t usable = (available - fft_size * dev->input->bytes_per_sample * 2) / unit;
+    const size_t units = std::min((stale + unit - 1) / unit, usable);
+    dev->input->bufs = (dev->input->bufs + units * unit) % dev->input->buf_size;
+    dev->read_count += units * unit;
+    scan_restart_batch(dev);
+    return true;
+}
+
 void multiply(float ar, float aj, float br, float bj, float* cr, float* cj) {
     *cr = ar * br - aj * bj;
     *cj = aj * br + ar * bj;
@@ -323,6 +589,9 @@ void* demodulate(void* params) {
         levels_s8[(uint8_t)i] = i / 128.0f;
     }
 
+    // when waiting for input, don't oversleep short audio batches
+    const useconds_t idle_usec = (wave_batch_ms * 1000 / 8 < 10000 ? wave_batch_ms * 1000 / 8 : 10000);
+
     // initialize fft window
     // blackman 7
     // the whole matrix is computed
@@ -391,13 +660,20 @@ void* demodulate(void* params) {
         }
 
         // number of input bytes per output wave sample (x 2 for I and Q)
-        size_t bps = 2 * dev->input->bytes_per_sample * (size_t)round((double)dev->input->sample_rate / (double)WAVE_RATE);
+        size_t bps = 2 * dev->input->bytes_per_sample * (size_t)round((double)dev->input->sample_rate / (double)dev->wave_rate);
         if (available < bps * FFT_BATCH + fft_size * dev->input->bytes_per_sample * 2) {
             // move to next device
             device_num = next_device(demod_params, device_num);
-            SLEEP(10);
+            usleep(idle_usec);
             continue;
         }
+        if (dev->scan_position_count > 0 && scan_discard_stale(dev, available, bps)) {
+            device_num = next_device(demod_params, device_num);
+            continue;
+        }
+        const size_t wave_batch = dev->wave_batch;
+        const size_t wave_mask = dev->wave_ring_len - 1;
+        const int demod_channels = dev->channel_count + dev->scan_monitor_count;
 
         if (dev->input->sfmt == SFMT_S16) {
             float const scale = 1.0f / dev->input->fullscale;
@@ -461,38 +737,79 @@ void* demodulate(void* params) {
 #endif /* WITH_BCM_VC */
 
 #ifdef WITH_BCM_VC
-        for (int i = 0; i < dev->channel_count; i++) {
-            float* wavein = dev->channels[i].wavein + dev->waveend;
-            __builtin_prefetch(wavein, 1);
+        for (int i = 0; i < demod_channels; i++) {
+            float* wavein = dev->channels[i].wavein;
+            __builtin_prefetch(wavein + (dev->waveend & wave_mask), 1);
             const int bin = dev->bins[i];
             const GPU_FFT_COMPLEX* fftout = fft->out + bin;
-            for (int j = 0; j < FFT_BATCH; j++, ++wavein, fftout += fft->step)
-                *wavein = sqrtf(fftout->im * fftout->im + fftout->re * fftout->re);
+            for (size_t j = dev->waveend; j < dev->waveend + FFT_BATCH; j++, fftout += fft->step)
+                wavein[j & wave_mask] = sqrtf(fftout->im * fftout->im + fftout->re * fftout->re);
         }
-        for (int j = 0; j < dev->channel_count; j++) {
+        for (int j = 0; j < demod_channels; j++) {
             if (dev->channels[j].needs_raw_iq) {
                 struct GPU_FFT_COMPLEX* ptr = fft->out;
-                for (int job = 0; job < FFT_BATCH; job++) {
-                    dev->channels[j].iq_in[2 * (dev->waveend + job)] = ptr[dev->bins[j]].re;
-                    dev->channels[j].iq_in[2 * (dev->waveend + job) + 1] = ptr[dev->bins[j]].im;
+                for (size_t job = dev->waveend; job < dev->waveend + FFT_BATCH; job++) {
+                    dev->channels[j].iq_in[2 * (job & wave_mask)] = ptr[dev->bins[j]].re;
+                    dev->channels[j].iq_in[2 * (job & wave_mask) + 1] = ptr[dev->bins[j]].im;
                     ptr += fft->step;
                 }
             }
         }
+        if (dev->spectrum) {
+            for (size_t b = 0; b < FFT_BATCH; b++) {
+                spectrum_add_fft(dev, (const float*)(fft->out + b * fft->step));
+            }
+        }
 #else
-        for (int j = 0; j < dev->channel_count; j++) {
-            dev->channels[j].wavein[dev->waveend] = sqrtf(fftout[dev->bins[j]][0] * fftout[dev->bins[j]][0] + fftout[dev->bins[j]][1] * fftout[dev->bins[j]][1]);
+        const size_t wavepos = dev->waveend & wave_mask;
+        for (int j = 0; j < demod_channels; j++) {
+            dev->channels[j].wavein[wavepos] = sqrtf(fftout[dev->bins[j]][0] * fftout[dev->bins[j]][0] + fftout[dev->bins[j]][1] * fftout[dev->bins[j]][1]);
             if (dev->channels[j].needs_raw_iq) {
-                dev->channels[j].iq_in[2 * dev->waveend] = fftout[dev->bins[j]][0];
-                dev->channels[j].iq_in[2 * dev->waveend + 1] = fftout[dev->bins[j]][1];
+                dev->channels[j].iq_in[2 * wavepos] = fftout[dev->bins[j]][0];
+                dev->channels[j].iq_in[2 * wavepos + 1] = fftout[dev->bins[j]][1];
             }
         }
+        if (dev->spectrum) {
+            spectrum_add_fft(dev, (const float*)fftout);
+        }
 #endif /* WITH_BCM_VC */
 
         dev->waveend += FFT_BATCH;
 
-        if (dev->waveend >= WAVE_BATCH + AGC_EXTRA) {
-            for (int i = 0; i < dev->channel_count; i++) {
+        if (dev->waveend - dev->wavestart >= wave_batch + AGC_EXTRA) {
+            if (dev->wave_restarted) {
+                // these would still hold audio of the frequency before a retune
+                for (int i = 0; i < demod_channels; i++) {
+                    channel_t* channel = dev->channels + i;
+                    for (size_t s = dev->wavestart; s < dev->wavestart + AGC_EXTRA; s++) {
+                        const size_t j = s & wave_mask;
+                        channel->waveout[j] = 0;
+                        if (j < wave_batch) {
+                            channel->waveout[j + dev->wave_ring_len] = 0;
+                        }
+                    }
+                }
+                dev->wave_restarted = false;
+            }
+            for (int i = 0; i < demod_channels; i++) {
+                if (dev->channels[i].idle) {
+                    channel_t* channel = dev->channels + i;
+                    if (channel->silence_pending) {
+                        // The outputs keep getting the last batch demodulated until this one
+                        // replaces it. It is written where the next batch would go, as the
+                        // outputs may still be reading the last one.
+                        for (size_t s = dev->wavestart; s < dev->wavestart + wave_batch; s++) {
+                            waveout_put(channel, s & wave_mask, 0);
+                        }
+                        if (channel->has_iq_outputs) {
+                            memset(channel->iq_out, 0, 2 * wave_batch * sizeof(float));
+                        }
+                        channel->waveout_ofs = dev->wavestart & wave_mask;
+                        channel->axcindicate = NO_SIGNAL;
+                        channel->silence_pending = false;
+                    }
+                    continue;
+                }
                 AFC afc(dev, i);
                 channel_t* channel = dev->channels + i;
                 freq_t* fparms = channel->freqlist + channel->freq_idx;
@@ -500,9 +817,15 @@ void* demodulate(void* params) {
                 // set to NO_SIGNAL, will be updated to SIGNAL based on squelch below
                 channel->axcindicate = NO_SIGNAL;
 
-                for (int j = AGC_EXTRA; j < WAVE_BATCH + AGC_EXTRA; j++) {
-                    float& real = channel->iq_in[2 * (j - AGC_EXTRA)];
-                    float& imag = channel->iq_in[2 * (j - AGC_EXTRA) + 1];
+                for (size_t s = dev->wavestart + AGC_EXTRA; s < dev->wavestart + wave_batch + AGC_EXTRA; s++) {
+                    // ring positions of the current sample and of the one AGC_EXTRA samples back
+                    const size_t j = s & wave_mask;
+                    const size_t d = (s - AGC_EXTRA) & wave_mask;
+                    // position in the current output batch
+                    const size_t o = s - AGC_EXTRA - dev->wavestart;
+
+                    float& real = channel->iq_in[2 * d];
+                    float& imag = channel->iq_in[2 * d + 1];
 
                     fparms->squelch.process_raw_sample(channel->wavein[j]);
 
@@ -532,16 +855,16 @@ void* demodulate(void* params) {
                     if (fparms->modulation == MOD_AM) {
                         // if squelch is just opening then bootstrip agcavgfast with prior values of wavein
                         if (fparms->squelch.first_open_sample()) {
-                            for (int k = j - AGC_EXTRA; k < j; k++) {
-                                if (channel->wavein[k] >= fparms->squelch.squelch_level()) {
-                                    fparms->agcavgfast = fparms->agcavgfast * 0.9f + channel->wavein[k] * 0.1f;
+                            for (size_t k = s - AGC_EXTRA; k < s; k++) {
+                                if (channel->wavein[k & wave_mask] >= fparms->squelch.squelch_level()) {
+                                    fparms->agcavgfast = fparms->agcavgfast * 0.9f + channel->wavein[k & wave_mask] * 0.1f;
                                 }
                             }
                         }
                         // if squelch is just closing then fade out the prior samples of waveout
                         else if (fparms->squelch.last_open_sample()) {
-                            for (int k = j - AGC_EXTRA + 1; k < j; k++) {
-                                channel->waveout[k] = channel->waveout[k - 1] * 0.94f;
+                            for (size_t k = s - AGC_EXTRA + 1; k < s; k++) {
+                                waveout_put(channel, k & wave_mask, channel->waveout[(k - 1) & wave_mask] * 0.94f);
                             }
                         }
                     }
@@ -555,7 +878,7 @@ void* demodulate(void* params) {
                                 fparms->agcavgfast = fparms->agcavgfast * 0.995f + channel->wavein[j] * 0.005f;
                             }
 
-                            waveout = (channel->wavein[j - AGC_EXTRA] - fparms->agcavgfast) / (fparms->agcavgfast * 1.5f);
+                            waveout = (channel->wavein[d] - fparms->agcavgfast) / (fparms->agcavgfast * 1.5f);
                             if (abs(waveout) > 0.8f) {
                                 waveout *= 0.85f;
                                 fparms->agcavgfast *= 1.15f;
@@ -605,23 +928,23 @@ void* demodulate(void* params) {
 
                         channel->axcindicate = SIGNAL;
                         if (channel->has_iq_outputs) {
-                            channel->iq_out[2 * (j - AGC_EXTRA)] = real;
-                            channel->iq_out[2 * (j - AGC_EXTRA) + 1] = imag;
+                            channel->iq_out[2 * o] = real;
+                            channel->iq_out[2 * o + 1] = imag;
                         }
 
                         // Squelch is closed
                     } else {
                         waveout = 0;
                         if (channel->has_iq_outputs) {
-                            channel->iq_out[2 * (j - AGC_EXTRA)] = 0;
-                            channel->iq_out[2 * (j - AGC_EXTRA) + 1] = 0;
+                            channel->iq_out[2 * o] = 0;
+                            channel->iq_out[2 * o + 1] = 0;
                         }
                     }
+                    if (j < wave_batch) {
+                        channel->waveout[j + dev->wave_ring_len] = waveout;
+                    }
                 }
-                memmove(channel->wavein, channel->wavein + WAVE_BATCH, (dev->waveend - WAVE_BATCH) * sizeof(float));
-                if (channel->needs_raw_iq) {
-                    memmove(channel->iq_in, channel->iq_in + 2 * WAVE_BATCH, (dev->waveend - WAVE_BATCH) * sizeof(float) * 2);
-                }
+                channel->waveout_ofs = dev->wavestart & wave_mask;
 
 #ifdef WITH_BCM_VC
                 afc.finalize(dev, i, fft->out);
@@ -629,7 +952,8 @@ void* demodulate(void* params) {
                 afc.finalize(dev, i, demod_params->fftout);
 #endif /* WITH_BCM_VC */
 
-                if (tui) {
+                // scan monitors share the scan channel line, show the one being listened to
+                if (tui && (i < dev->channel_count || channel->freq_idx == dev->channels[0].freq_idx)) {
                     char symbol = fparms->squelch.signal_outside_filter() ? '~' : (char)channel->axcindicate;
                     if (dev->mode == R_SCAN) {
                         GOTOXY(0, device_num * 17 + dev->row + 3);
@@ -646,13 +970,31 @@ void* demodulate(void* params) {
                     channel->freqlist[channel->freq_idx].active_counter++;
                 }
             }
+            if (dev->scan_monitor_count > 0) {
+                scan_select_monitor(dev);
+            }
+            dev->output_samples += wave_batch;
             if (dev->waveavail == 1) {
                 debug_print("devices[%d]: output channel overrun\n", device_num);
                 dev->output_overrun_count++;
             } else {
                 dev->waveavail = 1;
             }
-            dev->waveend -= WAVE_BATCH;
+            dev->wavestart += wave_batch;
+            // the backlog must not grow, or the ring would wrap over the batch the outputs read
+            assert(dev->waveend - dev->wavestart < wave_batch + AGC_EXTRA);
+            if (dev->scan_position_count > 0) {
+                dev->scan_batches++;
+                if (scan_position_open(dev)) {
+                    // remember where the audio of a newly opened frequency starts, for the metadata of outputs
+                    if (dev->scan_last_open != dev->scan_batches - 1 || dev->channels[0].freq_idx != dev->scan_open_freq) {
+                        dev->scan_open_sample = dev->output_samples - wave_batch;
+                        dev->scan_open_freq = dev->channels[0].freq_idx;
+                    }
+                    dev->scan_last_open = dev->scan_batches;
+                }
+                dev->scan_signal->send();
+            }
 #ifdef DEBUG
             gettimeofday(&te, NULL);
             debug_bulk_print("waveavail %lu.%lu %lu\n", te.tv_sec, (unsigned long)te.tv_usec, (te.tv_sec - ts.tv_sec) * 1000000UL + te.tv_usec - ts.tv_usec);
@@ -667,6 +1009,7 @@ void* demodulate(void* params) {
         }
 
         dev->input->bufs = (dev->input->bufs + bps * FFT_BATCH) % dev->input->buf_size;
+        dev->read_count += bps * FFT_BATCH;
         device_num = next_device(demod_params, device_num);
     }
 }
@@ -804,6 +1147,12 @@ int main(int argc, char* argv[]) {
             cerr << "Configuration error: shout_metadata_delay is out of allowed range (0-" << 2 * TAG_QUEUE_LEN << ")\n";
             error();
         }
+        if (root.exists("audio_batch_ms"))
+            wave_batch_ms = (int)(root["audio_batch_ms"]);
+        if (wave_batch_ms < MIN_WAVE_BATCH_MS || wave_batch_ms > MAX_WAVE_BATCH_MS) {
+            cerr << "Configuration error: audio_batch_ms is out of allowed range (" << MIN_WAVE_BATCH_MS << "-" << MAX_WAVE_BATCH_MS << ")\n";
+            error();
+        }
         if (root.exists("localtime") && (bool)root["localtime"] == true)
             use_localtime = true;
         if (root.exists("multiple_demod_threads") && (bool)root["multiple_demod_threads"] == true) {
@@ -817,13 +1166,50 @@ int main(int argc, char* argv[]) {
         if (root.exists("multiple_output_threads") && (bool)root["multiple_output_threads"] == true) {
             multiple_output_threads = true;
         }
+        if (root.exists("mp3_encoder_threads")) {
+            mp3_encoder_threads = (int)(root["mp3_encoder_threads"]);
+            if (mp3_encoder_threads < 0) {
+                cerr << "Configuration error: mp3_encoder_threads must not be negative\n";
+                error();
+            }
+        }
+        if (root.exists("lame_pool_size")) {
+            lame_pool_size = (int)(root["lame_pool_size"]);
+            if (lame_pool_size < 0) {
+                cerr << "Configuration error: lame_pool_size must not be negative\n";
+                error();
+            }
+        }
+        if (root.exists("async_file_writes") && (bool)root["async_file_writes"] == true) {
+            async_file_writes = true;
+        }
+        if (root.exists("file_fsync")) {
+            const char* policy = root["file_fsync"];
+            if (!strcmp(policy, "never")) {
+                file_fsync = FSYNC_NEVER;
+            } else if (!strcmp(policy, "close")) {
+                file_fsync = FSYNC_CLOSE;
+            } else if (!strcmp(policy, "periodic")) {
+                file_fsync = FSYNC_PERIODIC;
+            } else {
+                cerr << "Configuration error: file_fsync must be one of \"never\", \"close\" or \"periodic\"\n";
+                error();
+            }
+        }
+        if (root.exists("mixer_threads")) {
+            mixer_threads = (int)(root["mixer_threads"]);
+            if (mixer_threads < 1) {
+                cerr << "Configuration error: mixer_threads must be greater than 0\n";
+                error();
+            }
+        }
         if (root.exists("log_scan_activity") && (bool)root["log_scan_activity"] == true)
             log_scan_activity = true;
         if (root.exists("stats_filepath"))
             stats_filepath = strdup(root["stats_filepath"]);
 #ifdef NFM
         if (root.exists("tau"))
-            alpha = ((int)root["tau"] == 0 ? 0.0f : exp(-1.0f / (WAVE_RATE * 1e-6 * (int)root["tau"])));
+            tau = (int)root["tau"];
 #endif /* NFM */
 
         Setting& devs = config.lookup("devices");
@@ -944,27 +1330,45 @@ int main(int argc, char* argv[]) {
 
     for (int i = 0; i < mixer_count; i++) {
         if (mixers[i].enabled == false) {
-            continue;  // no inputs connected = no need to initialize output
+            // no inputs connected = no need to initialize output, but mixers fed by this
+            // sub-mix (coming later in the array) must not wait for it
+            channel_t* channel = &mixers[i].channel;
+            for (int k = 0; k < channel->output_count; k++) {
+                if (channel->outputs[k].type == O_MIXER) {
+                    mixer_data* mdata = (mixer_data*)channel->outputs[k].data;
+                    mixer_t* parent = mdata->mixer;
+                    parent->input_mask[mdata->input] = false;
+                    parent->enabled = std::find(parent->input_mask, parent->input_mask + parent->input_count, true) != parent->input_mask + parent->input_count;
+                }
+            }
+            continue;
         }
+        mixer_setup(&mixers[i]);
         channel_t* channel = &mixers[i].channel;
         if (channel->need_mp3) {
-            channel->lame = airlame_init(mixers[i].channel.mode, mixers[i].channel.highpass, mixers[i].channel.lowpass);
-            channel->lamebuf = (unsigned char*)malloc(sizeof(unsigned char) * LAMEBUF_SIZE);
+            lame_setup(channel);
+        }
+        if (channel->need_vorbis && !vorbis_setup(channel)) {
+            cerr << "Failed to initialize Vorbis encoder for mixer " << i << " - aborting\n";
+            error();
+        }
+        if (channel->need_pcm) {
+            pcm_setup(channel);
         }
         for (int k = 0; k < channel->output_count; k++) {
             output_t* output = channel->outputs + k;
             if (output->type == O_ICECAST) {
-                shout_setup((icecast_data*)(output->data), channel->mode);
+                shout_setup((icecast_data*)(output->data), channel->mode, channel->wave_rate);
             } else if (output->type == O_UDP_STREAM) {
                 udp_stream_data* sdata = (udp_stream_data*)(output->data);
-                if (!udp_stream_init(sdata, channel->mode, (size_t)WAVE_BATCH * sizeof(float))) {
+                if (!udp_stream_init(sdata, channel->mode, channel->wave_rate, channel->wave_batch * sizeof(float))) {
                     cerr << "Failed to initialize mixer " << i << " output " << k << " - aborting\n";
                     error();
                 }
 #ifdef WITH_PULSEAUDIO
             } else if (output->type == O_PULSE) {
                 pulse_init();
-                pulse_setup((pulse_data*)(output->data), channel->mode);
+                pulse_setup((pulse_data*)(output->data), channel->mode, channel->wave_rate);
 #endif /* WITH_PULSEAUDIO */
             }
         }
@@ -974,30 +1378,44 @@ int main(int argc, char* argv[]) {
         for (int j = 0; j < dev->channel_count; j++) {
             channel_t* channel = dev->channels + j;
 
-            // If the channel has icecast or MP3 file output, we will attempt to
-            // initialize a separate LAME context for MP3 encoding.
+            // If the channel has MP3 icecast or file output, it gets a separate LAME
+            // context for MP3 encoding once it has something to encode. Its Ogg outputs
+            // share a Vorbis encoder, its WAV and FLAC outputs a buffer of PCM samples.
             if (channel->need_mp3) {
-                channel->lame = airlame_init(channel->mode, channel->highpass, channel->lowpass);
-                channel->lamebuf = (unsigned char*)malloc(sizeof(unsigned char) * LAMEBUF_SIZE);
+                lame_setup(channel);
+            }
+            if (channel->need_vorbis && !vorbis_setup(channel)) {
+                cerr << "Failed to initialize Vorbis encoder for device " << i << " channel " << j << " - aborting\n";
+                error();
+            }
+            if (channel->need_pcm) {
+                pcm_setup(channel);
             }
             for (int k = 0; k < channel->output_count; k++) {
                 output_t* output = channel->outputs + k;
                 if (output->type == O_ICECAST) {
-                    shout_setup((icecast_data*)(output->data), channel->mode);
+                    shout_setup((icecast_data*)(output->data), channel->mode, channel->wave_rate);
                 } else if (output->type == O_UDP_STREAM) {
                     udp_stream_data* sdata = (udp_stream_data*)(output->data);
-                    if (!udp_stream_init(sdata, channel->mode, (size_t)WAVE_BATCH * sizeof(float))) {
+                    if (!udp_stream_init(sdata, channel->mode, channel->wave_rate, channel->wave_batch * sizeof(float))) {
                         cerr << "Failed to initialize device " << i << " channel " << j << " output " << k << " - aborting\n";
                         error();
                     }
 #ifdef WITH_PULSEAUDIO
                 } else if (output->type == O_PULSE) {
                     pulse_init();
-                    pulse_setup((pulse_data*)(output->data), channel->mode);
+                    pulse_setup((pulse_data*)(output->data), channel->mode, channel->wave_rate);
 #endif /* WITH_PULSEAUDIO */
                 }
             }
         }
+        if (dev->spectrum && !spectrum_init(dev->spectrum, dev->wave_rate)) {
+            cerr << "Failed to initialize spectrum output of device " << i << " - aborting\n";
+            error();
+        }
+        if (dev->discovery) {
+            discovery_init(dev->discovery);
+        }
         if (input_init(dev->input) != 0 || dev->input->state != INPUT_INITIALIZED) {
             if (errno != 0) {
                 cerr << "Failed to initialize input device " << i << ": " << strerror(errno) << " - aborting\n";
@@ -1010,12 +1428,9 @@ int main(int argc, char* argv[]) {
             cerr << "Failed to start input on device " << i << ": " << strerror(errno) << " - aborting\n";
             error();
         }
-        if (dev->mode == R_SCAN) {
+        if (dev->scan_position_count > 0) {
             // FIXME: set errno
-            if (pthread_mutex_init(&dev->tag_queue_lock, NULL) != 0) {
-                cerr << "Failed to initialize mutex - aborting\n";
-                error();
-            }
+            dev->scan_signal = new Signal;
             // FIXME: not needed when freq_count == 1?
             pthread_create(&dev->controller_thread, NULL, &controller_thread, dev);
         }
@@ -1053,12 +1468,19 @@ int main(int argc, char* argv[]) {
     demod_params_t* demod_params = (demod_params_t*)XCALLOC(demod_thread_count, sizeof(demod_params_t));
     THREAD* demod_threads = (THREAD*)XCALLOC(demod_thread_count, sizeof(THREAD));
 
+    // mixers are split between mixer threads, each of them signalling its own output thread
+    // if multiple_output_threads is set
+    int mixer_thread_count = std::min(mixer_threads, mixer_count);
+    mixer_params_t* mixer_params = (mixer_params_t*)XCALLOC(std::max(mixer_thread_count, 1), sizeof(mixer_params_t));
+    THREAD* mixer_thread_ids = (THREAD*)XCALLOC(std::max(mixer_thread_count, 1), sizeof(THREAD));
+    int* mixer_bounds = (int*)XCALLOC(mixer_thread_count + 1, sizeof(int));
+    if (mixer_thread_count > 0) {
+        mixer_partition(mixer_thread_count, mixer_bounds);
+    }
+
     int output_thread_count = 1;
     if (multiple_output_threads) {
-        output_thread_count = demod_thread_count;
-        if (mixer_count > 0) {
-            output_thread_count++;
-        }
+        output_thread_count = demod_thread_count + mixer_thread_count;
     }
     output_params_t* output_params = (output_params_t*)XCALLOC(output_thread_count, sizeof(output_params_t));
     THREAD* output_threads = (THREAD*)XCALLOC(output_thread_count, sizeof(THREAD));
@@ -1084,20 +1506,42 @@ int main(int argc, char* argv[]) {
                 init_demod(&demod_params[i], output_params[i].mp3_signal, i, i + 1);
             }
         }
-        if (mixer_count > 0) {
-            init_output(&output_params[output_thread_count - 1], 0, 0, 0, mixer_count);
+        for (int i = 0; i < mixer_thread_count; i++) {
+            init_output(&output_params[demod_thread_count + i], 0, 0, mixer_bounds[i], mixer_bounds[i + 1]);
         }
     }
+    for (int i = 0; i < mixer_thread_count; i++) {
+        Signal* signal = multiple_output_threads ? output_params[demod_thread_count + i].mp3_signal : output_params[0].mp3_signal;
+        mixer_thread_init(&mixer_params[i], signal, mixer_bounds[i], mixer_bounds[i + 1]);
+    }
 
-    // Startup the output threads
+    // Startup the encoder threads (if any), the file writer (if enabled) and the output threads
+    encoder_start(mp3_encoder_threads);
+    if (async_file_writes) {
+        writer_start();
+    }
     for (int i = 0; i < output_thread_count; i++) {
         pthread_create(&output_threads[i], NULL, &output_thread, &output_params[i]);
     }
 
-    // Startup the mixer thread (if there is one) using the signal for the last output thread
-    THREAD mixer;
-    if (mixer_count > 0) {
-        pthread_create(&mixer, NULL, &mixer_thread, output_params[output_thread_count - 1].mp3_signal);
+    // Startup the mixer threads (if there are any)
+    for (int i = 0; i < mixer_thread_count; i++) {
+        pthread_create(&mixer_thread_ids[i], NULL, &mixer_thread, &mixer_params[i]);
+    }
+
+    // Startup the spectrum thread if any device exports its spectrum
+    THREAD spectrum;
+    Signal* spectrum_signal = NULL;
+    for (int i = 0; i < device_count; i++) {
+        if (devices[i].spectrum && devices[i].spectrum->type != SPECTRUM_NONE) {
+            if (spectrum_signal == NULL) {
+                spectrum_signal = new Signal;
+            }
+            devices[i].spectrum->signal = spectrum_signal;
+        }
+    }
+    if (spectrum_signal) {
+        pthread_create(&spectrum, NULL, &spectrum_thread, spectrum_signal);
     }
 
 #ifdef WITH_PULSEAUDIO
@@ -1118,7 +1562,7 @@ int main(int argc, char* argv[]) {
 
     log(LOG_INFO, "Cleaning up\n");
     for (int i = 0; i < device_count; i++) {
-        if (devices[i].mode == R_SCAN)
+        if (devices[i].scan_position_count > 0)
             pthread_join(devices[i].controller_thread, NULL);
         if (input_stop(devices[i].input) != 0 || devices[i].input->state != INPUT_STOPPED) {
             if (errno != 0) {
@@ -1135,9 +1579,22 @@ int main(int argc, char* argv[]) {
         disable_device_outputs(dev);
     }
 
-    if (mixer_count > 0) {
-        log(LOG_INFO, "Closing mixer thread\n");
-        pthread_join(mixer, NULL);
+    if (mixer_thread_count > 0) {
+        log(LOG_INFO, "Closing mixer thread(s)\n");
+        for (int i = 0; i < mixer_thread_count; i++) {
+            pthread_join(mixer_thread_ids[i], NULL);
+        }
+    }
+
+    if (spectrum_signal) {
+        log(LOG_INFO, "Closing spectrum thread\n");
+        spectrum_signal->send();
+        pthread_join(spectrum, NULL);
+        for (int i = 0; i < device_count; i++) {
+            if (devices[i].spectrum) {
+                spectrum_shutdown(devices[i].spectrum);
+            }
+        }
     }
 
     log(LOG_INFO, "Closing output thread(s)\n");
@@ -1145,6 +1602,8 @@ int main(int argc, char* argv[]) {
         output_params[i].mp3_signal->send();
         pthread_join(output_threads[i], NULL);
     }
+    encoder_stop();
+    writer_stop();
 
     for (int i = 0; i < device_count; i++) {
         device_t* dev = devices + i;
@@ -1153,6 +1612,7 @@ int main(int argc, char* argv[]) {
             if (channel->need_mp3 && channel->lame) {
                 lame_close(channel->lame);
             }
+            vorbis_close(channel);
         }
     }
 
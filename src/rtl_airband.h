@@ -26,6 +26,7 @@
 #include <shout/shout.h>
 #include <stdint.h>  // uint32_t
 #include <sys/time.h>
+#include <time.h>  // clock_gettime()
 #include <complex>
 #include <cstdio>
 #include <libconfig.h++>
@@ -39,6 +40,10 @@
 #include <fftw3.h>
 #endif /* WITH_BCM_VC */
 
+#ifdef WITH_FLAC
+#include <FLAC/stream_encoder.h>
+#endif /* WITH_FLAC */
+
 #ifdef WITH_PULSEAUDIO
 #include <pulse/context.h>
 #include <pulse/stream.h>
@@ -47,6 +52,7 @@
 #include "filters.h"
 #include "input-common.h"  // input_t
 #include "logging.h"
+#include "resampler.h"
 #include "squelch.h"
 
 #define ALIGNED32 __attribute__((aligned(32)))
@@ -64,16 +70,21 @@
 #define MIN_BUF_SIZE 2560000
 #define DEFAULT_SAMPLE_RATE 2560000
 
-#ifdef NFM
-#define WAVE_RATE 16000
-#else
-#define WAVE_RATE 8000
-#endif /* NFM */
-
-#define WAVE_BATCH WAVE_RATE / 8
+#define DEFAULT_WAVE_RATE 8000  // audio sample rate of devices without NFM channels
+#define NFM_WAVE_RATE 16000     // default audio sample rate of devices with NFM channels
+#define DEFAULT_WAVE_BATCH_MS 125  // duration of an audio batch
+#define MIN_WAVE_BATCH_MS 10
+#define MAX_WAVE_BATCH_MS 125
+#define WAVE_BATCH(rate) ((size_t)(rate) * wave_batch_ms / 1000)
 #define AGC_EXTRA 100
-#define WAVE_LEN 2 * WAVE_BATCH + AGC_EXTRA
+#define WAVE_LEN(rate) (2 * WAVE_BATCH(rate) + AGC_EXTRA)
 #define MP3_RATE 8000
+#define VORBIS_QUALITY 0.0f  // libvorbis VBR quality, -0.1 to 1.0
+#define FLAC_COMPRESSION_LEVEL 5
+#define MAX_PRE_TRIGGER_MS 5000                     // longest lead-in kept for file outputs
+#define FILE_FSYNC_INTERVAL 10                      // seconds between syncs of open files with file_fsync = "periodic"
+#define WRITER_BUFFER_SIZE (256 * 1024)             // largest write of the file writer thread
+#define WRITER_MAX_QUEUED_BYTES (64 * 1024 * 1024)  // file data queued beyond this is dropped
 #define MAX_SHOUT_QUEUELEN 32768
 #define TAG_QUEUE_LEN 16
 
@@ -82,7 +93,15 @@
 #define MAX_FFT_SIZE_LOG 13
 
 #define LAMEBUF_SIZE 22000  // todo: calculate
+#define DEFAULT_LAME_POOL_SIZE 8
 #define MIX_DIVISOR 2
+#define DEFAULT_MIX_INPUT_SLOTS 2
+#define MAX_MIX_INPUT_SLOTS 8
+#define MIX_DRIFT_MAX 0.001       // largest rate adjustment applied by drift compensation
+#define MIX_DRIFT_KP 1e-3         // rate adjustment per batch of phase error
+#define MIX_DRIFT_KI 2.5e-7       // rate adjustment per batch of phase error, per batch it persists
+#define MIX_DRIFT_AVERAGING 0.03  // weight of a new phase measurement in its moving average
+#define MIX_DRIFT_RESYNC 4        // phase error in batches after which the input is considered restarted
 
 #ifdef WITH_BCM_VC
 struct sample_fft_arg {
@@ -96,6 +115,15 @@ extern "C" void samplefft(sample_fft_arg* a, unsigned char* buffer, float* windo
 #define FFT_BATCH 1
 #endif /* WITH_BCM_VC */
 
+// Channel sample history is kept in power-of-two rings addressed with a free-running
+// sample counter, so nothing has to be moved between batches. A ring must hold the batch
+// being read by the outputs, the batch being demodulated with its AGC_EXTRA look-back
+// and a partially filled FFT batch.
+constexpr size_t wave_ring_len(size_t min_len, size_t len = 1) {
+    return len >= min_len ? len : wave_ring_len(min_len, len << 1);
+}
+#define WAVE_RING_LEN(rate) wave_ring_len(WAVE_LEN(rate) + FFT_BATCH)
+
 //#define AFC_LOGGING
 
 enum status { NO_SIGNAL = ' ', SIGNAL = '*', AFC_UP = '<', AFC_DOWN = '>' };
@@ -112,6 +140,9 @@ enum output_type {
     O_PULSE
 #endif /* WITH_PULSEAUDIO */
 };
+enum audio_codecs { AC_MP3, AC_VORBIS, AC_WAV, AC_FLAC };
+enum fsync_policies { FSYNC_NEVER, FSYNC_CLOSE, FSYNC_PERIODIC };
+struct pre_trigger_ring;  // output.cpp
 
 struct icecast_data {
     const char* hostname;
@@ -126,6 +157,8 @@ struct icecast_data {
     const char* genre;
     const char* description;
     bool send_scan_freq_tags;
+    enum audio_codecs codec;
+    bool send_header;  // Ogg streams start with the stream headers, due before the next pages
     shout_t* shout;
 };
 
@@ -140,10 +173,20 @@ struct file_data {
     bool append;
     bool split_on_transmission;
     bool include_freq;
+    int pre_trigger_ms;             // O_FILE only, audio kept from before the output resumes
+    pre_trigger_ring* pre_trigger;  // that audio, allocated on first use
     timeval open_time;
     timeval last_write_time;
     FILE* f;
+    file_data* wfile;  // copy of the output used by the file writer thread while open, if async_file_writes
+    time_t sync_time;  // last fsync(), with file_fsync = FSYNC_PERIODIC
+    bool io_failed;    // a write of wfile has failed, guarded by the file writer
     enum output_type type;
+    enum audio_codecs codec;  // O_FILE only
+#ifdef WITH_FLAC
+    FLAC__StreamEncoder* flac;  // AC_FLAC only
+    FLAC__int32* flac_buf;      // samples of the current batch as taken by libFLAC
+#endif                          /* WITH_FLAC */
 };
 
 struct udp_stream_data {
@@ -169,6 +212,7 @@ struct pulse_data {
     pa_stream *left, *right;
     pa_channel_map lmap, rmap;
     mix_modes mode;
+    int wave_rate;
     bool continuous;
 };
 #endif /* WITH_PULSEAUDIO */
@@ -176,6 +220,7 @@ struct pulse_data {
 struct mixer_data {
     struct mixer_t* mixer;
     int input;
+    bool from_mixer;  // sub-mix, passed on by the mixer thread instead of the output thread
 };
 
 struct output_t {
@@ -187,7 +232,7 @@ struct output_t {
 
 struct freq_tag {
     int freq;
-    struct timeval tv;
+    size_t sample;  // output sample index where the audio of the frequency starts
 };
 
 enum modulations {
@@ -214,12 +259,73 @@ class Signal {
         pthread_cond_wait(&cond_, &mutex_);
         pthread_mutex_unlock(&mutex_);
     }
+    // returns false if the signal did not arrive within timeout_ms
+    bool timed_wait(int timeout_ms) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&mutex_);
+        int ret = pthread_cond_timedwait(&cond_, &mutex_, &ts);
+        pthread_mutex_unlock(&mutex_);
+        return ret == 0;
+    }
 
    private:
     pthread_cond_t cond_;
     pthread_mutex_t mutex_;
 };
 
+enum spectrum_output_type { SPECTRUM_NONE, SPECTRUM_UDP, SPECTRUM_UNIX, SPECTRUM_SHM };  // SPECTRUM_NONE - accumulate for carrier discovery only
+
+#define SPECTRUM_MAGIC 0x43455053  // "SPEC"
+#define DEFAULT_SPECTRUM_RATE 5
+#define MAX_SPECTRUM_RATE 50
+#define DEFAULT_SPECTRUM_SHM_SLOTS 16
+
+struct spectrum_frame_header {
+    uint32_t magic;
+    uint32_t sequence;     // frame number, starting at 1
+    uint64_t timestamp;    // frame completion time, in microseconds since the epoch
+    uint32_t centerfreq;   // device center frequency in Hz
+    uint32_t sample_rate;  // device sample rate in Hz
+    uint32_t bin_count;    // count of dBFS values following the header
+    uint32_t fft_count;    // count of FFTs averaged into the frame
+};
+
+struct spectrum_shm_header {
+    uint32_t magic;
+    uint32_t bin_count;
+    uint32_t slot_count;
+    uint32_t slot_size;                // frame header + bins, in bytes
+    volatile uint32_t write_sequence;  // sequence number of the latest complete frame
+};
+
+struct spectrum_t {
+    enum spectrum_output_type type;
+    int rate;                  // frames per second
+    size_t bin_count;          // bins per frame (fft_size decimated by averaging)
+    const char* dest_address;  // UDP
+    const char* dest_port;     // UDP
+    const char* path;          // Unix socket path or shared memory object name
+    size_t shm_slot_count;
+    size_t ffts_per_frame;
+    size_t fft_count;          // FFTs accumulated into power so far
+    float* power;              // power accumulator, one per FFT bin
+    unsigned char* frame;      // last complete frame
+    size_t frame_len;
+    volatile int frame_ready;  // frame waiting to be published
+    uint32_t sequence;
+    size_t overrun_count;      // frames dropped because the previous one has not been published yet
+    int send_socket;
+    unsigned char* shm;
+    Signal* signal;
+};
+
 struct freq_t {
     int frequency;     // scan frequency
     char* label;       // frequency label
@@ -227,16 +333,23 @@ struct freq_t {
     float ampfactor;   // multiplier to increase / decrease volume
     Squelch squelch;
     size_t active_counter;         // count of loops where channel has signal
+    bool priority;                 // scanning: revisited every scan_priority_hops hops
+    float activity;                // scanning: decaying share of visits with signal, persisted in scan_stats_file
     NotchFilter notch_filter;      // notch filter - good to remove CTCSS tones
     LowpassFilter lowpass_filter;  // lowpass filter, applied to I/Q after derotation, set at bandwidth/2 to remove out of band noise
     enum modulations modulation;
 };
+struct vorbis_encoder;  // output.cpp
 struct channel_t {
-    float wavein[WAVE_LEN];      // FFT output waveform
-    float waveout[WAVE_LEN];     // waveform after squelch + AGC (left/center channel mixer output)
-    float waveout_r[WAVE_LEN];   // right channel mixer output
-    float iq_in[2 * WAVE_LEN];   // raw input samples for I/Q outputs and NFM demod
-    float iq_out[2 * WAVE_LEN];  // raw output samples for I/Q outputs (FIXME: allocate only if required)
+    int wave_rate;         // audio sample rate
+    size_t wave_batch;     // audio samples per batch
+    size_t wave_ring_len;  // length of the wavein, waveout and iq_in rings (power of two, 0 for mixers)
+    float* wavein;         // FFT output waveform (ring)
+    float* waveout;        // waveform after squelch + AGC (ring, first wave_batch samples mirrored past its end) (left/center channel mixer output)
+    float* waveout_r;      // right channel mixer output
+    float* iq_in;          // raw input samples for I/Q outputs and NFM demod (ring)
+    float* iq_out;         // raw output samples for I/Q outputs (allocated only if required)
+    size_t waveout_ofs;    // offset of the batch ready for output in waveout
 #ifdef NFM
     float pr;            // previous sample - real part
     float pj;            // previous sample - imaginary part
@@ -251,48 +364,161 @@ struct channel_t {
     int freq_count;
     int freq_idx;
     int need_mp3;
+    int need_vorbis;
+    int need_pcm;
     int needs_raw_iq;
     int has_iq_outputs;
     enum ch_states state;  // mixer channel state flag
     int output_count;
     output_t* outputs;
-    int highpass;            // highpass filter cutoff
-    int lowpass;             // lowpass filter cutoff
-    lame_t lame;             // Context for LAME MP3 encoding if needed
-    unsigned char* lamebuf;  // Buffer used by each lame encode
+    int highpass;              // highpass filter cutoff
+    int lowpass;               // lowpass filter cutoff
+    lame_t lame;               // Context for LAME MP3 encoding if needed
+    unsigned char* lamebuf;    // Buffer used by each lame encode
+    bool lame_pending;         // LAME holds audio which has not been flushed yet
+    size_t mp3_skipped_count;  // batches not encoded because no output needed them
+    int mp3_bytes;             // MP3 frames of the current batch in lamebuf, set by encode_outputs()
+    bool mp3_flushed;          // lamebuf holds the tail of the audio before a gap instead
+    bool lame_poolable;        // all MP3 outputs are split_on_transmission files, LAME is only held during transmissions
+    vorbis_encoder* vorbis;    // Vorbis encoder shared by the Ogg outputs, if needed
+    int16_t* pcm;              // current batch as interleaved 16-bit samples, for WAV and FLAC outputs
+    int pcm_bytes;             // length of the batch in pcm, set by encode_outputs() (0 if no output needed it)
+    bool idle;                 // not demodulated (discovery channel with no carrier, unused scan monitor, or scan channel fed by monitors)
+    bool silence_pending;      // gone idle, the demodulator has yet to hand a batch of silence to the outputs
+};
+
+#define DEFAULT_SCAN_DWELL_MS 200
+#define DEFAULT_SCAN_HANG_MS 2000
+#define DEFAULT_SCAN_SETTLE_MS 30
+#define MAX_SCAN_SETTLE_MS 1000
+#define DEFAULT_SCAN_PRIORITY_HOPS 4
+#define SCAN_ACTIVITY_VISITS 32       // visits over which frequency activity is averaged
+#define SCAN_STATS_SAVE_INTERVAL 300  // seconds
+#define SCAN_USABLE_BANDWIDTH 0.8     // fraction of sample_rate where wideband scanning places frequencies
+
+struct scan_position_t {
+    int centerfreq;
+    int* freq_idx;      // frequencies monitored at this position, as indices into the scan channel freqlist
+    int freq_count;
+    bool priority;      // at least one of the frequencies is a priority one
+    int first_channel;  // banked multichannel: channels demodulated at this position
+    int channel_count;
+};
+
+// Devices scanning the same list together. Each of them takes the next position from the
+// shared cursor and skips positions held by another member.
+struct scan_group_t {
+    const char* name;
+    int position_count;
+    volatile unsigned int next;  // shared cursor, advanced by every member
+    volatile int* holder;        // index of the device holding each position, -1 if free
+};
+
+#define DEFAULT_DISCOVERY_THRESHOLD 10.0f
+#define DEFAULT_DISCOVERY_HOLD_TIME 5
+#define DEFAULT_DISCOVERY_MAX_CARRIERS 32
+
+struct carrier_t {
+    int freq;              // Hz, snapped to the channel raster if one is configured
+    float level;           // peak power in the last frame the carrier was seen, dBFS
+    size_t first_frame;    // frame number the carrier was first seen in
+    size_t last_frame;     // frame number the carrier was last seen in
+    size_t active_frames;  // count of frames the carrier was seen in
+    int channel;           // index of the temporary channel assigned to the carrier, -1 if none
+};
+
+struct discovery_t {
+    float threshold;         // dB above the noise floor
+    size_t hold_frames;      // carriers not seen for that many frames are dropped
+    int raster;              // channel raster in Hz, 0 - report peak bin frequencies
+    int max_carriers;
+    int first_temp_channel;  // index of the first temporary channel in device channels
+    freq_t* temp_freqs;      // freqlist[0] of each temporary channel as configured, restored for each carrier
+    carrier_t* carriers;
+    int carrier_count;
+    size_t frame;            // count of frames processed
+    float noise_floor;       // median bin power of the last frame, dBFS
+    float* levels;           // bin powers of the current frame in dBFS, lowest frequency first
+    float* sorted;           // scratch buffer for the noise floor estimate
+    pthread_mutex_t mutex;   // protects carriers against the stats writer
 };
 
 enum rec_modes { R_MULTICHANNEL, R_SCAN };
 struct device_t {
     input_t* input;
+    int wave_rate;           // audio sample rate of all channels
+    size_t wave_batch;       // audio samples per batch
+    size_t wave_ring_len;    // length of channel sample rings
+    spectrum_t* spectrum;    // NULL if spectrum export and carrier discovery are disabled
+    discovery_t* discovery;  // NULL if carrier discovery is disabled
 #ifdef NFM
     float alpha;
 #endif /* NFM */
     int channel_count;
     size_t *base_bins, *bins;
     channel_t* channels;
-    // FIXME: size_t
-    int waveend;
+    size_t waveend;       // count of samples written to channel rings
+    size_t wavestart;     // first sample of the next batch to demodulate
+    bool wave_restarted;  // wavestart was moved forward, the start of the next batch hasn't been demodulated
     int waveavail;
     THREAD controller_thread;
-    struct freq_tag tag_queue[TAG_QUEUE_LEN];
-    int tq_head, tq_tail;
+    struct freq_tag tag_queue[TAG_QUEUE_LEN];  // single producer (controller), single consumer (output thread)
+    volatile int tq_head, tq_tail;
     int last_frequency;
-    pthread_mutex_t tag_queue_lock;
+    volatile size_t output_samples;  // count of audio samples demodulated, including the batch waiting for output
     int row;
     int failed;
     enum rec_modes mode;
     size_t output_overrun_count;
+    size_t read_count;                 // input bytes consumed by the demodulator (wraps around like input->write_count)
+    int scan_dwell_ms;                 // time spent on a quiet frequency
+    int scan_hang_ms;                  // time spent on a frequency after its squelch has closed
+    int scan_settle_ms;                // tuner settle time, samples received during that period are discarded
+    int scan_max_dwell_ms;             // time spent on a quiet position whose frequencies have always been active
+    int scan_priority_hops;            // priority positions are revisited after this many hops, 0 - no priority frequencies
+    char* scan_stats_file;             // activity of scanned frequencies is kept here across restarts, NULL - not kept
+    volatile size_t retune_mark;       // input bytes up to this count were received before the last retune
+    scan_position_t* scan_positions;
+    int scan_position_count;
+    scan_group_t* scan_group;          // NULL if the device scans on its own
+    int scan_monitor_count;            // channels following the regular ones which monitor all frequencies of a position (wideband scanning)
+    volatile int scan_position;        // position the last retune went to
+    volatile int scan_retunes;         // count of retunes done by the controller
+    volatile int scan_retunes_seen;    // count of retunes the demodulator has caught up with
+    volatile int scan_batches;         // count of audio batches demodulated since the last retune
+    volatile int scan_last_open;       // value of scan_batches when the squelch was last open, 0 - not open since the last retune
+    volatile size_t scan_open_sample;  // output sample index of the batch where the squelch opened on the current frequency
+    int scan_open_freq;                // freq_idx the squelch has opened on
+    Signal* scan_signal;               // sent by the demodulator after each batch
 };
 
+// Batches are passed to the mixer through a ring of slot_count slots with a single
+// producer (the output thread of the connected channel) and a single consumer (the mixer
+// thread). The producer resamples straight into a free slot and then advances head, the
+// mixer advances tail once it has mixed the oldest slot. Slots are thus mixed in the order
+// the batches were produced, and the ring works as a jitter buffer for inputs which run
+// ahead of the mixer.
 struct mixinput_t {
-    float* wavein;
+    float* slots;  // slot_count batches of wave_batch samples at the mixer rate
+    int slot_count;
+    bool slot_has_signal[MAX_MIX_INPUT_SLOTS];
+    volatile unsigned int head;   // count of batches put by the producer
+    volatile unsigned int tail;   // count of batches taken by the mixer
+    int wave_rate;                // sample rate of the connected channel
+    Resampler resampler;
     float ampfactor;
     float ampl, ampr;
-    bool ready;
-    bool has_signal;
-    pthread_mutex_t mutex;
-    size_t input_overrun_count;
+    size_t input_overrun_count;   // batches dropped because all slots were full
+    size_t input_underrun_count;  // mixer batches emitted without this input, because it was late
+    bool drift_compensation;      // resample with a ratio trimmed to follow the input clock
+    float* carry;                 // drift compensation: resampled samples not making up a whole slot yet
+    size_t carry_len;
+    bool carry_has_signal;
+    struct timespec clock_start;  // drift compensation: time the phase is measured from
+    size_t clock_samples;         // drift compensation: samples produced since clock_start
+    double phase_avg;             // drift compensation: average lead of the input against the mixer clock, in batches
+    double drift_integral;
+    double drift;  // drift compensation: current rate adjustment
 };
 
 struct mixer_t {
@@ -304,6 +530,9 @@ struct mixer_t {
     mixinput_t* inputs;
     bool* inputs_todo;
     bool* input_mask;
+    bool waveout_mixed;             // an input with signal has been mixed into the current batch
+    bool waveout_silent;            // channel waveout buffers hold zeros
+    struct mixer_params_t* thread;  // mixer thread processing this mixer
     channel_t channel;
 };
 
@@ -327,27 +556,74 @@ struct output_params_t {
     int mixer_end;
 };
 
+struct mixer_params_t {
+    Signal* mp3_signal;
+    int mixer_start;
+    int mixer_end;
+    pthread_mutex_t wakeup_mutex;
+    pthread_cond_t wakeup_cond;
+    bool wakeup_pending;
+};
+
 // version.cpp
 extern char const* RTL_AIRBAND_VERSION;
 
 // output.cpp
-lame_t airlame_init(mix_modes mixmode, int highpass, int lowpass);
-void shout_setup(icecast_data* icecast, mix_modes mixmode);
+lame_t airlame_init(mix_modes mixmode, int wave_rate, int highpass, int lowpass);
+void lame_setup(channel_t* channel);
+bool vorbis_setup(channel_t* channel);
+void vorbis_close(channel_t* channel);
+void shout_setup(icecast_data* icecast, mix_modes mixmode, int wave_rate);
 void disable_device_outputs(device_t* dev);
 void disable_channel_outputs(channel_t* channel);
+void encode_outputs(channel_t* channel);
 void* output_check_thread(void* params);
 void* output_thread(void* params);
+bool file_io_open(file_data* fdata, const channel_t* channel, int is_audio);
+bool file_io_write(file_data* fdata, const channel_t* channel, const void* data, size_t len);
+void file_io_close(file_data* fdata);
+
+// encoder.cpp
+struct encode_job {
+    channel_t* channel;
+    int* remaining;  // jobs of the batch not completed yet
+    encode_job* next;
+};
+void encoder_start(int thread_count);
+void encoder_stop(void);
+void encoder_encode(channel_t** channels, int count, encode_job* jobs);
+
+// writer.cpp
+struct writer_stats {
+    int queue_depth;
+    size_t queued_bytes;
+    size_t dropped_bytes;
+};
+void writer_start(void);
+void writer_stop(void);
+file_data* writer_open(const file_data* fdata, const channel_t* channel, int is_audio);
+bool writer_write(file_data* wfile, const channel_t* channel, const void* data, size_t len);
+void writer_close(file_data* wfile);
+void writer_get_stats(writer_stats* stats);
 
 // rtl_airband.cpp
 extern bool use_localtime;
 extern bool multiple_demod_threads;
 extern bool multiple_output_threads;
+extern int mixer_threads;
+extern int mp3_encoder_threads;
+extern int lame_pool_size;
+extern bool async_file_writes;
+extern enum fsync_policies file_fsync;
 extern char* stats_filepath;
 extern size_t fft_size, fft_size_log;
 extern int device_count, mixer_count;
 extern int shout_metadata_delay;
+extern int wave_batch_ms;
 extern volatile int do_exit, device_opened;
-extern float alpha;
+#ifdef NFM
+extern int tau;
+#endif /* NFM */
 extern device_t* devices;
 extern mixer_t* mixers;
 
@@ -358,7 +634,7 @@ int atomic_get(volatile int* pv);
 double atofs(char* s);
 double delta_sec(const timeval* start, const timeval* stop);
 void log(int priority, const char* format, ...);
-void tag_queue_put(device_t* dev, int freq, struct timeval tv);
+void tag_queue_put(device_t* dev, int freq, size_t sample);
 void tag_queue_get(device_t* dev, struct freq_tag* tag);
 void tag_queue_advance(device_t* dev);
 void sincosf_lut_init();
@@ -369,12 +645,17 @@ void* xrealloc(void* ptr, size_t size, const char* file, const int line, const c
 #define XREALLOC(ptr, size) xrealloc((ptr), (size), __FILE__, __LINE__, __func__)
 float dBFS_to_level(const float& dBFS);
 float level_to_dBFS(const float& level);
+size_t freq_to_fft_bin(const input_t* input, int freq);
+uint32_t downmix_dphi(const input_t* input, int wave_rate, int freq);
 
 // mixer.cpp
 mixer_t* getmixerbyname(const char* name);
-int mixer_connect_input(mixer_t* mixer, float ampfactor, float balance);
+int mixer_connect_input(mixer_t* mixer, float ampfactor, float balance, int wave_rate, int slot_count, bool drift_compensation);
+void mixer_setup(mixer_t* mixer);
 void mixer_disable_input(mixer_t* mixer, int input_idx);
 void mixer_put_samples(mixer_t* mixer, int input_idx, const float* samples, bool has_signal, unsigned int len);
+void mixer_thread_init(mixer_params_t* params, Signal* signal, int mixer_start, int mixer_end);
+void mixer_partition(int thread_count, int* bounds);
 void* mixer_thread(void* params);
 const char* mixer_get_error();
 
@@ -382,8 +663,29 @@ const char* mixer_get_error();
 int parse_devices(libconfig::Setting& devs);
 int parse_mixers(libconfig::Setting& mx);
 
+// spectrum.cpp
+bool spectrum_init(spectrum_t* spectrum, int wave_rate);
+void spectrum_add_fft(device_t* dev, const float* fft);
+void* spectrum_thread(void* params);
+void spectrum_shutdown(spectrum_t* spectrum);
+
+// discovery.cpp
+void discovery_init(discovery_t* discovery);
+void discovery_process(device_t* dev, const float* power, size_t fft_count);
+
+// scan_stats.cpp
+void scan_stats_load(device_t* dev);
+void scan_stats_save(const device_t* dev);
+
+// pcm_file.cpp
+void pcm_setup(channel_t* channel);
+int pcm_encode(channel_t* channel);
+int pcm_file_open(file_data* fdata, const channel_t* channel);
+bool pcm_file_write(file_data* fdata, const channel_t* channel, const void* data, size_t len);
+void pcm_file_close(file_data* fdata);
+
 // udp_stream.cpp
-bool udp_stream_init(udp_stream_data* sdata, mix_modes mode, size_t len);
+bool udp_stream_init(udp_stream_data* sdata, mix_modes mode, int wave_rate, size_t len);
 void udp_stream_write(udp_stream_data* sdata, const float* data, size_t len);
 void udp_stream_write(udp_stream_data* sdata, const float* data_left, const float* data_right, size_t len);
 void udp_stream_shutdown(udp_stream_data* sdata);
@@ -392,7 +694,7 @@ void udp_stream_shutdown(udp_stream_data* sdata);
 #define PULSE_STREAM_LATENCY_LIMIT 10000000UL
 // pulse.cpp
 void pulse_init();
-int pulse_setup(pulse_data* pdata, mix_modes mixmode);
+int pulse_setup(pulse_data* pdata, mix_modes mixmode, int wave_rate);
 void pulse_start();
 void pulse_shutdown(pulse_data* pdata);
 void pulse_write_stream(pulse_data* pdata, mix_modes mode, const float* data_left, const float* data_right, size_t len);
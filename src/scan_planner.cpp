@@ -0,0 +1,117 @@
+/*
+ * scan_planner.cpp
+ *
+ * Copyright (C) 2024 charlie-foxtrot
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "scan_planner.h"
+
+#include <algorithm>  // std::stable_sort
+#include <cassert>    // assert()
+#include <cstdlib>    // llabs()
+
+using namespace std;
+
+namespace {
+
+struct FreqLess {
+    const vector<int>& freqs;
+    explicit FreqLess(const vector<int>& f) : freqs(f) {}
+    bool operator()(int a, int b) const { return freqs[a] < freqs[b]; }
+};
+
+// Finds a center frequency for the sorted frequencies f[first..last], preferring the middle
+// of the allowed range (and the higher one of two equally good candidates). Returns false
+// if there is none.
+bool find_center(const vector<long long>& f, size_t first, size_t last, long long min_offset, long long max_offset, long long* center) {
+    const long long lo = f[last] - max_offset;
+    const long long hi = f[first] + max_offset;
+    if (lo > hi) {
+        return false;
+    }
+    const long long mid = lo + (hi - lo) / 2;
+
+    // The allowed range minus the min_offset zones around each frequency is a set of intervals.
+    // The best point is either the middle of the range or an edge of one of these intervals.
+    vector<long long> candidates;
+    candidates.push_back(mid);
+    candidates.push_back(lo);
+    candidates.push_back(hi);
+    for (size_t k = first; k <= last; k++) {
+        candidates.push_back(f[k] - min_offset);
+        candidates.push_back(f[k] + min_offset);
+    }
+
+    bool found = false;
+    for (size_t c = 0; c < candidates.size(); c++) {
+        const long long cand = candidates[c];
+        if (cand < lo || cand > hi) {
+            continue;
+        }
+        bool clear = true;
+        for (size_t k = first; k <= last && clear; k++) {
+            clear = llabs(f[k] - cand) >= min_offset;
+        }
+        if (!clear) {
+            continue;
+        }
+        if (!found || llabs(cand - mid) < llabs(*center - mid) || (llabs(cand - mid) == llabs(*center - mid) && cand > *center)) {
+            *center = cand;
+            found = true;
+        }
+    }
+    return found;
+}
+
+}  // namespace
+
+vector<ScanPosition> plan_scan_positions(const vector<int>& freqs, int min_offset, int max_offset) {
+    assert(min_offset >= 0 && max_offset >= min_offset);
+    vector<ScanPosition> positions;
+
+    vector<int> order(freqs.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    stable_sort(order.begin(), order.end(), FreqLess(freqs));
+    vector<long long> sorted(order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        sorted[i] = freqs[order[i]];
+    }
+
+    // Greedy: extend each position with the next frequencies for as long as a center exists
+    size_t first = 0;
+    while (first < sorted.size()) {
+        long long center = 0;
+        bool found = find_center(sorted, first, first, min_offset, max_offset, &center);
+        assert(found);
+        (void)found;
+        // a failed attempt leaves center untouched
+        size_t last = first;
+        while (last + 1 < sorted.size() && find_center(sorted, first, last + 1, min_offset, max_offset, &center)) {
+            last++;
+        }
+
+        ScanPosition pos;
+        pos.centerfreq = (int)center;
+        for (size_t k = first; k <= last; k++) {
+            pos.freq_idx.push_back(order[k]);
+        }
+        positions.push_back(pos);
+        first = last + 1;
+    }
+    return positions;
+}
@@ -0,0 +1,37 @@
+/*
+ * scan_planner.h
+ *
+ * Copyright (C) 2024 charlie-foxtrot
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SCAN_PLANNER_H
+#define _SCAN_PLANNER_H 1
+
+#include <vector>
+
+// A tuner center frequency and the scan list frequencies (as indices into the list)
+// which can be monitored at once when tuned to it.
+struct ScanPosition {
+    int centerfreq;
+    std::vector<int> freq_idx;
+};
+
+// Groups scan list frequencies into as few tuning positions as possible. Every frequency
+// of a position lies no further than max_offset from its center frequency and no closer
+// than min_offset, to keep clear of the DC spike. Positions are ordered by frequency.
+std::vector<ScanPosition> plan_scan_positions(const std::vector<int>& freqs, int min_offset, int max_offset);
+
+#endif /* _SCAN_PLANNER_H */
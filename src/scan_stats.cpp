@@ -0,0 +1,84 @@
+/*
+ * scan_stats.cpp
+ * Persistence of scanned frequency activity
+ *
+ * Copyright (c) 2024 charlie-foxtrot
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>   // fopen()
+#include <string.h>  // strerror()
+#include <syslog.h>  // LOG_INFO / LOG_WARNING
+#include <algorithm>  // std::min(), std::max()
+#include <cerrno>
+#include <string>
+
+#include "rtl_airband.h"
+
+// The file holds one line per frequency of the scan channel: the frequency in Hz and its
+// activity (0-1). Frequencies no longer on the list are ignored when loading and new ones
+// start with no activity.
+
+void scan_stats_load(device_t* dev) {
+    if (dev->scan_stats_file == NULL) {
+        return;
+    }
+    FILE* f = fopen(dev->scan_stats_file, "r");
+    if (f == NULL) {
+        if (errno != ENOENT) {
+            log(LOG_WARNING, "Cannot read scan statistics from %s (%s)\n", dev->scan_stats_file, strerror(errno));
+        }
+        return;
+    }
+    channel_t* channel = dev->channels;
+    int freq, loaded = 0;
+    float activity;
+    char line[128];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%d %f", &freq, &activity) != 2) {
+            continue;
+        }
+        for (int k = 0; k < channel->freq_count; k++) {
+            if (channel->freqlist[k].frequency == freq) {
+                channel->freqlist[k].activity = std::min(std::max(activity, 0.0f), 1.0f);
+                loaded++;
+                break;
+            }
+        }
+    }
+    fclose(f);
+    log(LOG_INFO, "Loaded activity of %d scanned frequencies from %s\n", loaded, dev->scan_stats_file);
+}
+
+void scan_stats_save(const device_t* dev) {
+    if (dev->scan_stats_file == NULL) {
+        return;
+    }
+    // write a new file and rename it, so that a crash never leaves a truncated one behind
+    std::string tmp = std::string(dev->scan_stats_file) + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (f == NULL) {
+        log(LOG_WARNING, "Cannot open output file %s (%s)\n", tmp.c_str(), strerror(errno));
+        return;
+    }
+    const channel_t* channel = dev->channels;
+    fprintf(f, "# frequency activity\n");
+    for (int k = 0; k < channel->freq_count; k++) {
+        fprintf(f, "%d %.4f\n", channel->freqlist[k].frequency, channel->freqlist[k].activity);
+    }
+    if (fclose(f) != 0 || rename(tmp.c_str(), dev->scan_stats_file) != 0) {
+        log(LOG_WARNING, "Cannot write scan statistics to %s (%s)\n", dev->scan_stats_file, strerror(errno));
+    }
+}
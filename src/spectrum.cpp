@@ -0,0 +1,258 @@
+/*
+ * spectrum.cpp
+ * Averaged power spectrum export
+ *
+ * Copyright (c) 2024 charlie-foxtrot
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>     // O_* constants
+#include <string.h>    // strerror()
+#include <sys/mman.h>  // shm_open(), mmap()
+#include <sys/stat.h>  // mode constants
+#include <sys/un.h>    // sockaddr_un
+#include <syslog.h>    // LOG_INFO / LOG_ERR
+#include <unistd.h>    // close(), ftruncate()
+#include <cassert>     // assert()
+#include <cerrno>
+
+#include <netdb.h>  // getaddrinfo()
+
+#include "rtl_airband.h"
+
+// Each frame is a spectrum_frame_header followed by bin_count floats holding the average
+// power of each bin in dBFS, lowest frequency first. UDP and Unix socket outputs send one
+// frame per datagram. The shared memory output is a spectrum_shm_header followed by
+// slot_count frame slots of slot_size bytes each. Frame n is written to slot n % slot_count
+// and write_sequence is updated once the frame is complete. The sequence number in the
+// frame header of a slot is 0 while the slot is being written and is set last, so a reader
+// has a consistent frame if that sequence number is nonzero and unchanged after copying
+// the slot.
+
+static bool spectrum_udp_init(spectrum_t* spectrum) {
+    struct addrinfo hints, *result, *rptr;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    int error = getaddrinfo(spectrum->dest_address, spectrum->dest_port, &hints, &result);
+    if (error) {
+        log(LOG_ERR, "spectrum: could not resolve %s:%s - %s\n", spectrum->dest_address, spectrum->dest_port, gai_strerror(error));
+        return false;
+    }
+    for (rptr = result; rptr != NULL; rptr = rptr->ai_next) {
+        spectrum->send_socket = socket(rptr->ai_family, rptr->ai_socktype, rptr->ai_protocol);
+        if (spectrum->send_socket == -1) {
+            log(LOG_ERR, "spectrum: socket failed: %s\n", strerror(errno));
+            continue;
+        }
+        if (connect(spectrum->send_socket, rptr->ai_addr, rptr->ai_addrlen) == -1) {
+            log(LOG_INFO, "spectrum: connect to %s:%s failed: %s\n", spectrum->dest_address, spectrum->dest_port, strerror(errno));
+            close(spectrum->send_socket);
+            spectrum->send_socket = -1;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(result);
+    if (spectrum->send_socket == -1) {
+        log(LOG_ERR, "spectrum: could not set up UDP socket to %s:%s - all addresses failed\n", spectrum->dest_address, spectrum->dest_port);
+        return false;
+    }
+    log(LOG_INFO, "spectrum: sending %zu bins at %d frames/sec to %s:%s\n", spectrum->bin_count, spectrum->rate, spectrum->dest_address, spectrum->dest_port);
+    return true;
+}
+
+static bool spectrum_unix_init(spectrum_t* spectrum) {
+    if (strlen(spectrum->path) >= sizeof(((struct sockaddr_un*)NULL)->sun_path)) {
+        log(LOG_ERR, "spectrum: socket path %s is too long\n", spectrum->path);
+        return false;
+    }
+    spectrum->send_socket = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (spectrum->send_socket == -1) {
+        log(LOG_ERR, "spectrum: socket failed: %s\n", strerror(errno));
+        return false;
+    }
+    // not connected - frames are dropped until a reader binds the socket path
+    log(LOG_INFO, "spectrum: sending %zu bins at %d frames/sec to %s\n", spectrum->bin_count, spectrum->rate, spectrum->path);
+    return true;
+}
+
+static bool spectrum_shm_init(spectrum_t* spectrum) {
+    size_t len = sizeof(spectrum_shm_header) + spectrum->shm_slot_count * spectrum->frame_len;
+    int fd = shm_open(spectrum->path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1) {
+        log(LOG_ERR, "spectrum: shm_open %s failed: %s\n", spectrum->path, strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, len) == -1) {
+        log(LOG_ERR, "spectrum: could not resize %s: %s\n", spectrum->path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    void* shm = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        log(LOG_ERR, "spectrum: mmap %s failed: %s\n", spectrum->path, strerror(errno));
+        return false;
+    }
+    memset(shm, 0, len);
+    spectrum_shm_header* hdr = (spectrum_shm_header*)shm;
+    hdr->magic = SPECTRUM_MAGIC;
+    hdr->bin_count = spectrum->bin_count;
+    hdr->slot_count = spectrum->shm_slot_count;
+    hdr->slot_size = spectrum->frame_len;
+    hdr->write_sequence = 0;
+    spectrum->shm = (unsigned char*)shm;
+    log(LOG_INFO, "spectrum: writing %zu bins at %d frames/sec to shared memory %s (%zu slots)\n", spectrum->bin_count, spectrum->rate, spectrum->path, spectrum->shm_slot_count);
+    return true;
+}
+
+bool spectrum_init(spectrum_t* spectrum, int wave_rate) {
+    assert(spectrum);
+    // the FFT window slides by one audio sample, so there are wave_rate FFTs per second
+    spectrum->ffts_per_frame = wave_rate / spectrum->rate;
+    spectrum->fft_count = 0;
+    spectrum->power = (float*)XCALLOC(fft_size, sizeof(float));
+    spectrum->frame_len = sizeof(spectrum_frame_header) + spectrum->bin_count * sizeof(float);
+    spectrum->frame = (unsigned char*)XCALLOC(1, spectrum->frame_len);
+    spectrum->frame_ready = 0;
+    spectrum->sequence = 0;
+    spectrum->overrun_count = 0;
+    spectrum->send_socket = -1;
+    spectrum->shm = NULL;
+
+    switch (spectrum->type) {
+        case SPECTRUM_NONE:
+            return true;
+        case SPECTRUM_UDP:
+            return spectrum_udp_init(spectrum);
+        case SPECTRUM_UNIX:
+            return spectrum_unix_init(spectrum);
+        case SPECTRUM_SHM:
+            return spectrum_shm_init(spectrum);
+    }
+    return false;
+}
+
+// Called by the demod thread for each FFT computed for the device. fft points to fft_size
+// interleaved re/im values.
+void spectrum_add_fft(device_t* dev, const float* fft) {
+    spectrum_t* spectrum = dev->spectrum;
+    float* power = spectrum->power;
+    for (size_t i = 0; i < fft_size; i++) {
+        power[i] += fft[2 * i] * fft[2 * i] + fft[2 * i + 1] * fft[2 * i + 1];
+    }
+    if (++spectrum->fft_count < spectrum->ffts_per_frame) {
+        return;
+    }
+
+    if (dev->discovery) {
+        discovery_process(dev, power, spectrum->fft_count);
+    }
+    if (spectrum->type == SPECTRUM_NONE) {
+        // nothing to publish
+    } else if (atomic_get(&spectrum->frame_ready)) {
+        debug_print("spectrum: frame overrun\n");
+        spectrum->overrun_count++;
+    } else {
+        spectrum_frame_header* hdr = (spectrum_frame_header*)spectrum->frame;
+        float* bins = (float*)(spectrum->frame + sizeof(spectrum_frame_header));
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        hdr->magic = SPECTRUM_MAGIC;
+        hdr->sequence = ++spectrum->sequence;
+        hdr->timestamp = (uint64_t)tv.tv_sec * 1000000ULL + tv.tv_usec;
+        hdr->centerfreq = dev->input->centerfreq;
+        hdr->sample_rate = dev->input->sample_rate;
+        hdr->bin_count = spectrum->bin_count;
+        hdr->fft_count = spectrum->fft_count;
+
+        // FFT output starts at the center frequency, shift it to start at the lowest frequency
+        // and average adjacent bins down to bin_count
+        const size_t decimation = fft_size / spectrum->bin_count;
+        const float scale = 1.0f / (spectrum->fft_count * decimation);
+        for (size_t b = 0; b < spectrum->bin_count; b++) {
+            float sum = 0.0f;
+            for (size_t k = b * decimation; k < (b + 1) * decimation; k++) {
+                sum += power[(k + fft_size / 2) & (fft_size - 1)];
+            }
+            bins[b] = level_to_dBFS(sqrtf(sum * scale));
+        }
+        atomic_inc(&spectrum->frame_ready);
+        spectrum->signal->send();
+    }
+    memset(power, 0, fft_size * sizeof(float));
+    spectrum->fft_count = 0;
+}
+
+static void spectrum_publish(spectrum_t* spectrum) {
+    if (spectrum->type == SPECTRUM_UDP) {
+        if (spectrum->send_socket != -1) {
+            send(spectrum->send_socket, spectrum->frame, spectrum->frame_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+    } else if (spectrum->type == SPECTRUM_UNIX) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, spectrum->path, sizeof(addr.sun_path) - 1);
+        sendto(spectrum->send_socket, spectrum->frame, spectrum->frame_len, MSG_DONTWAIT | MSG_NOSIGNAL, (struct sockaddr*)&addr, sizeof(addr));
+    } else if (spectrum->type == SPECTRUM_SHM) {
+        spectrum_shm_header* hdr = (spectrum_shm_header*)spectrum->shm;
+        spectrum_frame_header header = *(spectrum_frame_header*)spectrum->frame;
+        const uint32_t sequence = header.sequence;
+        unsigned char* slot = spectrum->shm + sizeof(spectrum_shm_header) + (sequence % spectrum->shm_slot_count) * spectrum->frame_len;
+        spectrum_frame_header* slot_header = (spectrum_frame_header*)slot;
+        slot_header->sequence = 0;
+        __sync_synchronize();
+        header.sequence = 0;
+        memcpy(slot, &header, sizeof(header));
+        memcpy(slot + sizeof(header), spectrum->frame + sizeof(header), spectrum->frame_len - sizeof(header));
+        __sync_synchronize();
+        slot_header->sequence = sequence;
+        __sync_synchronize();
+        hdr->write_sequence = sequence;
+    }
+}
+
+void* spectrum_thread(void* param) {
+    assert(param != NULL);
+    Signal* signal = (Signal*)param;
+
+    debug_print("Starting spectrum thread, signal %p\n", signal);
+    while (!do_exit) {
+        signal->wait();
+        for (int i = 0; i < device_count; i++) {
+            spectrum_t* spectrum = devices[i].spectrum;
+            if (spectrum == NULL || !atomic_get(&spectrum->frame_ready)) {
+                continue;
+            }
+            spectrum_publish(spectrum);
+            atomic_dec(&spectrum->frame_ready);
+        }
+    }
+    return 0;
+}
+
+void spectrum_shutdown(spectrum_t* spectrum) {
+    if (spectrum->send_socket != -1) {
+        close(spectrum->send_socket);
+        spectrum->send_socket = -1;
+    }
+    if (spectrum->shm != NULL) {
+        munmap(spectrum->shm, sizeof(spectrum_shm_header) + spectrum->shm_slot_count * spectrum->frame_len);
+        shm_unlink(spectrum->path);
+        spectrum->shm = NULL;
+    }
+}
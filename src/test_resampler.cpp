@@ -0,0 +1,171 @@
+/*
+ * test_resampler.cpp
+ *
+ * Copyright (C) 2024 charlie-foxtrot
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <vector>
+
+#include "test_base_class.h"
+
+#include "resampler.h"
+
+using namespace std;
+
+class ResamplerTest : public TestBaseClass {
+   protected:
+    void SetUp(void) { TestBaseClass::SetUp(); }
+
+    void TearDown(void) { TestBaseClass::TearDown(); }
+
+    vector<float> tone(int sample_rate, float tone_freq, size_t len) {
+        vector<float> samples(len);
+        for (size_t i = 0; i < len; i++) {
+            samples[i] = 0.5 * sin(2.0 * M_PI * tone_freq * i / sample_rate);
+        }
+        return samples;
+    }
+
+    size_t count_zero_crossings(const vector<float>& samples) {
+        size_t count = 0;
+        for (size_t i = 1; i < samples.size(); i++) {
+            if ((samples[i - 1] < 0.0f) != (samples[i] < 0.0f)) {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    vector<float> resample_in_batches(Resampler& resampler, const vector<float>& in, size_t in_batch, size_t out_batch) {
+        vector<float> out(in.size() / in_batch * out_batch);
+        for (size_t b = 0; b < in.size() / in_batch; b++) {
+            resampler.process(in.data() + b * in_batch, in_batch, out.data() + b * out_batch, out_batch);
+        }
+        return out;
+    }
+};
+
+TEST_F(ResamplerTest, default_constructor) {
+    Resampler resampler;
+    EXPECT_FALSE(resampler.enabled());
+}
+
+TEST_F(ResamplerTest, same_rate) {
+    Resampler resampler(8000, 8000);
+    EXPECT_FALSE(resampler.enabled());
+
+    vector<float> in = tone(8000, 1000, 1000);
+    vector<float> out(1000);
+    resampler.process(in.data(), in.size(), out.data(), out.size());
+    EXPECT_EQ(in, out);
+}
+
+TEST_F(ResamplerTest, upsample) {
+    Resampler resampler(8000, 16000);
+    EXPECT_TRUE(resampler.enabled());
+
+    vector<float> in = tone(8000, 1000, 8000);
+    vector<float> out = resample_in_batches(resampler, in, 1000, 2000);
+
+    // same tone, twice the samples
+    EXPECT_NEAR(count_zero_crossings(out), count_zero_crossings(in), 2);
+    vector<float> expected = tone(16000, 1000, 16000);
+    for (size_t i = 1; i < out.size(); i++) {
+        ASSERT_NEAR(out[i], expected[i - 1], 0.05) << "sample " << i;
+    }
+}
+
+TEST_F(ResamplerTest, downsample) {
+    Resampler resampler(16000, 8000);
+    EXPECT_TRUE(resampler.enabled());
+
+    vector<float> in = tone(16000, 1000, 16000);
+    vector<float> out = resample_in_batches(resampler, in, 2000, 1000);
+
+    EXPECT_NEAR(count_zero_crossings(out), count_zero_crossings(in), 2);
+}
+
+TEST_F(ResamplerTest, downsample_filters_aliases) {
+    Resampler resampler(16000, 8000);
+
+    // 7.5 kHz would alias to 500 Hz, the boxcar filter has to attenuate it
+    vector<float> in = tone(16000, 7500, 16000);
+    vector<float> out = resample_in_batches(resampler, in, 2000, 1000);
+
+    for (size_t i = 0; i < out.size(); i++) {
+        ASSERT_LT(fabs(out[i]), 0.1) << "sample " << i;
+    }
+}
+
+TEST_F(ResamplerTest, batches_are_continuous) {
+    vector<float> in = tone(8000, 440, 8000);
+
+    Resampler whole(8000, 16000);
+    vector<float> expected = resample_in_batches(whole, in, 8000, 16000);
+
+    Resampler batched(8000, 16000);
+    vector<float> out = resample_in_batches(batched, in, 1000, 2000);
+
+    ASSERT_EQ(out.size(), expected.size());
+    for (size_t i = 0; i < out.size(); i++) {
+        ASSERT_FLOAT_EQ(out[i], expected[i]) << "sample " << i;
+    }
+}
+
+TEST_F(ResamplerTest, adaptive_same_rate) {
+    Resampler resampler(8000, 8000, true);
+    EXPECT_TRUE(resampler.enabled());
+
+    vector<float> in = tone(8000, 440, 8000);
+    vector<float> out(in.size());
+    EXPECT_EQ(resampler.process_variable(in.data(), in.size(), out.data(), out.size()), in.size());
+}
+
+TEST_F(ResamplerTest, adjustment_changes_output_count) {
+    vector<float> in = tone(8000, 440, 8000);
+    vector<float> out(in.size() + 100);
+
+    // consuming input 1% faster yields 1% fewer samples
+    Resampler fast(8000, 8000, true);
+    fast.set_adjustment(0.01);
+    size_t count = 0;
+    for (size_t i = 0; i < in.size(); i += 1000) {
+        count += fast.process_variable(in.data() + i, 1000, out.data() + count, out.size() - count);
+    }
+    EXPECT_NEAR(count, 7921, 2);
+
+    Resampler slow(8000, 8000, true);
+    slow.set_adjustment(-0.01);
+    count = 0;
+    for (size_t i = 0; i < in.size(); i += 1000) {
+        count += slow.process_variable(in.data() + i, 1000, out.data() + count, out.size() - count);
+    }
+    EXPECT_NEAR(count, 8081, 2);
+}
+
+TEST_F(ResamplerTest, skip_matches_process_count) {
+    vector<float> in(1000, 0.0f);
+    vector<float> out(3000);
+
+    Resampler processed(8000, 16000, true);
+    Resampler skipped(8000, 16000, true);
+    processed.set_adjustment(0.001);
+    skipped.set_adjustment(0.001);
+    for (int i = 0; i < 8; i++) {
+        EXPECT_EQ(skipped.skip(in.size()), processed.process_variable(in.data(), in.size(), out.data(), out.size())) << "batch " << i;
+    }
+}
@@ -0,0 +1,119 @@
+/*
+ * test_scan_planner.cpp
+ *
+ * Copyright (C) 2024 charlie-foxtrot
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdlib>
+#include <vector>
+
+#include "test_base_class.h"
+
+#include "scan_planner.h"
+
+using namespace std;
+
+static const int min_offset = 20000;
+static const int max_offset = 1000000;
+
+class ScanPlannerTest : public TestBaseClass {
+   protected:
+    // every frequency is covered exactly once, within the allowed offsets from its center
+    void assert_valid(const vector<int>& freqs, const vector<ScanPosition>& positions) {
+        vector<int> seen(freqs.size(), 0);
+        for (size_t p = 0; p < positions.size(); p++) {
+            ASSERT_FALSE(positions[p].freq_idx.empty());
+            for (size_t k = 0; k < positions[p].freq_idx.size(); k++) {
+                int idx = positions[p].freq_idx[k];
+                ASSERT_GE(idx, 0);
+                ASSERT_LT(idx, (int)freqs.size());
+                seen[idx]++;
+                int offset = abs(freqs[idx] - positions[p].centerfreq);
+                EXPECT_GE(offset, min_offset);
+                EXPECT_LE(offset, max_offset);
+            }
+        }
+        for (size_t i = 0; i < seen.size(); i++) {
+            EXPECT_EQ(seen[i], 1) << "frequency " << i;
+        }
+    }
+};
+
+TEST_F(ScanPlannerTest, empty_list) {
+    EXPECT_TRUE(plan_scan_positions(vector<int>(), min_offset, max_offset).empty());
+}
+
+TEST_F(ScanPlannerTest, single_frequency_above_dc) {
+    vector<int> freqs(1, 118000000);
+    vector<ScanPosition> positions = plan_scan_positions(freqs, min_offset, max_offset);
+    ASSERT_EQ(positions.size(), 1);
+    EXPECT_EQ(positions[0].centerfreq, 118000000 + min_offset);
+    assert_valid(freqs, positions);
+}
+
+TEST_F(ScanPlannerTest, close_frequencies_share_a_position) {
+    int list[] = {118100000, 118700000, 119300000, 118400000};
+    vector<int> freqs(list, list + 4);
+    vector<ScanPosition> positions = plan_scan_positions(freqs, min_offset, max_offset);
+    ASSERT_EQ(positions.size(), 1);
+    EXPECT_EQ(positions[0].freq_idx.size(), 4);
+    assert_valid(freqs, positions);
+}
+
+TEST_F(ScanPlannerTest, distant_frequencies_are_split) {
+    int list[] = {127000000, 118000000, 136000000, 118500000};
+    vector<int> freqs(list, list + 4);
+    vector<ScanPosition> positions = plan_scan_positions(freqs, min_offset, max_offset);
+    ASSERT_EQ(positions.size(), 3);
+    // ordered by frequency
+    EXPECT_EQ(positions[0].freq_idx.size(), 2);
+    EXPECT_EQ(positions[1].freq_idx[0], 0);
+    EXPECT_EQ(positions[2].freq_idx[0], 2);
+    assert_valid(freqs, positions);
+}
+
+TEST_F(ScanPlannerTest, center_avoids_frequencies) {
+    // the middle of the range falls on a scanned frequency
+    int list[] = {120000000, 120500000, 121000000};
+    vector<int> freqs(list, list + 3);
+    vector<ScanPosition> positions = plan_scan_positions(freqs, min_offset, max_offset);
+    ASSERT_EQ(positions.size(), 1);
+    assert_valid(freqs, positions);
+}
+
+TEST_F(ScanPlannerTest, dense_list) {
+    // 50 kHz raster from 118 to 137 MHz leaves room for the center between frequencies
+    vector<int> freqs;
+    for (int f = 118000000; f <= 137000000; f += 50000) {
+        freqs.push_back(f);
+    }
+    vector<ScanPosition> positions = plan_scan_positions(freqs, min_offset, max_offset);
+    assert_valid(freqs, positions);
+    // each position spans close to 2 * max_offset
+    EXPECT_LE(positions.size(), 11);
+}
+
+TEST_F(ScanPlannerTest, dense_list_without_gaps) {
+    // 25 kHz raster - every point between the frequencies is closer than min_offset
+    // to one of them, so the center has to lie outside of each group
+    vector<int> freqs;
+    for (int f = 118000000; f <= 120000000; f += 25000) {
+        freqs.push_back(f);
+    }
+    vector<ScanPosition> positions = plan_scan_positions(freqs, min_offset, max_offset);
+    assert_valid(freqs, positions);
+    EXPECT_LE(positions.size(), 3);
+}
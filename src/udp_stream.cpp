@@ -8,7 +8,7 @@
 
 #include "rtl_airband.h"
 
-bool udp_stream_init(udp_stream_data* sdata, mix_modes mode, size_t len) {
+bool udp_stream_init(udp_stream_data* sdata, mix_modes mode, int wave_rate, size_t len) {
     // pre-allocate the stereo buffer
     if (mode == MM_STEREO) {
         sdata->stereo_buffer_len = len * 2;
@@ -61,7 +61,7 @@ bool udp_stream_init(udp_stream_data* sdata, mix_modes mode, size_t len) {
         return false;
     }
 
-    log(LOG_INFO, "udp_stream: sending %s 32-bit float at %d Hz to %s:%s\n", mode == MM_MONO ? "Mono" : "Stereo", WAVE_RATE, sdata->dest_address, sdata->dest_port);
+    log(LOG_INFO, "udp_stream: sending %s 32-bit float at %d Hz to %s:%s\n", mode == MM_MONO ? "Mono" : "Stereo", wave_rate, sdata->dest_address, sdata->dest_port);
     return true;
 }
 
@@ -44,42 +44,40 @@ int atomic_get(volatile int* pv) {
     return __sync_fetch_and_add(pv, 0);
 }
 
-void tag_queue_put(device_t* dev, int freq, struct timeval tv) {
-    pthread_mutex_lock(&dev->tag_queue_lock);
-    dev->tq_head++;
-    dev->tq_head %= TAG_QUEUE_LEN;
-    if (dev->tq_head == dev->tq_tail) {
+// The tag queue has a single producer (the scan controller, which moves tq_head) and a
+// single consumer (the output thread, which moves tq_tail), so it needs no lock. Entries
+// are at tq_tail+1 .. tq_head. Each index is only updated after the entry it covers has
+// been written or read.
+void tag_queue_put(device_t* dev, int freq, size_t sample) {
+    const int head = (dev->tq_head + 1) % TAG_QUEUE_LEN;
+    if (head == dev->tq_tail) {
         log(LOG_WARNING, "tag_queue_put: queue overrun\n");
-        dev->tq_tail++;
+        return;
     }
-    dev->tag_queue[dev->tq_head].freq = freq;
-    memcpy(&dev->tag_queue[dev->tq_head].tv, &tv, sizeof(struct timeval));
-    pthread_mutex_unlock(&dev->tag_queue_lock);
+    dev->tag_queue[head].freq = freq;
+    dev->tag_queue[head].sample = sample;
+    __sync_synchronize();
+    dev->tq_head = head;
 }
 
 void tag_queue_get(device_t* dev, struct freq_tag* tag) {
-    int i;
-
     if (!tag)
         return;
-    pthread_mutex_lock(&dev->tag_queue_lock);
-    if (dev->tq_head == dev->tq_tail) { /* empty queue */
+    const int tail = dev->tq_tail;
+    if (dev->tq_head == tail) { /* empty queue */
         tag->freq = -1;
-    } else {
-        // read queue entry at pos tq_tail+1 without dequeueing it
-        i = dev->tq_tail + 1;
-        i %= TAG_QUEUE_LEN;
-        tag->freq = dev->tag_queue[i].freq;
-        memcpy(&tag->tv, &dev->tag_queue[i].tv, sizeof(struct timeval));
+        return;
     }
-    pthread_mutex_unlock(&dev->tag_queue_lock);
+    __sync_synchronize();
+    // read queue entry at pos tq_tail+1 without dequeueing it
+    const int i = (tail + 1) % TAG_QUEUE_LEN;
+    tag->freq = dev->tag_queue[i].freq;
+    tag->sample = dev->tag_queue[i].sample;
 }
 
 void tag_queue_advance(device_t* dev) {
-    pthread_mutex_lock(&dev->tag_queue_lock);
-    dev->tq_tail++;
-    dev->tq_tail %= TAG_QUEUE_LEN;
-    pthread_mutex_unlock(&dev->tag_queue_lock);
+    __sync_synchronize();
+    dev->tq_tail = (dev->tq_tail + 1) % TAG_QUEUE_LEN;
 }
 
 void* xcalloc(size_t nmemb, size_t size, const char* file, const int line, const char* func) {
@@ -178,3 +176,43 @@ float dBFS_to_level(const float& dBFS) {
 float level_to_dBFS(const float& level) {
     return std::min(0.0f, 20.0f * log10f(level / fft_size) + dBFS_offset());
 }
+
+// FFT bin of the given frequency. FFT output starts at the center frequency and wraps
+// around at the lowest one.
+size_t freq_to_fft_bin(const input_t* input, int freq) {
+    return (size_t)ceil((freq + input->sample_rate - input->centerfreq) / (double)(input->sample_rate / fft_size) - 1.0) % fft_size;
+}
+
+// Derotation phase increment which shifts the given frequency to the center of the
+// channel I/Q stream.
+uint32_t downmix_dphi(const input_t* input, int wave_rate, int freq) {
+    double dm_dphi = (double)(freq - input->centerfreq);  // downmix freq in Hz
+
+    // In general, sample_rate is not required to be an integer multiple of the audio rate.
+    // However the FFT window may only slide by an integer number of input samples. A non-zero rounding error
+    // introduces additional phase rotation which we have to compensate in order to shift the channel of interest
+    // to the center of the spectrum of the output I/Q stream. This is important for correct NFM demodulation.
+    // The error value (in Hz):
+    // - has an absolute value 0..wave_rate/2
+    // - is linear with the error introduced by rounding the value of sample_rate/wave_rate to the nearest integer
+    //   (range of -0.5..0.5)
+    // - is linear with the distance between center frequency and the channel frequency, normalized to 0..1
+    double decimation_factor = ((double)input->sample_rate / (double)wave_rate);
+    double dm_dphi_correction = (double)wave_rate / 2.0;
+    dm_dphi_correction *= (decimation_factor - round(decimation_factor));
+    dm_dphi_correction *= (double)(freq - input->centerfreq) / ((double)input->sample_rate / 2.0);
+
+    debug_print("freq %d: dm_dphi: %f Hz dm_dphi_correction: %f Hz\n", freq, dm_dphi, dm_dphi_correction);
+    dm_dphi -= dm_dphi_correction;
+    debug_print("freq %d: dm_dphi_corrected: %f Hz\n", freq, dm_dphi);
+    // Normalize
+    dm_dphi /= (double)wave_rate;
+    // Unalias it, to prevent overflow of int during cast
+    dm_dphi -= trunc(dm_dphi);
+    debug_print("freq %d: dm_dphi_normalized=%f\n", freq, dm_dphi);
+    // Translate this to uint32_t range 0x00000000-0x00ffffff
+    dm_dphi *= 256.0 * 65536.0;
+    // Cast it to signed int first, because casting negative float to uint is not portable
+    debug_print("freq %d: dm_dphi_scaled=%f cast=0x%x\n", freq, dm_dphi, (uint32_t)((int)dm_dphi));
+    return (uint32_t)((int)dm_dphi);
+}
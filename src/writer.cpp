@@ -0,0 +1,297 @@
+/*
+ * writer.cpp
+ * File writer thread
+ *
+ * Copyright (c) 2024 charlie-foxtrot
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>  // posix_memalign()
+#include <string.h>
+#include <sys/time.h>
+#include <syslog.h>  // LOG_INFO
+
+#include "rtl_airband.h"
+
+// With async_file_writes, output threads queue the opening, writing and closing of their
+// files here instead of doing it themselves, so that a slow or stalled disk can't delay the
+// audio of the other outputs. Each open file has a copy of its file_data (wfile) which only
+// the writer thread uses. The writer lets writes accumulate for a while and then merges the
+// consecutive writes of a file into one large write. Once too much data is queued, new data
+// is dropped rather than letting memory grow without bounds.
+
+#define WRITER_LINGER_MS 500  // how long queued writes may wait to be merged
+#define WRITER_ALIGNMENT 4096
+
+enum writer_ops { W_OPEN, W_WRITE, W_CLOSE };
+
+struct writer_job {
+    writer_ops op;
+    file_data* wfile;
+    const channel_t* channel;
+    int is_audio;         // W_OPEN only
+    unsigned char* data;  // W_WRITE only, owned by the job
+    size_t len;
+    writer_job* next;
+};
+
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_work = PTHREAD_COND_INITIALIZER;  // jobs were queued, enough data is queued to write, or the writer is stopping
+static writer_job* queue_head = NULL;
+static writer_job* queue_tail = NULL;
+static int queue_depth = 0;      // jobs queued or being run
+static size_t queued_bytes = 0;  // data of these jobs
+static size_t dropped_bytes = 0;
+static bool writer_exit = false;
+static bool writer_running = false;
+static THREAD writer_thread_id;
+static unsigned char* write_buf = NULL;
+
+static void writer_push(writer_job* job) {
+    job->next = NULL;
+    pthread_mutex_lock(&writer_mutex);
+    const bool was_below = (queued_bytes < WRITER_BUFFER_SIZE);
+    if (queue_tail != NULL) {
+        queue_tail->next = job;
+    } else {
+        queue_head = job;
+    }
+    queue_tail = job;
+    queue_depth++;
+    queued_bytes += job->len;
+    // the writer only needs waking up when it's idle, or when it may stop lingering
+    if (queue_head == job || (was_below && queued_bytes >= WRITER_BUFFER_SIZE)) {
+        pthread_cond_signal(&writer_work);
+    }
+    pthread_mutex_unlock(&writer_mutex);
+}
+
+static void writer_fail(file_data* wfile) {
+    pthread_mutex_lock(&writer_mutex);
+    wfile->io_failed = true;
+    pthread_mutex_unlock(&writer_mutex);
+}
+
+// Writes the data of job and of the writes of the same file which follow it in the list,
+// up to the next job of the file which isn't a write. The merged jobs are removed from the list.
+static void writer_run_write(writer_job* job) {
+    file_data* wfile = job->wfile;
+    if (wfile->f == NULL || wfile->io_failed) {
+        return;  // the file couldn't be opened or written to before
+    }
+    if (job->len >= WRITER_BUFFER_SIZE) {
+        if (!file_io_write(wfile, job->channel, job->data, job->len)) {
+            writer_fail(wfile);
+        }
+        return;
+    }
+
+    memcpy(write_buf, job->data, job->len);
+    size_t len = job->len;
+    writer_job* prev = job;
+    for (writer_job* next = job->next; next != NULL; next = prev->next) {
+        if (next->wfile != wfile) {
+            prev = next;
+            continue;
+        }
+        if (next->op != W_WRITE || len + next->len > WRITER_BUFFER_SIZE) {
+            break;
+        }
+        memcpy(write_buf + len, next->data, next->len);
+        len += next->len;
+        job->len += next->len;  // accounted for with job
+        prev->next = next->next;
+        free(next->data);
+        delete next;
+        pthread_mutex_lock(&writer_mutex);
+        queue_depth--;
+        pthread_mutex_unlock(&writer_mutex);
+    }
+    if (!file_io_write(wfile, job->channel, write_buf, len)) {
+        writer_fail(wfile);
+    }
+}
+
+static void writer_run_job(writer_job* job) {
+    switch (job->op) {
+        case W_OPEN:
+            if (!file_io_open(job->wfile, job->channel, job->is_audio)) {
+                writer_fail(job->wfile);
+            }
+            break;
+        case W_WRITE:
+            writer_run_write(job);
+            break;
+        case W_CLOSE:
+            if (job->wfile->f != NULL) {
+                file_io_close(job->wfile);
+            }
+            delete job->wfile;
+            break;
+    }
+}
+
+static void* writer_thread(void*) {
+    pthread_mutex_lock(&writer_mutex);
+    while (true) {
+        if (queue_head == NULL) {
+            if (writer_exit) {
+                break;
+            }
+            pthread_cond_wait(&writer_work, &writer_mutex);
+            continue;
+        }
+
+        // let more writes come in to be merged, unless there's enough to fill a write already
+        timeval now;
+        gettimeofday(&now, NULL);
+        timespec deadline;
+        deadline.tv_sec = now.tv_sec + WRITER_LINGER_MS / 1000;
+        deadline.tv_nsec = now.tv_usec * 1000 + (WRITER_LINGER_MS % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!writer_exit && queued_bytes < WRITER_BUFFER_SIZE) {
+            if (pthread_cond_timedwait(&writer_work, &writer_mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        writer_job* list = queue_head;
+        queue_head = queue_tail = NULL;
+        pthread_mutex_unlock(&writer_mutex);
+
+        while (list != NULL) {
+            writer_job* job = list;
+            writer_run_job(job);
+            list = job->next;  // read after running it, merged writes are unlinked
+            pthread_mutex_lock(&writer_mutex);
+            queue_depth--;
+            queued_bytes -= job->len;
+            pthread_mutex_unlock(&writer_mutex);
+            free(job->data);
+            delete job;
+        }
+
+        pthread_mutex_lock(&writer_mutex);
+    }
+    pthread_mutex_unlock(&writer_mutex);
+    return 0;
+}
+
+void writer_start(void) {
+    if (posix_memalign((void**)&write_buf, WRITER_ALIGNMENT, WRITER_BUFFER_SIZE) != 0) {
+        log(LOG_ERR, "Could not allocate file writer buffer\n");
+        error();
+    }
+    writer_exit = false;
+    pthread_create(&writer_thread_id, NULL, &writer_thread, NULL);
+    writer_running = true;
+    log(LOG_INFO, "Started file writer thread\n");
+}
+
+// Completes the queued jobs and stops the writer
+void writer_stop(void) {
+    if (!writer_running) {
+        return;
+    }
+    pthread_mutex_lock(&writer_mutex);
+    writer_exit = true;
+    pthread_cond_signal(&writer_work);
+    pthread_mutex_unlock(&writer_mutex);
+    pthread_join(writer_thread_id, NULL);
+    writer_running = false;
+    free(write_buf);
+    write_buf = NULL;
+}
+
+// Queues the opening of the file of fdata, whose path has been set. Returns the copy of
+// fdata used by the writer, to be passed to writer_write() and writer_close().
+file_data* writer_open(const file_data* fdata, const channel_t* channel, int is_audio) {
+    file_data* wfile = new file_data(*fdata);
+    wfile->f = NULL;
+    wfile->wfile = NULL;
+    wfile->io_failed = false;
+
+    writer_job* job = new writer_job;
+    job->op = W_OPEN;
+    job->wfile = wfile;
+    job->channel = channel;
+    job->is_audio = is_audio;
+    job->data = NULL;
+    job->len = 0;
+    writer_push(job);
+    return wfile;
+}
+
+// Queues a copy of data to be written to the file. Returns false if the file could not be
+// opened or written to, in which case it should be closed.
+bool writer_write(file_data* wfile, const channel_t* channel, const void* data, size_t len) {
+    if (len == 0) {
+        return true;
+    }
+    pthread_mutex_lock(&writer_mutex);
+    const bool failed = wfile->io_failed;
+    const bool drop = (queued_bytes + len > WRITER_MAX_QUEUED_BYTES);
+    const bool first_drop = (drop && dropped_bytes == 0);
+    if (drop) {
+        dropped_bytes += len;
+    }
+    pthread_mutex_unlock(&writer_mutex);
+
+    if (failed) {
+        return false;
+    }
+    if (drop) {
+        if (first_drop) {
+            log(LOG_WARNING, "File writes are not keeping up, dropping data of %s and others\n", wfile->file_path.c_str());
+        }
+        return true;
+    }
+
+    writer_job* job = new writer_job;
+    job->op = W_WRITE;
+    job->wfile = wfile;
+    job->channel = channel;
+    job->is_audio = 0;
+    job->data = (unsigned char*)XCALLOC(len, 1);
+    memcpy(job->data, data, len);
+    job->len = len;
+    writer_push(job);
+    return true;
+}
+
+// Queues the closing of the file. The writer frees wfile afterwards.
+void writer_close(file_data* wfile) {
+    writer_job* job = new writer_job;
+    job->op = W_CLOSE;
+    job->wfile = wfile;
+    job->channel = NULL;
+    job->is_audio = 0;
+    job->data = NULL;
+    job->len = 0;
+    writer_push(job);
+}
+
+void writer_get_stats(writer_stats* stats) {
+    pthread_mutex_lock(&writer_mutex);
+    stats->queue_depth = queue_depth;
+    stats->queued_bytes = queued_bytes;
+    stats->dropped_bytes = dropped_bytes;
+    pthread_mutex_unlock(&writer_mutex);
+}